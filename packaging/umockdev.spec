@@ -49,7 +49,8 @@ export SLOW_TESTBED_FACTOR=10
 
 # Remove rpath
 chrpath --delete %{buildroot}%{_bindir}/umockdev-record \
-	%{buildroot}%{_bindir}/umockdev-run
+	%{buildroot}%{_bindir}/umockdev-run \
+	%{buildroot}%{_bindir}/umockdev-uevent-storm
 chrpath --delete %{buildroot}%{_libdir}/libumockdev.so.*
 chrpath --delete %{buildroot}%{_libdir}/libumockdev-preload.so.*
 
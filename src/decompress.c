@@ -0,0 +1,282 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * decompress.c - Open recordings which are optionally xz or zstd compressed
+ *
+ * The compression format gets detected from the file contents, and the data
+ * is decompressed while it is being read through the returned FILE, so that
+ * large recordings never need to be in memory as a whole. This uses liblzma
+ * and libzstd if available, and otherwise falls back to reading from the xz
+ * or zstd programs.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#include "config.h"
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "debug.h"
+#include "decompress.h"
+
+#define INBUF_SIZE 65536
+
+static const unsigned char xz_magic[] = { 0xFD, '7', 'z', 'X', 'Z', 0x00 };
+static const unsigned char zstd_magic[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+typedef struct {
+    FILE *in;
+    unsigned char inbuf[INBUF_SIZE];
+#ifdef HAVE_LZMA
+    lzma_stream lzma;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd;
+    ZSTD_inBuffer zstd_in;
+#endif
+    bool done;
+} decompress_cookie;
+
+static int
+cookie_close(void *c)
+{
+    decompress_cookie *cookie = c;
+    int res = fclose(cookie->in);
+#ifdef HAVE_LZMA
+    lzma_end(&cookie->lzma);
+#endif
+#ifdef HAVE_ZSTD
+    if (cookie->zstd != NULL)
+	ZSTD_freeDStream(cookie->zstd);
+#endif
+    free(cookie);
+    return res;
+}
+
+#if defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+static FILE *
+open_cookie(decompress_cookie *cookie, cookie_io_functions_t funcs)
+{
+    FILE *f = fopencookie(cookie, "r", funcs);
+    if (f == NULL)
+	cookie_close(cookie);
+    return f;
+}
+#endif
+
+#ifdef HAVE_LZMA
+static ssize_t
+xz_read(void *c, char *buf, size_t size)
+{
+    decompress_cookie *cookie = c;
+    lzma_stream *s = &cookie->lzma;
+
+    if (cookie->done)
+	return 0;
+
+    s->next_out = (uint8_t *) buf;
+    s->avail_out = size;
+    while (s->avail_out > 0) {
+	lzma_ret ret;
+
+	if (s->avail_in == 0 && !feof(cookie->in)) {
+	    s->next_in = cookie->inbuf;
+	    s->avail_in = fread(cookie->inbuf, 1, sizeof(cookie->inbuf), cookie->in);
+	    if (ferror(cookie->in))
+		return -1;
+	}
+
+	ret = lzma_code(s, feof(cookie->in) ? LZMA_FINISH : LZMA_RUN);
+	if (ret == LZMA_STREAM_END) {
+	    cookie->done = true;
+	    break;
+	}
+	if (ret != LZMA_OK) {
+	    DBG(DBG_IOCTL, "decompress: xz decoding failed with code %i\n", (int) ret);
+	    errno = EIO;
+	    return -1;
+	}
+    }
+    return size - s->avail_out;
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static ssize_t
+zstd_read(void *c, char *buf, size_t size)
+{
+    decompress_cookie *cookie = c;
+    ZSTD_outBuffer out = { buf, size, 0 };
+
+    while (out.pos < out.size && !cookie->done) {
+	size_t ret;
+
+	if (cookie->zstd_in.pos == cookie->zstd_in.size && !feof(cookie->in)) {
+	    cookie->zstd_in.src = cookie->inbuf;
+	    cookie->zstd_in.pos = 0;
+	    cookie->zstd_in.size = fread(cookie->inbuf, 1, sizeof(cookie->inbuf), cookie->in);
+	    if (ferror(cookie->in))
+		return -1;
+	}
+
+	ret = ZSTD_decompressStream(cookie->zstd, &out, &cookie->zstd_in);
+	if (ZSTD_isError(ret)) {
+	    DBG(DBG_IOCTL, "decompress: zstd decoding failed: %s\n", ZSTD_getErrorName(ret));
+	    errno = EIO;
+	    return -1;
+	}
+
+	if (cookie->zstd_in.pos == cookie->zstd_in.size && feof(cookie->in) && out.pos < out.size) {
+	    /* all input consumed and all output flushed; this must be at the
+	     * end of a frame, otherwise the file is truncated */
+	    if (ret != 0 && out.pos == 0) {
+		DBG(DBG_IOCTL, "decompress: zstd data is truncated\n");
+		errno = EIO;
+		return -1;
+	    }
+	    cookie->done = (ret == 0);
+	    break;
+	}
+    }
+    return out.pos;
+}
+#endif
+
+#if !defined(HAVE_LZMA) || !defined(HAVE_ZSTD)
+static int
+popen_close(void *c)
+{
+    return pclose(c) == 0 ? 0 : EOF;
+}
+
+static ssize_t
+popen_read(void *c, char *buf, size_t size)
+{
+    size_t n = fread(buf, 1, size, c);
+    return (n == 0 && ferror((FILE *) c)) ? -1 : (ssize_t) n;
+}
+
+/* fall back to the command line tool if the library is not available */
+static FILE *
+open_with_program(const char *program, const char *path)
+{
+    cookie_io_functions_t funcs = { popen_read, NULL, NULL, popen_close };
+    size_t len = strlen(program) + sizeof(" -cd ''");
+    char *cmd, *q;
+    FILE *pipe, *f;
+
+    /* quote the path for the shell */
+    for (const char *p = path; *p; ++p)
+	len += (*p == '\'') ? 4 : 1;
+    cmd = malloc(len);
+    if (cmd == NULL)
+	return NULL;
+    q = cmd + sprintf(cmd, "%s -cd '", program);
+    for (const char *p = path; *p; ++p) {
+	if (*p == '\'') {
+	    memcpy(q, "'\\''", 4);
+	    q += 4;
+	} else {
+	    *q++ = *p;
+	}
+    }
+    strcpy(q, "'");
+
+    pipe = popen(cmd, "re");
+    free(cmd);
+    if (pipe == NULL)
+	return NULL;
+    f = fopencookie(pipe, "r", funcs);
+    if (f == NULL)
+	pclose(pipe);
+    return f;
+}
+#endif
+
+/**
+ * decompress_fopen:
+ *
+ * Open path for reading. If it is xz or zstd compressed, the returned FILE
+ * transparently provides the decompressed data. Returns NULL with errno set on
+ * failure.
+ */
+FILE *
+decompress_fopen(const char *path)
+{
+    unsigned char magic[sizeof(xz_magic)];
+    size_t magic_len;
+    bool is_xz, is_zstd;
+    decompress_cookie *cookie;
+    FILE *in;
+
+    in = fopen(path, "re");
+    if (in == NULL)
+	return NULL;
+
+    magic_len = fread(magic, 1, sizeof(magic), in);
+    is_xz = magic_len >= sizeof(xz_magic) && memcmp(magic, xz_magic, sizeof(xz_magic)) == 0;
+    is_zstd = magic_len >= sizeof(zstd_magic) && memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0;
+    rewind(in);
+    if (!is_xz && !is_zstd)
+	return in;
+
+#ifndef HAVE_LZMA
+    if (is_xz) {
+	fclose(in);
+	return open_with_program("xz", path);
+    }
+#endif
+#ifndef HAVE_ZSTD
+    if (is_zstd) {
+	fclose(in);
+	return open_with_program("zstd", path);
+    }
+#endif
+
+    cookie = calloc(1, sizeof(decompress_cookie));
+    if (cookie == NULL) {
+	fclose(in);
+	return NULL;
+    }
+    cookie->in = in;
+
+#ifdef HAVE_LZMA
+    cookie->lzma = (lzma_stream) LZMA_STREAM_INIT;
+    if (is_xz) {
+	cookie_io_functions_t funcs = { xz_read, NULL, NULL, cookie_close };
+	if (lzma_stream_decoder(&cookie->lzma, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+	    cookie_close(cookie);
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	return open_cookie(cookie, funcs);
+    }
+#endif
+
+#ifdef HAVE_ZSTD
+    if (is_zstd) {
+	cookie_io_functions_t funcs = { zstd_read, NULL, NULL, cookie_close };
+	cookie->zstd = ZSTD_createDStream();
+	if (cookie->zstd == NULL || ZSTD_isError(ZSTD_initDStream(cookie->zstd))) {
+	    cookie_close(cookie);
+	    errno = ENOMEM;
+	    return NULL;
+	}
+	return open_cookie(cookie, funcs);
+    }
+#endif
+
+    /* not reached */
+    cookie_close(cookie);
+    errno = EINVAL;
+    return NULL;
+}
@@ -0,0 +1,10 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * decompress.h - Open recordings which are optionally xz or zstd compressed
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+FILE *decompress_fopen(const char *path);
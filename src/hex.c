@@ -0,0 +1,189 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * hex.c - Fast conversion between binary data and hex strings
+ *
+ * Recordings and device dumps store binary data as hex strings, and URB or
+ * SPI payloads can be megabytes large. This converts 16 bytes at a time with
+ * SSE2 on x86_64 and NEON on aarch64 (both are always available there), with
+ * a scalar implementation for the remainder and for other architectures.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "utils.h"
+#include "hex.h"
+
+static const char hex_upper[] = "0123456789ABCDEF";
+static const char hex_lower[] = "0123456789abcdef";
+
+static inline int
+hexdigit(char c)
+{
+    if (c >= '0' && c <= '9')
+	return c - '0';
+    if (c >= 'A' && c <= 'F')
+	return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+	return c - 'a' + 10;
+    return -1;
+}
+
+/**
+ * hex_encode:
+ *
+ * Write the 2 * len hex digits of data into out, without a terminating NUL.
+ */
+void
+hex_encode(const void *data, size_t len, char *out, bool lowercase)
+{
+    const uint8_t *src = data;
+    const char *digits = lowercase ? hex_lower : hex_upper;
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    /* distance from '9' + 1 to 'A' or 'a' */
+    const __m128i letter = _mm_set1_epi8(lowercase ? 'a' - '0' - 10 : 'A' - '0' - 10);
+
+    for (; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i lo = _mm_and_si128(v, mask);
+
+	hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), letter));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), letter));
+	_mm_storeu_si128((__m128i *) (out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *) (out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    const uint8x16_t table = vld1q_u8((const uint8_t *) digits);
+
+    for (; i + 16 <= len; i += 16) {
+	uint8x16_t v = vld1q_u8(src + i);
+	uint8x16x2_t chars;
+
+	chars.val[0] = vqtbl1q_u8(table, vshrq_n_u8(v, 4));
+	chars.val[1] = vqtbl1q_u8(table, vandq_u8(v, vdupq_n_u8(0x0F)));
+	vst2q_u8((uint8_t *) out + 2 * i, chars);
+    }
+#endif
+
+    for (; i < len; ++i) {
+	out[2 * i] = digits[src[i] >> 4];
+	out[2 * i + 1] = digits[src[i] & 0x0F];
+    }
+}
+
+/**
+ * hex_encode_string:
+ *
+ * Return a newly allocated NUL terminated string with the hex digits of data.
+ */
+char *
+hex_encode_string(const void *data, size_t len, bool lowercase)
+{
+    char *result = mallocx(2 * len + 1);
+
+    hex_encode(data, len, result, lowercase);
+    result[2 * len] = '\0';
+    return result;
+}
+
+#if defined(__SSE2__)
+/* convert 16 hex digits to their values; set *valid to a bit mask of the
+ * valid ones */
+static inline __m128i
+hex_values_sse2(__m128i c, int *valid)
+{
+    /* all valid characters are ASCII, i. e. positive as signed chars */
+    __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8('0' - 1)),
+				     _mm_cmplt_epi8(c, _mm_set1_epi8('9' + 1)));
+    __m128i l = _mm_or_si128(c, _mm_set1_epi8(0x20));
+    __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+				      _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+
+    *valid = _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+    return _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+			_mm_and_si128(is_letter, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+}
+
+/* combine pairs of digit values into bytes, in the low bytes of each 16 bit lane */
+static inline __m128i
+hex_pairs_sse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, _mm_set1_epi16(0x00FF)), 4),
+			_mm_srli_epi16(v, 8));
+}
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+static inline uint8x16_t
+hex_values_neon(uint8x16_t c, uint8x16_t *valid)
+{
+    uint8x16_t d = vsubq_u8(c, vdupq_n_u8('0'));
+    uint8x16_t l = vsubq_u8(vorrq_u8(c, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+    uint8x16_t is_digit = vcltq_u8(d, vdupq_n_u8(10));
+    uint8x16_t is_letter = vcltq_u8(l, vdupq_n_u8(6));
+
+    *valid = vandq_u8(*valid, vorrq_u8(is_digit, is_letter));
+    return vbslq_u8(is_digit, d, vaddq_u8(l, vdupq_n_u8(10)));
+}
+#endif
+
+/**
+ * hex_decode:
+ *
+ * Decode up to len hex digits (upper or lower case) into buf, which must have
+ * space for len / 2 bytes. Stops at the first character which is not a hex
+ * digit. Returns the number of hex digits which were read; if that is odd, the
+ * last one did not get decoded as it has no partner.
+ */
+size_t
+hex_decode(const char *hex, size_t len, void *buf)
+{
+    uint8_t *dest = buf;
+    size_t i = 0;
+    int hi, lo;
+
+#if defined(__SSE2__)
+    for (; i + 32 <= len; i += 32) {
+	int valid1, valid2;
+	__m128i v1 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (hex + i)), &valid1);
+	__m128i v2 = hex_values_sse2(_mm_loadu_si128((const __m128i *) (hex + i + 16)), &valid2);
+
+	/* let the scalar code find the end */
+	if ((valid1 & valid2) != 0xFFFF)
+	    break;
+	_mm_storeu_si128((__m128i *) (dest + i / 2), _mm_packus_epi16(hex_pairs_sse2(v1), hex_pairs_sse2(v2)));
+    }
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+    for (; i + 32 <= len; i += 32) {
+	uint8x16x2_t c = vld2q_u8((const uint8_t *) hex + i);
+	uint8x16_t valid = vdupq_n_u8(0xFF);
+	uint8x16_t v_hi = hex_values_neon(c.val[0], &valid);
+	uint8x16_t v_lo = hex_values_neon(c.val[1], &valid);
+
+	if (vminvq_u8(valid) == 0)
+	    break;
+	vst1q_u8(dest + i / 2, vorrq_u8(vshlq_n_u8(v_hi, 4), v_lo));
+    }
+#endif
+
+    for (; i + 1 < len; i += 2) {
+	if ((hi = hexdigit(hex[i])) < 0)
+	    return i;
+	if ((lo = hexdigit(hex[i + 1])) < 0)
+	    return i + 1;
+	dest[i / 2] = hi << 4 | lo;
+    }
+    if (i < len && hexdigit(hex[i]) >= 0)
+	++i;
+    return i;
+}
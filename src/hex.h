@@ -0,0 +1,13 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * hex.h - Fast conversion between binary data and hex strings
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void hex_encode(const void *data, size_t len, char *out, bool lowercase);
+char *hex_encode_string(const void *data, size_t len, bool lowercase);
+size_t hex_decode(const char *hex, size_t len, void *buf);
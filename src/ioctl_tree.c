@@ -23,6 +23,11 @@
 #include <assert.h>
 #include <errno.h>
 #include <err.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/ioctl.h>
 #include <linux/usbdevice_fs.h>
 #include <linux/input.h>
@@ -31,6 +36,7 @@
 #include "debug.h"
 #include "utils.h"
 #include "cros_ec.h"
+#include "hex.h"
 #include "ioctl_tree.h"
 
 #define TRUE 1
@@ -45,6 +51,299 @@
  *
  ***********************************/
 
+/* Arena for the nodes and their data of trees which are read from a file, so
+ * that loading allocates in large chunks, the data of neighbouring nodes is
+ * contiguous, and freeing the tree only needs to free the chunks. Nodes which
+ * get inserted later are allocated separately. */
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN 16
+
+struct ioctl_arena_chunk {
+    struct ioctl_arena_chunk *prev;
+    size_t used;
+    size_t size;
+};
+
+struct ioctl_arena {
+    struct ioctl_arena_chunk *chunk;	/* current chunk, linked to the older ones */
+    size_t n_heap_nodes;	/* number of separately allocated nodes in the tree */
+};
+
+#define ARENA_HEADER_SIZE ((sizeof(struct ioctl_arena_chunk) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1))
+
+static struct ioctl_arena_chunk *
+ioctl_arena_chunk_new(size_t size)
+{
+    struct ioctl_arena_chunk *chunk = mallocx(ARENA_HEADER_SIZE + size);
+    chunk->used = 0;
+    chunk->size = size;
+    return chunk;
+}
+
+/* return zeroed memory */
+static void *
+ioctl_arena_alloc(struct ioctl_arena *arena, size_t size)
+{
+    struct ioctl_arena_chunk *chunk = arena->chunk;
+    size_t aligned;
+    void *p;
+
+    /* the chunk size would overflow; this can never succeed, so let
+     * callocx() fail cleanly */
+    if (size > SIZE_MAX - ARENA_HEADER_SIZE - ARENA_ALIGN)
+	return callocx(size, 1);
+
+    aligned = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+    if (aligned > ARENA_CHUNK_SIZE / 4) {
+	/* large blocks get their own chunk, behind the current one */
+	struct ioctl_arena_chunk *large = ioctl_arena_chunk_new(aligned);
+	large->used = aligned;
+	if (chunk != NULL) {
+	    large->prev = chunk->prev;
+	    chunk->prev = large;
+	} else {
+	    large->prev = NULL;
+	    arena->chunk = large;
+	}
+	chunk = large;
+	p = (char *) chunk + ARENA_HEADER_SIZE;
+    } else {
+	if (chunk == NULL || chunk->size - chunk->used < aligned) {
+	    chunk = ioctl_arena_chunk_new(ARENA_CHUNK_SIZE);
+	    chunk->prev = arena->chunk;
+	    arena->chunk = chunk;
+	}
+	p = (char *) chunk + ARENA_HEADER_SIZE + chunk->used;
+	chunk->used += aligned;
+    }
+
+    memset(p, 0, size);
+    return p;
+}
+
+static void
+ioctl_arena_free(struct ioctl_arena *arena)
+{
+    struct ioctl_arena_chunk *chunk, *prev;
+
+    for (chunk = arena->chunk; chunk != NULL; chunk = prev) {
+	prev = chunk->prev;
+	free(chunk);
+    }
+    free(arena);
+}
+
+/* allocate memory for node's data; from its tree's arena, if it has one */
+static void *
+ioctl_node_alloc(ioctl_tree * node, size_t size)
+{
+    return node->arena != NULL ? ioctl_arena_alloc(node->arena, size) : callocx(size, 1);
+}
+
+static void
+ioctl_node_free(ioctl_tree * node, void *p)
+{
+    if (node->arena == NULL)
+	free(p);
+}
+
+/* Index of the nodes which can handle a particular ioctl request id, in
+ * pre-order, so that ioctl_tree_execute() does not need to walk through the
+ * whole tree. Open addressing hash table. */
+typedef struct {
+    IOCTL_REQUEST_TYPE id;
+    ioctl_node_list *nodes;	/* NULL for unused slots */
+} ioctl_id_index_entry;
+
+struct ioctl_id_index {
+    size_t size;		/* power of two */
+    size_t n;
+    ioctl_id_index_entry *entries;
+};
+
+static size_t
+ioctl_id_index_slot(const struct ioctl_id_index *index, IOCTL_REQUEST_TYPE id)
+{
+    size_t i = ((uint32_t) id * 2654435761u) & (index->size - 1);
+
+    while (index->entries[i].nodes != NULL && index->entries[i].id != id)
+	i = (i + 1) & (index->size - 1);
+    return i;
+}
+
+static void
+ioctl_id_index_add(struct ioctl_id_index *index, IOCTL_REQUEST_TYPE id, ioctl_tree * node)
+{
+    size_t i;
+
+    /* keep the load factor below 1/2 */
+    if (2 * (index->n + 1) > index->size) {
+	ioctl_id_index_entry *old = index->entries;
+	size_t old_size = index->size;
+
+	index->size = old_size ? old_size * 2 : 16;
+	index->entries = callocx(index->size, sizeof(ioctl_id_index_entry));
+	for (size_t j = 0; j < old_size; ++j)
+	    if (old[j].nodes != NULL)
+		index->entries[ioctl_id_index_slot(index, old[j].id)] = old[j];
+	free(old);
+    }
+
+    i = ioctl_id_index_slot(index, id);
+    if (index->entries[i].nodes == NULL) {
+	index->entries[i].id = id;
+	index->entries[i].nodes = ioctl_node_list_new();
+	index->n++;
+    }
+    ioctl_node_list_append(index->entries[i].nodes, node);
+}
+
+static void
+ioctl_id_index_free(struct ioctl_id_index *index)
+{
+    if (index == NULL)
+	return;
+    for (size_t i = 0; i < index->size; ++i)
+	if (index->entries[i].nodes != NULL)
+	    ioctl_node_list_free(index->entries[i].nodes);
+    free(index->entries);
+    free(index);
+}
+
+static void
+ioctl_tree_build_id_index(ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node;
+    size_t seq = 0;
+
+    assert(tree->id_index == NULL);
+    tree->id_index = callocx(1, sizeof(struct ioctl_id_index));
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = ioctl_tree_cursor_next(&cursor)) {
+	node->seq = seq++;
+	if (node->type->execute != NULL) {
+	    ioctl_id_index_add(tree->id_index, node->id, node);
+	    if (node->type->execute_also_id != 0 && node->type->execute_also_id != node->id)
+		ioctl_id_index_add(tree->id_index, node->type->execute_also_id, node);
+	}
+    }
+}
+
+/* return the indexed nodes for the given id, or NULL */
+static ioctl_node_list *
+ioctl_tree_id_index_get(ioctl_tree * tree, IOCTL_REQUEST_TYPE id)
+{
+    size_t i;
+
+    if (tree->id_index == NULL)
+	ioctl_tree_build_id_index(tree);
+    if (tree->id_index->size == 0)
+	return NULL;
+    i = ioctl_id_index_slot(tree->id_index, id);
+    return tree->id_index->entries[i].nodes;
+}
+
+/* Index of all nodes by their content hash, so that ioctl_tree_insert() can
+ * find an equal node without calling equal() on every node of the tree. Open
+ * addressing hash table; nodes with the same hash are all kept. */
+struct ioctl_dedup_index {
+    size_t size;		/* power of two */
+    size_t n;
+    ioctl_tree **nodes;		/* NULL for unused slots */
+};
+
+/* FNV-1a */
+static uint32_t
+hash_bytes(uint32_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; ++i)
+	h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+#define HASH_INIT 2166136261u
+
+static uint32_t
+ioctl_tree_node_hash(const ioctl_tree * node)
+{
+    uint32_t h;
+
+    if (node->type->hash == NULL)
+	return 0;
+    h = node->type->hash(node);
+    if (h == 0)
+	return 0;
+    /* ioctl_tree_find_equal() also requires the same id */
+    h = hash_bytes(h, &node->id, sizeof(node->id));
+    return h ? h : 1;
+}
+
+static void
+ioctl_dedup_index_add(struct ioctl_dedup_index *index, ioctl_tree * node)
+{
+    size_t i;
+
+    if (node->hash == 0)
+	return;
+
+    /* keep the load factor below 1/2 */
+    if (2 * (index->n + 1) > index->size) {
+	ioctl_tree **old = index->nodes;
+	size_t old_size = index->size;
+
+	index->size = old_size ? old_size * 2 : 64;
+	index->nodes = callocx(index->size, sizeof(ioctl_tree *));
+	for (size_t j = 0; j < old_size; ++j) {
+	    if (old[j] == NULL)
+		continue;
+	    for (i = old[j]->hash & (index->size - 1); index->nodes[i] != NULL; i = (i + 1) & (index->size - 1));
+	    index->nodes[i] = old[j];
+	}
+	free(old);
+    }
+
+    for (i = node->hash & (index->size - 1); index->nodes[i] != NULL; i = (i + 1) & (index->size - 1));
+    index->nodes[i] = node;
+    index->n++;
+}
+
+static ioctl_tree *
+ioctl_dedup_index_find(const struct ioctl_dedup_index *index, const ioctl_tree * node)
+{
+    if (node->hash == 0 || index->size == 0)
+	return NULL;
+
+    for (size_t i = node->hash & (index->size - 1); index->nodes[i] != NULL; i = (i + 1) & (index->size - 1)) {
+	ioctl_tree *t = index->nodes[i];
+	/* only compare the contents on hash collisions */
+	if (t->hash == node->hash && t->id == node->id && node->type->equal(node, t))
+	    return t;
+    }
+    return NULL;
+}
+
+static void
+ioctl_dedup_index_free(struct ioctl_dedup_index *index)
+{
+    if (index == NULL)
+	return;
+    free(index->nodes);
+    free(index);
+}
+
+static void
+ioctl_dedup_index_add_tree(struct ioctl_dedup_index *index, ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node;
+
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = ioctl_tree_cursor_next(&cursor)) {
+	node->hash = ioctl_tree_node_hash(node);
+	ioctl_dedup_index_add(index, node);
+    }
+}
+
 ioctl_tree *
 ioctl_tree_new_from_bin(IOCTL_REQUEST_TYPE id, const void *data, int ret)
 {
@@ -68,8 +367,9 @@ ioctl_tree_new_from_bin(IOCTL_REQUEST_TYPE id, const void *data, int ret)
     return t;
 }
 
-ioctl_tree *
-ioctl_tree_new_from_text(const char *line)
+/* allocate the node and its data from arena, if it is not NULL */
+static ioctl_tree *
+ioctl_tree_new_from_text_arena(const char *line, struct ioctl_arena *arena)
 {
     static char lead_ws[1001];
     static char ioctl_name[101];
@@ -97,33 +397,69 @@ ioctl_tree_new_from_text(const char *line)
 	return NULL;
     }
 
-    t = callocx(sizeof(ioctl_tree), 1);
+    t = arena != NULL ? ioctl_arena_alloc(arena, sizeof(ioctl_tree)) : callocx(sizeof(ioctl_tree), 1);
+    t->arena = arena;
     t->type = type;
     t->depth = strlen(lead_ws);
     t->ret = ret;
     t->id = id;
     if (!type->init_from_text(t, line + offset)) {
 	DBG(DBG_IOCTL_TREE, "ioctl_tree_new_from_text: ioctl %s failed to initialize from data '%s'\n", ioctl_name, line + offset);
-	free(t);
+	ioctl_node_free(t, t);
 	return NULL;
     }
     return t;
 }
 
+ioctl_tree *
+ioctl_tree_new_from_text(const char *line)
+{
+    return ioctl_tree_new_from_text_arena(line, NULL);
+}
+
+static void
+ioctl_tree_free_nodes(ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node, *next;
+
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = next) {
+	next = ioctl_tree_cursor_next(&cursor);
+	/* nodes in an arena get freed together with it */
+	if (node->arena != NULL)
+	    continue;
+	if (node->type != NULL && node->type->free_data != NULL)
+	    node->type->free_data(node);
+	free(node);
+    }
+}
+
 void
 ioctl_tree_free(ioctl_tree * tree)
 {
+    struct ioctl_arena *arena;
+
     if (tree == NULL)
 	return;
 
-    ioctl_tree_free(tree->child);
-    ioctl_tree_free(tree->next);
-    if (tree->type != NULL && tree->type->free_data != NULL)
-	tree->type->free_data(tree);
+    ioctl_id_index_free(tree->id_index);
+    ioctl_dedup_index_free(tree->dedup_index);
     if (tree->last_added != NULL)
 	ioctl_node_list_free(tree->last_added);
 
-    free(tree);
+    /* compiled trees are one block, see ioctl_tree_read_compiled() */
+    if (tree->compiled_map != NULL) {
+	munmap(tree->compiled_map, tree->compiled_map_size);
+	free(tree);
+	return;
+    }
+
+    /* only walk trees which were read from a file if nodes got inserted later */
+    arena = tree->arena;
+    if (arena == NULL || arena->n_heap_nodes > 0)
+	ioctl_tree_free_nodes(tree);
+    if (arena != NULL)
+	ioctl_arena_free(arena);
 }
 
 static ioctl_tree *
@@ -151,13 +487,26 @@ ioctl_tree_insert(ioctl_tree * tree, ioctl_tree * node)
     if (tree == NULL) {
 	node->last_added = ioctl_node_list_new();
 	ioctl_node_list_append(node->last_added, node);
+	node->last_sibling = ioctl_tree_last_sibling(node);
+	node->dedup_index = callocx(1, sizeof(struct ioctl_dedup_index));
+	node->hash = ioctl_tree_node_hash(node);
+	ioctl_dedup_index_add(node->dedup_index, node);
 	return node;
     }
 
     /* trying to insert into itself? */
     assert(tree != node);
+    /* compiled trees are read-only */
+    assert(tree->compiled_map == NULL);
 
-    existing = ioctl_tree_find_equal(tree, node);
+    /* index trees which were read from a file on the first insertion */
+    if (tree->dedup_index == NULL) {
+	tree->dedup_index = callocx(1, sizeof(struct ioctl_dedup_index));
+	ioctl_dedup_index_add_tree(tree->dedup_index, tree);
+    }
+
+    node->hash = ioctl_tree_node_hash(node);
+    existing = ioctl_dedup_index_find(tree->dedup_index, node);
     if (existing) {
 	DBG(DBG_IOCTL_TREE, "ioctl_tree_insert: node of type %s ptr %p already exists\n", node->type->name, node);
 	ioctl_node_list_append(tree->last_added, existing);
@@ -165,6 +514,10 @@ ioctl_tree_insert(ioctl_tree * tree, ioctl_tree * node)
 	return tree;
     }
 
+    /* the tree changes, rebuild the index on the next execution */
+    ioctl_id_index_free(tree->id_index);
+    tree->id_index = NULL;
+
     node->parent = node->type->insertion_parent(tree, node);
     if (node->parent == NULL)
 	errx(EXIT_FAILURE, "ioctl_tree_insert: did not get insertion parent for node type %s ptr %p",
@@ -173,17 +526,28 @@ ioctl_tree_insert(ioctl_tree * tree, ioctl_tree * node)
     /* if the parent is the whole tree, then we put it as a sibling, not a
      * child */
     if (node->parent == tree) {
-	ioctl_tree_last_sibling(tree)->next = node;
+	/* trees which were not built by ioctl_tree_read() or inserting */
+	if (tree->last_sibling == NULL)
+	    tree->last_sibling = ioctl_tree_last_sibling(tree);
+	tree->last_sibling->next = node;
+	tree->last_sibling = node;
 	node->depth = 0;
     } else {
 	if (node->parent->child == NULL)
 	    node->parent->child = node;
-	else
-	    ioctl_tree_last_sibling(node->parent->child)->next = node;
+	else {
+	    if (node->parent->last_child == NULL)
+		node->parent->last_child = ioctl_tree_last_sibling(node->parent->child);
+	    node->parent->last_child->next = node;
+	}
+	node->parent->last_child = node;
 
 	node->depth = node->parent->depth + 1;
     }
 
+    if (tree->arena != NULL)
+	tree->arena->n_heap_nodes++;
+    ioctl_dedup_index_add(tree->dedup_index, node);
     ioctl_node_list_append(tree->last_added, node);
     return tree;
 }
@@ -194,43 +558,58 @@ ioctl_tree_read(FILE * f)
     ioctl_tree *tree = NULL;
     ioctl_tree *node, *prev = NULL;
     ioctl_tree *sibling;
+    struct ioctl_arena *arena = callocx(1, sizeof(struct ioctl_arena));
     char *line = NULL;
     size_t line_len;
+    unsigned int repeat = 0;
 
     while (getline(&line, &line_len, f) >= 0) {
 	/* skip empty and comment lines */
 	if (line[0] == '\n' || line[0] == '#')
 	    continue;
 
+	/* repeat count of the next node, see ioctl_tree_compact() */
+	if (sscanf(line, "@REPEAT %u", &repeat) == 1)
+	    continue;
+
         /* skip lines with metadata */
         if (line[0] == '@')
             continue;
 
-	node = ioctl_tree_new_from_text(line);
+	node = ioctl_tree_new_from_text_arena(line, arena);
 	if (node == NULL) {
 	    DBG(DBG_IOCTL_TREE, "ioctl_tree_read: failure to parse line: %s", line);
 	    free(line);
 	    line = NULL;
 	    break;
 	}
+	node->repeat = repeat;
+	repeat = 0;
 
 	if (tree == NULL) {
 	    tree = node;
 	    node->last_added = ioctl_node_list_new();
+	    node->last_sibling = node;
 	} else {
 	    /* insert at the right depth */
 	    if (node->depth > prev->depth) {
 		assert(node->depth == prev->depth + 1);
 		assert(prev->child == NULL);
 		prev->child = node;
+		prev->last_child = node;
 		node->parent = prev;
 	    } else {
+		/* the tail of the list at node's depth is the last node at that
+		 * depth on the path from prev up to the root */
 		for (sibling = prev; sibling != NULL; sibling = sibling->parent) {
 		    if (node->depth == sibling->depth) {
 			assert(sibling->next == NULL);
 			sibling->next = node;
-			//ioctl_tree_last_sibling (sibling)->next = node;
 			node->parent = sibling->parent;
+			if (node->parent != NULL)
+			    node->parent->last_child = node;
+			else
+			    tree->last_sibling = node;
 			break;
 		    }
 		}
@@ -244,52 +623,114 @@ ioctl_tree_read(FILE * f)
     if (line != NULL)
 	free(line);
 
+    if (tree != NULL)
+	ioctl_tree_build_id_index(tree);
+    else
+	ioctl_arena_free(arena);
+
     return tree;
 }
 
-void
-ioctl_tree_write(FILE * f, const ioctl_tree * tree)
+/* write a single node without indentation */
+static void
+ioctl_tree_write_node(FILE * f, const ioctl_tree * node)
 {
     int res;
-    if (tree == NULL)
-	return;
 
-    /* write indent */
-    for (int i = 0; i < tree->depth; ++i)
-	fputc(' ', f);
-    if (tree->id != tree->type->id) {
+    if (node->id != node->type->id) {
 	long offset;
-	offset = _IOC_NR(tree->id) - _IOC_NR(tree->type->id);
+	offset = _IOC_NR(node->id) - _IOC_NR(node->type->id);
 	assert(offset >= 0);
-	assert(offset <= tree->type->nr_range);
-	fprintf(f, "%s(%li) %i ", tree->type->name, offset, tree->ret);
+	assert(offset <= node->type->nr_range);
+	fprintf(f, "%s(%li) %i ", node->type->name, offset, node->ret);
     } else {
-	fprintf(f, "%s %i ", tree->type->name, tree->ret);
+	fprintf(f, "%s %i ", node->type->name, node->ret);
     }
-    tree->type->write(tree, f);
+    node->type->write(node, f);
     res = fputc('\n', f);
     assert(res == '\n');
+}
+
+void
+ioctl_tree_write(FILE * f, const ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node;
+
+    /* the cursor does not modify the tree */
+    for (node = ioctl_tree_cursor_init(&cursor, (ioctl_tree *) tree); node != NULL;
+	 node = ioctl_tree_cursor_next(&cursor)) {
+	if (node->repeat > 1)
+	    fprintf(f, "@REPEAT %u\n", node->repeat);
+	/* write indent */
+	for (int i = 0; i < node->depth; ++i)
+	    fputc(' ', f);
+	ioctl_tree_write_node(f, node);
+    }
+}
+
+/**
+ * ioctl_tree_write_journal:
+ *
+ * Append node to a journal of recorded requests, and flush it, so that it is
+ * not lost if the recording process crashes. Every recorded request needs to
+ * be written, including the ones which ioctl_tree_insert() drops as
+ * duplicates, as they determine where subsequent nodes get inserted.
+ */
+void
+ioctl_tree_write_journal(FILE * f, const ioctl_tree * node)
+{
+    ioctl_tree_write_node(f, node);
+    fflush(f);
+}
+
+/**
+ * ioctl_tree_read_journal:
+ *
+ * Insert all requests from a journal written by ioctl_tree_write_journal()
+ * into tree, and return the (new) root of the tree. This stops at the first
+ * incomplete record, which is left over from a crash during writing.
+ */
+ioctl_tree *
+ioctl_tree_read_journal(ioctl_tree * tree, FILE * f)
+{
+    char *line = NULL;
+    size_t line_size;
+    ssize_t len;
+    ioctl_tree *node;
+
+    while ((len = getline(&line, &line_size, f)) >= 0) {
+	/* skip empty, comment, and metadata lines */
+	if (line[0] == '\n' || line[0] == '#' || line[0] == '@')
+	    continue;
+
+	if (line[len - 1] != '\n') {
+	    DBG(DBG_IOCTL_TREE, "ioctl_tree_read_journal: ignoring incomplete record at the end\n");
+	    break;
+	}
+	node = ioctl_tree_new_from_text(line);
+	if (node == NULL) {
+	    DBG(DBG_IOCTL_TREE, "ioctl_tree_read_journal: failure to parse line: %s", line);
+	    break;
+	}
+	tree = ioctl_tree_insert(tree, node);
+    }
+    free(line);
 
-    ioctl_tree_write(f, tree->child);
-    ioctl_tree_write(f, tree->next);
+    return tree;
 }
 
 ioctl_tree *
 ioctl_tree_find_equal(ioctl_tree * tree, ioctl_tree * node)
 {
+    ioctl_tree_cursor cursor;
     ioctl_tree *t;
 
-    if (node->id == tree->id && node->type->equal(node, tree))
-	return tree;
-    if (tree->child) {
-	t = ioctl_tree_find_equal(tree->child, node);
-	if (t != NULL)
-	    return t;
-    }
-    if (tree->next) {
-	t = ioctl_tree_find_equal(tree->next, node);
-	if (t != NULL)
+    for (t = ioctl_tree_cursor_init(&cursor, tree); t != NULL; t = ioctl_tree_cursor_next(&cursor)) {
+	if (node->id == t->id && node->type->equal(node, t)) {
+	    ioctl_tree_cursor_clear(&cursor);
 	    return t;
+	}
     }
     return NULL;
 }
@@ -311,6 +752,69 @@ ioctl_tree_next(const ioctl_tree * node)
     return NULL;
 }
 
+/***********************************
+ *
+ * ioctl_tree_cursor
+ *
+ ***********************************/
+
+/**
+ * ioctl_tree_cursor_init:
+ *
+ * Start a pre-order traversal of tree, and return its first node. This
+ * does not use ioctl_tree_next(), as inserted top level nodes have the root
+ * as parent.
+ */
+ioctl_tree *
+ioctl_tree_cursor_init(ioctl_tree_cursor * cursor, ioctl_tree * tree)
+{
+    cursor->node = tree;
+    cursor->pending = NULL;
+    return tree;
+}
+
+/**
+ * ioctl_tree_cursor_next:
+ *
+ * Advance to the next node in pre-order and return it, or NULL at the end.
+ * The memory for the pending siblings is released at the end.
+ */
+ioctl_tree *
+ioctl_tree_cursor_next(ioctl_tree_cursor * cursor)
+{
+    ioctl_tree *node = cursor->node;
+
+    if (node == NULL)
+	return NULL;
+
+    if (node->child != NULL) {
+	/* only siblings need to be remembered, not the path to the root */
+	if (node->next != NULL) {
+	    if (cursor->pending == NULL)
+		cursor->pending = ioctl_node_list_new();
+	    ioctl_node_list_append(cursor->pending, node->next);
+	}
+	cursor->node = node->child;
+    } else if (node->next != NULL) {
+	cursor->node = node->next;
+    } else if (cursor->pending != NULL && cursor->pending->n > 0) {
+	cursor->node = cursor->pending->items[--cursor->pending->n];
+    } else {
+	cursor->node = NULL;
+	ioctl_tree_cursor_clear(cursor);
+    }
+    return cursor->node;
+}
+
+void
+ioctl_tree_cursor_clear(ioctl_tree_cursor * cursor)
+{
+    if (cursor->pending != NULL) {
+	ioctl_node_list_free(cursor->pending);
+	cursor->pending = NULL;
+    }
+}
+
 /***********************************
  *
  * ioctl_node_list
@@ -350,10 +854,13 @@ ioctl_node_list_append(ioctl_node_list * list, ioctl_tree * element)
 }
 
 ioctl_tree *
-ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+		   ioctl_replay_state * state)
 {
     const ioctl_type *t;
     ioctl_tree *i;
+    ioctl_node_list *candidates;
+    ssize_t start;
     int r, handled;
 
     /* initialize return code */
@@ -370,7 +877,7 @@ ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id,
     /* check if it's a hardware independent stateless ioctl */
     if (t != NULL && t->insertion_parent == NULL) {
 	DBG(DBG_IOCTL_TREE, "  ioctl_tree_execute: stateless\n");
-	if (t->execute(NULL, id, arg, &r))
+	if (t->execute(NULL, id, arg, &r, state))
 	    *ret = r;
 	return last;
     }
@@ -378,48 +885,90 @@ ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id,
     if (tree == NULL)
 	return NULL;
 
-    i = ioctl_tree_next_wrap(tree, last);
-    /* start at the previously executed node to maintain original order of
-     * ioctls as much as possible (i. e. maintain it while the requests come in
-     * at the same order as originally recorded) */
-    for (;;) {
+    /* a node from a compacted recording answers all of its repetitions
+     * before the replay moves on */
+    if (state != NULL && last != NULL && state->repeat_node == last && state->repeat_left > 0) {
+	handled = last->type->execute(last, id, arg, &r, state);
+	if (handled) {
+	    DBG(DBG_IOCTL_TREE, "    -> repeated match, ret %i, adv: %i, %u left\n", r, handled, state->repeat_left);
+	    *ret = r;
+	    if (handled == 1)
+		--state->repeat_left;
+	    return last;
+	}
+    }
+
+    /* only look at the nodes which can handle this id; start after the
+     * previously executed node to maintain original order of ioctls as much
+     * as possible (i. e. maintain it while the requests come in at the same
+     * order as originally recorded), and wrap around to do a full circle */
+    candidates = ioctl_tree_id_index_get(tree, id);
+    if (candidates == NULL) {
+	DBG(DBG_IOCTL_TREE, "    -> no nodes for this id, not found\n");
+	return NULL;
+    }
+
+    start = 0;
+    if (last != NULL) {
+	/* binary search for the first candidate after last */
+	ssize_t hi = candidates->n;
+	while (start < hi) {
+	    ssize_t mid = start + (hi - start) / 2;
+	    if (ioctl_node_list_get(candidates, mid)->seq <= last->seq)
+		start = mid + 1;
+	    else
+		hi = mid;
+	}
+    }
+
+    for (ssize_t k = 0; k < candidates->n; ++k) {
+	i = ioctl_node_list_get(candidates, (start + k) % candidates->n);
 	DBG(DBG_IOCTL_TREE, "   ioctl_tree_execute: checking node %s(%X, base id %X) ", i->type->name, (unsigned) i->id, (unsigned) i->type->id);
 	if (debug_categories & DBG_IOCTL_TREE)
 	    i->type->write(i, stderr);
 	DBG(DBG_IOCTL_TREE, "\n");
-	handled = i->type->execute(i, id, arg, &r);
+	handled = i->type->execute(i, id, arg, &r, state);
 	if (handled) {
 	    DBG(DBG_IOCTL_TREE, "    -> match, ret %i, adv: %i\n", r, handled);
 	    *ret = r;
-	    if (handled == 1)
+	    if (handled == 1) {
+		if (state != NULL) {
+		    state->repeat_node = i;
+		    state->repeat_left = i->repeat > 1 ? i->repeat - 1 : 0;
+		}
 		return i;
-	    else
+	    } else
 		return last;
 	}
-
-	if (last != NULL && i == last) {
-	    /* we did a full circle */
-	    DBG(DBG_IOCTL_TREE, "    -> full iteration, not found\n");
-	    break;
-	}
-
-	i = ioctl_tree_next_wrap(tree, i);
-
-	if (last == NULL && i == tree) {
-	    /* we did a full circle */
-	    DBG(DBG_IOCTL_TREE, "    -> full iteration with last == NULL, not found\n");
-	    break;
-	}
     }
+    DBG(DBG_IOCTL_TREE, "    -> full iteration, not found\n");
 
     /* not found */
     return NULL;
 }
 
+ioctl_replay_state *
+ioctl_replay_state_new(void)
+{
+    return callocx(1, sizeof(ioctl_replay_state));
+}
+
+void
+ioctl_replay_state_free(ioctl_replay_state * state)
+{
+    free(state);
+}
+
 int
-ioctl_tree_next_ret(ioctl_tree * tree, ioctl_tree * last)
+ioctl_tree_next_ret(ioctl_tree * tree, ioctl_tree * last, const ioctl_replay_state * state)
 {
-    const ioctl_tree *i = ioctl_tree_next_wrap(tree, last);
+    const ioctl_tree *i;
+
+    /* last has repetitions left */
+    if (state != NULL && last != NULL && state->repeat_node == last && state->repeat_left > 0)
+	return last->ret;
+
+    i = ioctl_tree_next_wrap(tree, last);
 
     if (i == NULL) {
         return 0;
@@ -434,38 +983,20 @@ ioctl_tree_next_ret(ioctl_tree * tree, ioctl_tree * last)
  *
  ***********************************/
 
-static inline signed char
-hexdigit(char c)
-{
-    if (c >= '0' && c <= '9')
-	return c - '0';
-    if (c >= 'A' && c <= 'F')
-	return c - 'A' + 10;
-    if (c >= 'a' && c <= 'f')
-	return c - 'a' + 10;
-    return -1;
-}
-
 static int
 read_hex(const char *hex, char *buf, size_t bufsize)
 {
-    const char *hexptr = hex;
-    size_t written = 0;
-    signed char upper, lower;
-
-    while ((upper = hexdigit(hexptr[0])) >= 0) {
-	if (written >= bufsize) {
-	    DBG(DBG_IOCTL_TREE, "read_hex: data is larger than buffer size %zu\n", bufsize);
-	    return FALSE;
-	}
+    /* one more digit than fits into buf, to detect too large data */
+    size_t len = strnlen(hex, bufsize < SIZE_MAX / 2 ? 2 * bufsize + 1 : SIZE_MAX);
+    size_t digits = hex_decode(hex, len, buf);
 
-	lower = hexdigit(hexptr[1]);
-	if (lower < 0) {
-	    DBG(DBG_IOCTL_TREE, "read_hex: data has odd number of digits: '%s'\n", hex);
-	    return FALSE;
-	}
-	buf[written++] = upper << 4 | lower;
-	hexptr += 2;
+    if (digits > 2 * bufsize) {
+	DBG(DBG_IOCTL_TREE, "read_hex: data is larger than buffer size %zu\n", bufsize);
+	return FALSE;
+    }
+    if (digits % 2 != 0) {
+	DBG(DBG_IOCTL_TREE, "read_hex: data has odd number of digits: '%s'\n", hex);
+	return FALSE;
     }
     return TRUE;
 }
@@ -473,13 +1004,16 @@ read_hex(const char *hex, char *buf, size_t bufsize)
 static void
 write_hex(FILE * file, const char *buf, size_t len)
 {
-    size_t i;
-
-    if (len == 0)
-	return;
-
-    for (i = 0; i < len; ++i)
-	fprintf(file, "%02X", (unsigned)(unsigned char)buf[i]);
+    char hex[4096];
+    size_t chunk;
+
+    while (len > 0) {
+	chunk = len < sizeof(hex) / 2 ? len : sizeof(hex) / 2;
+	hex_encode(buf, chunk, hex, false);
+	fwrite(hex, 1, 2 * chunk, file);
+	buf += chunk;
+	len -= chunk;
+    }
 }
 
 /***********************************
@@ -504,7 +1038,7 @@ static void
 ioctl_simplestruct_init_from_bin(ioctl_tree * node, const void *data)
 {
     DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_bin: %s(%X): size is %u bytes\n", node->type->name, (unsigned) node->id, (unsigned) NSIZE(node));
-    node->data = mallocx(NSIZE(node));
+    node->data = ioctl_node_alloc(node, NSIZE(node));
     memcpy(node->data, data, NSIZE(node));
 }
 
@@ -515,7 +1049,7 @@ ioctl_simplestruct_init_from_text(ioctl_tree * node, const char *data)
      * correct length for data; this happens for variable length ioctls such as
      * EVIOCGBIT */
     size_t data_len = strlen(data) / 2;
-    node->data = mallocx(data_len);
+    node->data = ioctl_node_alloc(node, data_len);
 
     if (NSIZE(node) != data_len) {
 	DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_text: adjusting ioctl ID %X (size %u) to actual data length %zu\n",
@@ -525,7 +1059,7 @@ ioctl_simplestruct_init_from_text(ioctl_tree * node, const char *data)
 
     if (!read_hex(data, node->data, NSIZE(node))) {
 	DBG(DBG_IOCTL_TREE, "ioctl_simplestruct_init_from_text: failed to parse '%s'\n", data);
-	free(node->data);
+	ioctl_node_free(node, node->data);
 	return FALSE;
     }
     return TRUE;
@@ -535,7 +1069,7 @@ static void
 ioctl_simplestruct_free_data(ioctl_tree * node)
 {
     if (node->data != NULL)
-	free(node->data);
+	ioctl_node_free(node, node->data);
 }
 
 static void
@@ -551,8 +1085,15 @@ ioctl_simplestruct_equal(const ioctl_tree * n1, const ioctl_tree * n2)
     return n1->type == n2->type && memcmp(n1->data, n2->data, NSIZE(n1)) == 0;
 }
 
+static uint32_t
+ioctl_simplestruct_hash(const ioctl_tree * node)
+{
+    return hash_bytes(HASH_INIT, node->data, NSIZE(node));
+}
+
 static int
-ioctl_simplestruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+ioctl_simplestruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+			      UNUSED ioctl_replay_state * _state)
 {
     if (id == node->id) {
 	memcpy(arg, node->data, NSIZE(node));
@@ -574,7 +1115,7 @@ ioctl_varlenstruct_init_from_bin(ioctl_tree * node, const void *data)
 {
     size_t size = node->type->get_data_size(node->id, data);
     DBG(DBG_IOCTL_TREE, "ioctl_varlenstruct_init_from_bin: %s(%X): size is %zu bytes\n", node->type->name, (unsigned) node->id, size);
-    node->data = mallocx(size);
+    node->data = ioctl_node_alloc(node, size);
     memcpy(node->data, data, size);
 }
 
@@ -583,11 +1124,11 @@ ioctl_varlenstruct_init_from_text(ioctl_tree * node, const char *data)
 {
     size_t data_len = strlen(data) / 2;
 
-    node->data = mallocx(data_len);
+    node->data = ioctl_node_alloc(node, data_len);
 
     if (!read_hex(data, node->data, data_len)) {
 	fprintf(stderr, "ioctl_varlenstruct_init_from_text: failed to parse '%s'\n", data);
-	free(node->data);
+	ioctl_node_free(node, node->data);
 	return FALSE;
     }
 
@@ -597,7 +1138,7 @@ ioctl_varlenstruct_init_from_text(ioctl_tree * node, const char *data)
     if (size != data_len) {
 	fprintf(stderr, "ioctl_varlenstruct_init_from_text: ioctl %X: expected data length %zu, but got %zu bytes from text data\n",
 		(unsigned) node->id, size, data_len);
-	free(node->data);
+	ioctl_node_free(node, node->data);
 	return FALSE;
     }
 
@@ -620,7 +1161,8 @@ ioctl_varlenstruct_equal(const ioctl_tree * n1, const ioctl_tree * n2)
 }
 
 static int
-ioctl_varlenstruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+ioctl_varlenstruct_in_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+			      UNUSED ioctl_replay_state * _state)
 {
     if (id == node->id) {
 	size_t size = node->type->get_data_size(id, node->data);
@@ -644,10 +1186,10 @@ usbdevfs_reapurb_init_from_bin(ioctl_tree * node, const void *data)
     const struct usbdevfs_urb *urb = *((struct usbdevfs_urb **)data);
     struct usbdevfs_urb *copy;
 
-    copy = callocx(sizeof(struct usbdevfs_urb), 1);
+    copy = ioctl_node_alloc(node, sizeof(struct usbdevfs_urb));
     memcpy(copy, urb, sizeof(struct usbdevfs_urb));
     /* we need to make a copy of the buffer */
-    copy->buffer = callocx(urb->buffer_length, 1);
+    copy->buffer = ioctl_node_alloc(node, urb->buffer_length);
     memcpy(copy->buffer, urb->buffer, urb->buffer_length);
     node->data = copy;
 }
@@ -655,27 +1197,27 @@ usbdevfs_reapurb_init_from_bin(ioctl_tree * node, const void *data)
 static int
 usbdevfs_reapurb_init_from_text(ioctl_tree * node, const char *data)
 {
-    struct usbdevfs_urb *info = callocx(sizeof(struct usbdevfs_urb), 1);
+    struct usbdevfs_urb *info = ioctl_node_alloc(node, sizeof(struct usbdevfs_urb));
     int offset, result;
     unsigned type, endpoint;
     result = sscanf(data, "%u %u %i %u %i %i %i %n", &type, &endpoint,
 		    &info->status, &info->flags, &info->buffer_length,
 		    &info->actual_length, &info->error_count, &offset);
     /* ambiguity of counting or not %n */
-    if (result < 7) {
+    if (result < 7 || info->buffer_length < 0) {
 	DBG(DBG_IOCTL_TREE, "usbdevfs_reapurb_init_from_text: failed to parse record '%s'\n", data);
-	free(info);
+	ioctl_node_free(node, info);
 	return FALSE;
     }
     info->type = (unsigned char)type;
     info->endpoint = (unsigned char)endpoint;
 
     /* read buffer */
-    info->buffer = callocx(info->buffer_length, 1);
+    info->buffer = ioctl_node_alloc(node, info->buffer_length);
     if (!read_hex(data + offset, info->buffer, info->buffer_length)) {
 	DBG(DBG_IOCTL_TREE, "usbdevfs_reapurb_init_from_text: failed to parse buffer '%s'\n", data + offset);
-	free(info->buffer);
-	free(info);
+	ioctl_node_free(node, info->buffer);
+	ioctl_node_free(node, info);
 	return FALSE;
     };
 
@@ -689,11 +1231,38 @@ usbdevfs_reapurb_free_data(ioctl_tree * node)
     struct usbdevfs_urb *info = node->data;
     if (info != NULL) {
 	if (info->buffer != NULL)
-	    free(info->buffer);
-	free(info);
+	    ioctl_node_free(node, info->buffer);
+	ioctl_node_free(node, info);
     }
 }
 
+/* URB struct, directly followed by the buffer */
+static size_t
+usbdevfs_reapurb_flatten(const ioctl_tree * node, void *buf)
+{
+    const struct usbdevfs_urb *urb = node->data;
+
+    if (buf != NULL) {
+	struct usbdevfs_urb *flat = buf;
+	memcpy(flat, urb, sizeof(struct usbdevfs_urb));
+	flat->buffer = NULL;
+	memcpy(flat + 1, urb->buffer, urb->buffer_length);
+    }
+    return sizeof(struct usbdevfs_urb) + urb->buffer_length;
+}
+
+static int
+usbdevfs_reapurb_unflatten(ioctl_tree * node, size_t size)
+{
+    struct usbdevfs_urb *urb = node->data;
+
+    if (size < sizeof(struct usbdevfs_urb) || urb->buffer_length < 0 ||
+	(size_t) urb->buffer_length != size - sizeof(struct usbdevfs_urb))
+	return FALSE;
+    urb->buffer = urb + 1;
+    return TRUE;
+}
+
 static void
 usbdevfs_reapurb_write(const ioctl_tree * node, FILE * f)
 {
@@ -724,18 +1293,36 @@ usbdevfs_reapurb_equal(const ioctl_tree * n1, const ioctl_tree * n2)
 	u1->actual_length == u2->actual_length && memcmp(u1->buffer, u2->buffer, u1->buffer_length) == 0;
 }
 
+static uint32_t
+usbdevfs_reapurb_hash(const ioctl_tree * node)
+{
+    const struct usbdevfs_urb *u = node->data;
+    uint32_t h = HASH_INIT;
+
+    /* input URBs are never equal, see usbdevfs_reapurb_equal() */
+    if (u->endpoint & 0x80)
+	return 0;
+
+    h = hash_bytes(h, &u->type, sizeof(u->type));
+    h = hash_bytes(h, &u->endpoint, sizeof(u->endpoint));
+    h = hash_bytes(h, &u->status, sizeof(u->status));
+    h = hash_bytes(h, &u->flags, sizeof(u->flags));
+    h = hash_bytes(h, &u->buffer_length, sizeof(u->buffer_length));
+    h = hash_bytes(h, &u->actual_length, sizeof(u->actual_length));
+    return hash_bytes(h, u->buffer, u->buffer_length);
+}
+
 static int
-usbdevfs_reapurb_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret)
+usbdevfs_reapurb_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+			 ioctl_replay_state * state)
 {
-    /* set in SUBMIT, cleared in REAP */
-    static const ioctl_tree *submit_node = NULL;
-    static struct usbdevfs_urb *submit_urb = NULL;
+    assert(state != NULL);
 
     /* have to cast here, as with musl USBDEVFS* have the wrong type "unsigned long" */
     if (id == (IOCTL_REQUEST_TYPE) USBDEVFS_SUBMITURB) {
 	const struct usbdevfs_urb *n_urb = node->data;
 	struct usbdevfs_urb *a_urb = arg;
-	assert(submit_node == NULL);
+	assert(state->submit_node == NULL);
 
 	if (n_urb->type != a_urb->type || n_urb->endpoint != a_urb->endpoint ||
 	    n_urb->flags != a_urb->flags || n_urb->buffer_length != a_urb->buffer_length)
@@ -752,21 +1339,22 @@ usbdevfs_reapurb_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *a
 	DBG(DBG_IOCTL_TREE, "  usbdevfs_reapurb_execute: handling SUBMITURB, buffer match, remembering\n");
 
 	/* remember the node for the next REAP */
-	submit_node = node;
-	submit_urb = a_urb;
+	state->submit_node = node;
+	state->submit_urb = a_urb;
 	*ret = 0;
 	return 1;
     }
 
     if (id == node->type->id) {
+	struct usbdevfs_urb *submit_urb = state->submit_urb;
 	struct usbdevfs_urb *orig_node_urb;
-	if (submit_node == NULL) {
+	if (state->submit_node == NULL) {
 	    DBG(DBG_IOCTL_TREE, "  usbdevfs_reapurb_execute: handling %s, but no submit node -> EAGAIN\n", node->type->name);
 	    *ret = -1;
 	    errno = EAGAIN;
 	    return 2;
 	}
-	orig_node_urb = submit_node->data;
+	orig_node_urb = state->submit_node->data;
 
 	submit_urb->actual_length = orig_node_urb->actual_length;
 	submit_urb->error_count = orig_node_urb->error_count;
@@ -785,8 +1373,8 @@ usbdevfs_reapurb_execute(const ioctl_tree * node, IOCTL_REQUEST_TYPE id, void *a
 	    write_hex(stderr, submit_urb->buffer, submit_urb->endpoint & 0x80 ?
 		    submit_urb->actual_length : submit_urb->buffer_length);
 
-	submit_urb = NULL;
-	submit_node = NULL;
+	state->submit_urb = NULL;
+	state->submit_node = NULL;
 	*ret = 0;
 	return 2;
     }
@@ -821,7 +1409,8 @@ usbdevfs_reapurb_insertion_parent(ioctl_tree * tree, ioctl_tree * node)
  ***********************************/
 
 static int
-ioctl_execute_success(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret)
+ioctl_execute_success(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret,
+		      UNUSED ioctl_replay_state * _state)
 {
     errno = 0;
     *ret = 0;
@@ -829,7 +1418,8 @@ ioctl_execute_success(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE
 }
 
 static int
-ioctl_execute_enodata(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret)
+ioctl_execute_enodata(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret,
+		      UNUSED ioctl_replay_state * _state)
 {
     errno = ENODATA;
     *ret = -1;
@@ -837,7 +1427,8 @@ ioctl_execute_enodata(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE
 }
 
 static int
-ioctl_execute_enotty(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret)
+ioctl_execute_enotty(UNUSED const ioctl_tree * _node, UNUSED IOCTL_REQUEST_TYPE _id, UNUSED void *_arg, int *ret,
+		      UNUSED ioctl_replay_state * _state)
 {
     errno = ENOTTY;
     *ret = -1;
@@ -851,6 +1442,479 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
 }
 
 
+/***********************************
+ *
+ * Compiled binary tree format
+ *
+ * A header, a table of the used ioctl type names, fixed size node records in
+ * pre-order, and a data arena with the (flattened) node data. The file gets
+ * mmap()ed and the node data is used in place. This is only meant for
+ * replaying on the machine that compiled it, as the data is in native byte
+ * order and struct layout.
+ *
+ ***********************************/
+
+#define COMPILED_MAGIC "UMDIOCTB"
+#define COMPILED_VERSION 2
+#define COMPILED_ALIGN 8
+#define COMPILED_ALIGN_UP(x) (((x) + COMPILED_ALIGN - 1) & ~((uint64_t) COMPILED_ALIGN - 1))
+
+struct compiled_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;	/* 0x01020304 in native order */
+    uint32_t pointer_size;
+    uint32_t n_types;
+    uint32_t n_nodes;
+    uint32_t reserved;
+    uint64_t types_offset;	/* all offsets are from the start of the file */
+    uint64_t nodes_offset;
+    uint64_t data_offset;
+    uint64_t data_size;
+    char device[256];
+};
+
+struct compiled_type {
+    char name[100];
+    char padding[4];
+};
+
+struct compiled_node {
+    uint64_t id;
+    uint64_t data_offset;	/* from the start of the data arena */
+    uint64_t data_size;
+    uint32_t type;		/* index into the type table */
+    int32_t ret;
+    int32_t depth;
+    /* relative to this node's index, 0 for none */
+    int32_t child;
+    int32_t next;
+    int32_t parent;
+    uint32_t repeat;
+    uint32_t reserved;
+};
+
+/* size of the data of node in the compiled format */
+static size_t
+ioctl_tree_flat_size(const ioctl_tree * node)
+{
+    if (node->type->flatten != NULL)
+	return node->type->flatten(node, NULL);
+    if (node->type->real_size < 0 && node->type->get_data_size != NULL)
+	return node->type->get_data_size(node->id, node->data);
+    return NSIZE(node);
+}
+
+static void
+ioctl_tree_collect(ioctl_node_list * list, ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node;
+
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = ioctl_tree_cursor_next(&cursor)) {
+	node->seq = list->n;
+	ioctl_node_list_append(list, node);
+    }
+}
+
+/**
+ * ioctl_tree_write_compiled:
+ *
+ * Write the tree in the compiled binary format, which ioctl_tree_read_compiled()
+ * can load without parsing. Return 0 on success, or -1 with errno set.
+ */
+int
+ioctl_tree_write_compiled(FILE * f, const char *device, ioctl_tree * tree)
+{
+    static const char zeros[COMPILED_ALIGN];
+    struct compiled_header header;
+    ioctl_node_list *nodes = ioctl_node_list_new();
+    const ioctl_type **types = NULL;
+    uint64_t data_size = 0;
+    ssize_t i;
+
+    if (strlen(device) >= sizeof(header.device)) {
+	ioctl_node_list_free(nodes);
+	errno = ENAMETOOLONG;
+	return -1;
+    }
+
+    ioctl_tree_collect(nodes, tree);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+    header.version = COMPILED_VERSION;
+    header.byte_order = 0x01020304;
+    header.pointer_size = sizeof(void *);
+    header.n_nodes = nodes->n;
+    strcpy(header.device, device);
+
+    /* table of used types; there are only a few, so a linear search is fine */
+    types = callocx(nodes->n > 0 ? nodes->n : 1, sizeof(ioctl_type *));
+    for (i = 0; i < nodes->n; ++i) {
+	const ioctl_type *t = ioctl_node_list_get(nodes, i)->type;
+	uint32_t j;
+	for (j = 0; j < header.n_types && types[j] != t; ++j);
+	if (j == header.n_types)
+	    types[header.n_types++] = t;
+	data_size += COMPILED_ALIGN_UP(ioctl_tree_flat_size(ioctl_node_list_get(nodes, i)));
+    }
+
+    header.types_offset = COMPILED_ALIGN_UP(sizeof(header));
+    header.nodes_offset = header.types_offset + COMPILED_ALIGN_UP(header.n_types * sizeof(struct compiled_type));
+    header.data_offset = header.nodes_offset + COMPILED_ALIGN_UP(nodes->n * sizeof(struct compiled_node));
+    header.data_size = data_size;
+
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(zeros, header.types_offset - sizeof(header), 1, f);
+
+    for (uint32_t j = 0; j < header.n_types; ++j) {
+	struct compiled_type ct;
+	memset(&ct, 0, sizeof(ct));
+	strncpy(ct.name, types[j]->name, sizeof(ct.name) - 1);
+	fwrite(&ct, sizeof(ct), 1, f);
+    }
+    fwrite(zeros, header.nodes_offset - header.types_offset - header.n_types * sizeof(struct compiled_type), 1, f);
+
+    data_size = 0;
+    for (i = 0; i < nodes->n; ++i) {
+	const ioctl_tree *n = ioctl_node_list_get(nodes, i);
+	struct compiled_node cn;
+
+	memset(&cn, 0, sizeof(cn));
+	cn.id = n->id;
+	cn.data_offset = data_size;
+	cn.data_size = ioctl_tree_flat_size(n);
+	for (cn.type = 0; types[cn.type] != n->type; ++cn.type);
+	cn.ret = n->ret;
+	cn.depth = n->depth;
+	cn.repeat = n->repeat;
+	if (n->child != NULL)
+	    cn.child = n->child->seq - i;
+	if (n->next != NULL)
+	    cn.next = n->next->seq - i;
+	/* inserted top level nodes point to the root */
+	if (n->parent != NULL && n->depth > 0)
+	    cn.parent = (ssize_t) n->parent->seq - i;
+	fwrite(&cn, sizeof(cn), 1, f);
+	data_size += COMPILED_ALIGN_UP(cn.data_size);
+    }
+    fwrite(zeros, header.data_offset - header.nodes_offset - nodes->n * sizeof(struct compiled_node), 1, f);
+
+    for (i = 0; i < nodes->n; ++i) {
+	const ioctl_tree *n = ioctl_node_list_get(nodes, i);
+	size_t size = ioctl_tree_flat_size(n);
+
+	if (n->type->flatten != NULL) {
+	    void *buf = mallocx(size);
+	    n->type->flatten(n, buf);
+	    fwrite(buf, size, 1, f);
+	    free(buf);
+	} else {
+	    fwrite(n->data, size, 1, f);
+	}
+	fwrite(zeros, COMPILED_ALIGN_UP(size) - size, 1, f);
+    }
+
+    free(types);
+    ioctl_node_list_free(nodes);
+    fflush(f);
+    if (ferror(f)) {
+	errno = EIO;
+	return -1;
+    }
+    return 0;
+}
+
+/* check that a table of n elements at offset is aligned and inside the file,
+ * without overflowing */
+static int
+compiled_table_valid(uint64_t offset, uint64_t n, size_t elem_size, size_t file_size)
+{
+    return offset % COMPILED_ALIGN == 0 &&
+	offset <= file_size &&
+	n <= (file_size - offset) / elem_size;
+}
+
+static int
+compiled_header_valid(const struct compiled_header *header, size_t file_size)
+{
+    return memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) == 0 &&
+	header->version == COMPILED_VERSION &&
+	header->byte_order == 0x01020304 &&
+	header->pointer_size == sizeof(void *) &&
+	memchr(header->device, '\0', sizeof(header->device)) != NULL &&
+	compiled_table_valid(header->types_offset, header->n_types, sizeof(struct compiled_type), file_size) &&
+	compiled_table_valid(header->nodes_offset, header->n_nodes, sizeof(struct compiled_node), file_size) &&
+	compiled_table_valid(header->data_offset, header->data_size, 1, file_size);
+}
+
+/**
+ * ioctl_tree_compiled_device:
+ *
+ * Return the device name of a compiled tree file, or NULL if path is not a
+ * compiled tree. The result must be freed.
+ */
+char *
+ioctl_tree_compiled_device(const char *path)
+{
+    struct compiled_header header;
+    struct stat st;
+    char *result = NULL;
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (f == NULL)
+	return NULL;
+    if (fstat(fileno(f), &st) == 0 &&
+	fread(&header, sizeof(header), 1, f) == 1 &&
+	compiled_header_valid(&header, st.st_size))
+	result = strdupx(header.device);
+    fclose(f);
+    return result;
+}
+
+/**
+ * ioctl_tree_read_compiled:
+ *
+ * Load a tree written by ioctl_tree_write_compiled(). Return NULL if path is
+ * not a valid compiled tree, or if it is empty.
+ */
+ioctl_tree *
+ioctl_tree_read_compiled(const char *path)
+{
+    const struct compiled_header *header;
+    const struct compiled_type *ctypes;
+    const struct compiled_node *cnodes;
+    const ioctl_type **types = NULL;
+    ioctl_tree *nodes = NULL;
+    char *arena;
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return NULL;
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(struct compiled_header)) {
+	close(fd);
+	return NULL;
+    }
+    /* private writable mapping, as pointers in node data need to be set up */
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+	return NULL;
+
+    header = map;
+    if (!compiled_header_valid(header, st.st_size) || header->n_nodes == 0) {
+	DBG(DBG_IOCTL_TREE, "ioctl_tree_read_compiled: %s is not a valid compiled tree\n", path);
+	goto fail;
+    }
+    ctypes = (const struct compiled_type *) ((const char *) map + header->types_offset);
+    cnodes = (const struct compiled_node *) ((const char *) map + header->nodes_offset);
+    arena = (char *) map + header->data_offset;
+
+    types = callocx(header->n_types > 0 ? header->n_types : 1, sizeof(ioctl_type *));
+    for (uint32_t i = 0; i < header->n_types; ++i) {
+	IOCTL_REQUEST_TYPE id;
+	if (memchr(ctypes[i].name, '\0', sizeof(ctypes[i].name)) == NULL ||
+	    (types[i] = ioctl_type_get_by_name(ctypes[i].name, &id)) == NULL) {
+	    fprintf(stderr, "ioctl_tree_read_compiled: %s: unknown ioctl %.100s\n", path, ctypes[i].name);
+	    goto fail;
+	}
+    }
+
+    /* all nodes in one block */
+    nodes = callocx(header->n_nodes, sizeof(ioctl_tree));
+    for (uint32_t i = 0; i < header->n_nodes; ++i) {
+	const struct compiled_node *cn = &cnodes[i];
+	ioctl_tree *n = &nodes[i];
+
+	if (cn->type >= header->n_types ||
+	    cn->data_offset % COMPILED_ALIGN != 0 ||
+	    cn->data_offset > header->data_size ||
+	    cn->data_size > header->data_size - cn->data_offset ||
+	    (cn->child != 0 && (cn->child < 0 || cn->child >= (int64_t) header->n_nodes - i)) ||
+	    (cn->next != 0 && (cn->next < 0 || cn->next >= (int64_t) header->n_nodes - i)) ||
+	    (cn->parent != 0 && (cn->parent > 0 || -cn->parent > (int64_t) i))) {
+	    fprintf(stderr, "ioctl_tree_read_compiled: %s: invalid node %u\n", path, i);
+	    goto fail;
+	}
+
+	n->type = types[cn->type];
+	n->id = cn->id;
+	n->ret = cn->ret;
+	n->depth = cn->depth;
+	n->repeat = cn->repeat;
+	n->seq = i;
+	n->data = arena + cn->data_offset;
+	n->child = cn->child ? n + cn->child : NULL;
+	n->next = cn->next ? n + cn->next : NULL;
+	n->parent = cn->parent ? n + cn->parent : NULL;
+
+	/* variable length data needs its fixed part for get_data_size() */
+	if (n->type->flatten == NULL && n->type->real_size < 0 && n->type->get_data_size != NULL &&
+	    cn->data_size < (uint64_t) NSIZE(n)) {
+	    fprintf(stderr, "ioctl_tree_read_compiled: %s: invalid data for node %u\n", path, i);
+	    goto fail;
+	}
+
+	if ((n->type->unflatten != NULL && !n->type->unflatten(n, cn->data_size)) ||
+	    ioctl_tree_flat_size(n) != cn->data_size) {
+	    fprintf(stderr, "ioctl_tree_read_compiled: %s: invalid data for node %u\n", path, i);
+	    goto fail;
+	}
+    }
+
+    free(types);
+    nodes->compiled_map = map;
+    nodes->compiled_map_size = st.st_size;
+    ioctl_tree_build_id_index(nodes);
+    return nodes;
+
+ fail:
+    free(nodes);
+    free(types);
+    munmap(map, st.st_size);
+    return NULL;
+}
+
+/***********************************
+ *
+ * Compaction
+ *
+ * Polling produces long runs of identical requests, like an interrupt
+ * endpoint that keeps sending the same input URB, or status queries which the
+ * tree can't dedup as their equal() is always false. Such a run gets folded
+ * into its first node, which then has a repeat count. This only considers
+ * runs of single requests: an identical next sibling when there are no
+ * children in between, or an identical only child.
+ *
+ ***********************************/
+
+/* node as written into a recording, without its indentation */
+static char *
+ioctl_tree_node_text(const ioctl_tree * node)
+{
+    char *text = NULL;
+    size_t len;
+    FILE *f = open_memstream(&text, &len);
+
+    assert(f != NULL);
+    fprintf(f, "%lX %i ", (unsigned long) node->id, node->ret);
+    node->type->write(node, f);
+    fclose(f);
+    return text;
+}
+
+/* fold other, which must directly follow node in pre-order, into node */
+static void
+ioctl_tree_fold(ioctl_tree * node, ioctl_tree * other)
+{
+    node->repeat = (node->repeat > 1 ? node->repeat : 1) + (other->repeat > 1 ? other->repeat : 1);
+    if (other == node->child) {
+	node->child = other->child;
+    } else {
+	assert(node->child == NULL && other == node->next);
+	node->child = other->child;
+	node->next = other->next;
+    }
+
+    if (other->arena == NULL) {
+	if (other->type->free_data != NULL)
+	    other->type->free_data(other);
+	free(other);
+    }
+}
+
+static void
+ioctl_tree_compact_nodes(ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node;
+
+    /* folding only changes the current node's child and next, before the
+     * cursor looks at them */
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = ioctl_tree_cursor_next(&cursor)) {
+	char *text = ioctl_tree_node_text(node);
+
+	for (;;) {
+	    ioctl_tree *other;
+	    char *other_text;
+	    int same;
+
+	    if (node->child != NULL && node->child->next == NULL)
+		other = node->child;
+	    else if (node->child == NULL && node->next != NULL)
+		other = node->next;
+	    else
+		break;
+
+	    if (other->type != node->type)
+		break;
+	    other_text = ioctl_tree_node_text(other);
+	    same = strcmp(text, other_text) == 0;
+	    free(other_text);
+	    if (!same)
+		break;
+	    ioctl_tree_fold(node, other);
+	}
+	free(text);
+    }
+}
+
+/* set up parent, depth, and last_child of the children after folding; in
+ * pre-order, parents are always fixed before their children */
+static void
+ioctl_tree_fix_children(ioctl_tree * tree)
+{
+    ioctl_tree_cursor cursor;
+    ioctl_tree *node, *c;
+
+    for (node = ioctl_tree_cursor_init(&cursor, tree); node != NULL; node = ioctl_tree_cursor_next(&cursor)) {
+	node->last_child = NULL;
+	for (c = node->child; c != NULL; c = c->next) {
+	    c->parent = node;
+	    c->depth = node->depth + 1;
+	    node->last_child = c;
+	}
+    }
+}
+
+/**
+ * ioctl_tree_compact:
+ *
+ * Fold runs of identical consecutive requests into a single node with a
+ * repeat count. ioctl_tree_write() writes the count as "@REPEAT n" line in
+ * front of the node, and ioctl_tree_execute() answers that many requests with
+ * the node before it moves on. This is meant for finished recordings; nodes
+ * which get inserted afterwards do not continue the previous ones.
+ */
+void
+ioctl_tree_compact(ioctl_tree * tree)
+{
+    ioctl_tree *n;
+
+    if (tree == NULL)
+	return;
+    /* compiled trees are read-only */
+    assert(tree->compiled_map == NULL);
+
+    ioctl_tree_compact_nodes(tree);
+    ioctl_tree_fix_children(tree);
+    for (n = tree; n != NULL; n = n->next)
+	tree->last_sibling = n;
+
+    /* indices and the insertion history may point to folded nodes */
+    ioctl_id_index_free(tree->id_index);
+    tree->id_index = NULL;
+    ioctl_dedup_index_free(tree->dedup_index);
+    tree->dedup_index = NULL;
+    if (tree->last_added != NULL)
+	tree->last_added->n = 0;
+}
+
 /***********************************
  *
  * Known ioctls
@@ -867,7 +1931,8 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
      ioctl_simplestruct_init_from_bin, ioctl_simplestruct_init_from_text,      \
      ioctl_simplestruct_free_data,                                             \
      ioctl_simplestruct_write, ioctl_simplestruct_equal,                       \
-     ioctl_simplestruct_in_execute, insertion_parent_fn, NULL}
+     ioctl_simplestruct_in_execute, insertion_parent_fn, NULL, 0,            \
+     ioctl_simplestruct_hash}
 
 #define I_SIZED_SIMPLE_STRUCT_IN(name, size, nr_range, insertion_parent_fn) \
     I_NAMED_SIZED_SIMPLE_STRUCT_IN(name, #name, size, nr_range, insertion_parent_fn)
@@ -880,21 +1945,23 @@ ioctl_insertion_parent_stateless(ioctl_tree * tree, UNUSED ioctl_tree *_node)
     I_NAMED_SIZED_SIMPLE_STRUCT_IN(name, #name, -1, nr_range, insertion_parent_fn)
 
 /* input structs with a variable length (but no pointers to substructures) */
-#define I_VARLEN_STRUCT_IN(name, equal_fn, insertion_parent_fn, data_size_fn) \
+#define I_VARLEN_STRUCT_IN(name, equal_fn, hash_fn, insertion_parent_fn, data_size_fn) \
     {name, -1, 0, #name,                                                       \
      ioctl_varlenstruct_init_from_bin, ioctl_varlenstruct_init_from_text,      \
      ioctl_simplestruct_free_data,                                             \
      ioctl_varlenstruct_write, equal_fn,                       \
-     ioctl_varlenstruct_in_execute, insertion_parent_fn, data_size_fn}
+     ioctl_varlenstruct_in_execute, insertion_parent_fn, data_size_fn, 0, hash_fn}
 
 /* data with custom handlers; necessary for structs with pointers to nested
  * structs, or keeping stateful handlers */
-#define I_CUSTOM(name, size, nr_range, fn_prefix)               \
+#define I_CUSTOM(name, size, nr_range, fn_prefix, execute_also_id) \
     {name, size, nr_range, #name,                  \
      fn_prefix ## _init_from_bin, fn_prefix ## _init_from_text, \
      fn_prefix ## _free_data,                                   \
      fn_prefix ## _write, fn_prefix ## _equal,                  \
-     fn_prefix ## _execute, fn_prefix ## _insertion_parent}
+     fn_prefix ## _execute, fn_prefix ## _insertion_parent,     \
+     NULL, execute_also_id, fn_prefix ## _hash,                 \
+     fn_prefix ## _flatten, fn_prefix ## _unflatten}
 
 #define I_DUMMY(name, size, nr_range)               \
     {name, size, nr_range, #name,                  \
@@ -906,6 +1973,12 @@ cros_ec_ioctl_equal(UNUSED const ioctl_tree *_n1, UNUSED const ioctl_tree *_n2)
   return FALSE;
 }
 
+static uint32_t
+cros_ec_ioctl_hash(UNUSED const ioctl_tree *_node)
+{
+  return 0;
+}
+
 static size_t
 cros_ec_ioctl_get_data_size(IOCTL_REQUEST_TYPE _id, const void *data)
 {
@@ -920,8 +1993,9 @@ ioctl_type ioctl_db[] = {
     /* we assume that every SUBMITURB is followed by a REAPURB and that
      * ouput EPs don't change the buffer, so we ignore USBDEVFS_SUBMITURB */
     I_DUMMY(USBDEVFS_SUBMITURB, -1, 0),
-    I_CUSTOM(USBDEVFS_REAPURB, -1, 0, usbdevfs_reapurb),
-    I_CUSTOM(USBDEVFS_REAPURBNDELAY, -1, 0, usbdevfs_reapurb),
+    /* REAPURB nodes also answer the SUBMITURB that precedes them */
+    I_CUSTOM(USBDEVFS_REAPURB, -1, 0, usbdevfs_reapurb, USBDEVFS_SUBMITURB),
+    I_CUSTOM(USBDEVFS_REAPURBNDELAY, -1, 0, usbdevfs_reapurb, USBDEVFS_SUBMITURB),
 #ifdef USBDEVFS_GET_CAPABILITIES
     I_SIMPLE_STRUCT_IN(USBDEVFS_GET_CAPABILITIES, 0, ioctl_insertion_parent_stateless),
 #endif
@@ -983,57 +2057,101 @@ ioctl_type ioctl_db[] = {
 #endif
 
     /* cros_ec */
-    I_VARLEN_STRUCT_IN(CROS_EC_DEV_IOCXCMD_V2, cros_ec_ioctl_equal, ioctl_insertion_parent_stateless, cros_ec_ioctl_get_data_size),
+    I_VARLEN_STRUCT_IN(CROS_EC_DEV_IOCXCMD_V2, cros_ec_ioctl_equal, cros_ec_ioctl_hash, ioctl_insertion_parent_stateless, cros_ec_ioctl_get_data_size),
     I_NOSTATE(CROS_EC_DEV_IOCEVENTMASK_V2, enodata),
 
     /* terminator */
-    {0, 0, 0, "", NULL, NULL, NULL, NULL, NULL}
+    {0, 0, 0, "", NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, 0, NULL, NULL, NULL}
 };
 
+/* Lookup indexes for ioctl_db, built on first use. By id: one table of
+ * _IOC_NR entries for each _IOC_DIR/_IOC_TYPE combination that occurs in the
+ * db, which covers the nr_range families as well. By name: open addressing
+ * hash table. */
+#define ID_INDEX_BUCKETS ((1 << _IOC_DIRBITS) << _IOC_TYPEBITS)
+#define ID_INDEX_BUCKET(id) ((_IOC_DIR(id) << _IOC_TYPEBITS) | _IOC_TYPE(id))
+#define NAME_INDEX_SIZE 256	/* power of two, > 2 * number of ioctl_db entries */
+
+static const ioctl_type **id_index[ID_INDEX_BUCKETS];
+static const ioctl_type *name_index[NAME_INDEX_SIZE];
+static pthread_once_t index_once = PTHREAD_ONCE_INIT;
+
+static unsigned
+name_hash(const char *name, size_t len)
+{
+    return hash_bytes(HASH_INIT, name, len) & (NAME_INDEX_SIZE - 1);
+}
+
+static void
+ioctl_db_build_index(void)
+{
+    const ioctl_type *cur;
+
+    for (cur = ioctl_db; cur->name[0] != '\0'; ++cur) {
+	const ioctl_type **bucket = id_index[ID_INDEX_BUCKET(cur->id)];
+	unsigned h;
+
+	if (bucket == NULL) {
+	    bucket = callocx(1 << _IOC_NRBITS, sizeof(ioctl_type *));
+	    id_index[ID_INDEX_BUCKET(cur->id)] = bucket;
+	}
+	/* first match wins, like in a linear scan */
+	for (IOCTL_REQUEST_TYPE nr = _IOC_NR(cur->id);
+	     nr <= _IOC_NR(cur->id) + cur->nr_range && nr < (1 << _IOC_NRBITS); ++nr)
+	    if (bucket[nr] == NULL)
+		bucket[nr] = cur;
+
+	assert(cur - ioctl_db < NAME_INDEX_SIZE / 2);
+	for (h = name_hash(cur->name, strlen(cur->name));
+	     name_index[h] != NULL && strcmp(name_index[h]->name, cur->name) != 0;
+	     h = (h + 1) & (NAME_INDEX_SIZE - 1));
+	if (name_index[h] == NULL)
+	    name_index[h] = cur;
+    }
+}
+
 const ioctl_type *
 ioctl_type_get_by_id(IOCTL_REQUEST_TYPE id)
 {
-    ioctl_type *cur;
-    for (cur = ioctl_db; cur->name[0] != '\0'; ++cur)
-	if (id_matches_type(id, cur))
-	    return cur;
-    return NULL;
+    const ioctl_type **bucket;
+
+    pthread_once(&index_once, ioctl_db_build_index);
+    bucket = id_index[ID_INDEX_BUCKET(id)];
+    return bucket ? bucket[_IOC_NR(id)] : NULL;
 }
 
 int ioctl_data_size_by_id(IOCTL_REQUEST_TYPE id)
 {
-    ioctl_type *cur;
-    for (cur = ioctl_db; cur->name[0] != '\0'; ++cur)
-	if (id_matches_type(id, cur))
-	    return TSIZE(cur, id);
-    return 0;
+    const ioctl_type *t = ioctl_type_get_by_id(id);
+    return t ? TSIZE(t, id) : 0;
+}
+
+const char *
+ioctl_name_by_id(IOCTL_REQUEST_TYPE id)
+{
+    const ioctl_type *t = ioctl_type_get_by_id(id);
+    return t ? t->name : NULL;
 }
 
 const ioctl_type *
 ioctl_type_get_by_name(const char *name, IOCTL_REQUEST_TYPE *out_id)
 {
-    ioctl_type *cur;
-    char *parens;
-    char *real_name;
-    const ioctl_type *result = NULL;
-    long offset = 0;
+    size_t len;
+    unsigned h;
+
+    pthread_once(&index_once, ioctl_db_build_index);
 
     /* chop off real name from offset */
-    real_name = strdupx(name);
-    parens = strchr(real_name, '(');
-    if (parens != NULL) {
-	*parens = '\0';
-	offset = atol(parens + 1);
-    }
+    len = strcspn(name, "(");
 
-    for (cur = ioctl_db; cur->name[0] != '\0'; ++cur)
-	if (strcmp(cur->name, real_name) == 0) {
+    for (h = name_hash(name, len); name_index[h] != NULL; h = (h + 1) & (NAME_INDEX_SIZE - 1)) {
+	const ioctl_type *cur = name_index[h];
+	if (strncmp(cur->name, name, len) == 0 && cur->name[len] == '\0') {
 	    if (out_id != NULL)
-		*out_id = cur->id + offset;
-	    result = cur;
-	    break;
+		*out_id = cur->id + (name[len] == '(' ? atol(name + len + 1) : 0);
+	    return cur;
 	}
+    }
 
-    free(real_name);
-    return result;
+    return NULL;
 }
@@ -21,9 +21,15 @@
 
 #include "config.h"
 #include <stdio.h>
+#include <stdint.h>
 
 struct ioctl_tree;
 typedef struct ioctl_tree ioctl_tree;
+struct ioctl_replay_state;
+typedef struct ioctl_replay_state ioctl_replay_state;
+struct ioctl_id_index;
+struct ioctl_dedup_index;
+struct ioctl_arena;
 
 typedef struct {
     IOCTL_REQUEST_TYPE id;
@@ -36,12 +42,23 @@ typedef struct {
     void (*write) (const ioctl_tree *, FILE *);
     int (*equal) (const ioctl_tree *, const ioctl_tree *);
     /* ret: 0: unhandled, 1: handled, move to next node, 2: handled, keep node */
-    int (*execute) (const ioctl_tree *, IOCTL_REQUEST_TYPE, void *, int *);
+    int (*execute) (const ioctl_tree *, IOCTL_REQUEST_TYPE, void *, int *, ioctl_replay_state *);
     ioctl_tree *(*insertion_parent) (ioctl_tree *, ioctl_tree *);
     /* some structs have a variable length and contain a length field, or their
      * ioctls do not encode the size; if set, and real_size < 0, this function
      * returns the length */
     size_t (*get_data_size) (IOCTL_REQUEST_TYPE, const void *);
+    /* another request id that execute() handles on nodes of this type, or 0 */
+    IOCTL_REQUEST_TYPE execute_also_id;
+    /* hash of the data that equal() compares; 0 if the node is never equal
+     * to any other */
+    uint32_t (*hash) (const ioctl_tree *);
+    /* for data with pointers in the compiled tree format: copy data into buf
+     * as a flat block (if buf is not NULL) and return its size; and set up
+     * pointers in node->data which points to such a block of given size.
+     * NULL for data without pointers. */
+    size_t (*flatten) (const ioctl_tree *, void *);
+    int (*unflatten) (ioctl_tree *, size_t);
 } ioctl_type;
 
 typedef struct {
@@ -59,9 +76,35 @@ struct ioctl_tree {
     ioctl_tree *child;
     ioctl_tree *next;		/* sibling */
     ioctl_tree *parent;
+    /* number of identical consecutive requests which this node stands for,
+     * see ioctl_tree_compact(); 0 and 1 both mean a single one */
+    unsigned int repeat;
 
     /* below are internal private fields */
     ioctl_node_list *last_added;
+    ioctl_tree *last_child;	/* tail of the child list */
+    ioctl_tree *last_sibling;	/* tail of the top level list, only in the root node */
+    size_t seq;			/* position in pre-order traversal, for the id index */
+    struct ioctl_id_index *id_index;	/* only in the root node */
+    uint32_t hash;		/* content hash for the dedup index, 0 if never equal */
+    struct ioctl_dedup_index *dedup_index;	/* only in the root node */
+    /* arena which the node and its data are allocated from, NULL if they are
+     * allocated separately; the root node owns it */
+    struct ioctl_arena *arena;
+    /* mmap()ed compiled tree file, only in the root node; all nodes of such
+     * a tree are in one array, and their data points into the mapping */
+    void *compiled_map;
+    size_t compiled_map_size;
+};
+
+/* Replay state of one client of a tree, for ioctls which span several
+ * requests, like USBDEVFS_SUBMITURB and REAPURB. Each client needs its own,
+ * so that several of them can replay the same tree at the same time. */
+struct ioctl_replay_state {
+    const ioctl_tree *submit_node;	/* set in SUBMITURB, cleared in REAPURB */
+    struct usbdevfs_urb *submit_urb;
+    const ioctl_tree *repeat_node;	/* last executed node with a repeat count */
+    unsigned int repeat_left;	/* how many more times it answers */
 };
 
 ioctl_tree *ioctl_tree_new_from_bin(IOCTL_REQUEST_TYPE id, const void *data, int ret);
@@ -69,11 +112,37 @@ ioctl_tree *ioctl_tree_new_from_text(const char *line);
 void ioctl_tree_free(ioctl_tree * tree);
 ioctl_tree *ioctl_tree_read(FILE * f);
 void ioctl_tree_write(FILE * f, const ioctl_tree * tree);
+void ioctl_tree_write_journal(FILE * f, const ioctl_tree * node);
+ioctl_tree *ioctl_tree_read_journal(ioctl_tree * tree, FILE * f);
+ioctl_tree *ioctl_tree_read_compiled(const char *path);
+int ioctl_tree_write_compiled(FILE * f, const char *device, ioctl_tree * tree);
+char *ioctl_tree_compiled_device(const char *path);
 ioctl_tree *ioctl_tree_insert(ioctl_tree * tree, ioctl_tree * node);
 ioctl_tree *ioctl_tree_find_equal(ioctl_tree * tree, ioctl_tree * node);
 ioctl_tree *ioctl_tree_next(const ioctl_tree * node);
-ioctl_tree *ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret);
-int ioctl_tree_next_ret(ioctl_tree * tree, ioctl_tree * last);
+void ioctl_tree_compact(ioctl_tree * tree);
+ioctl_tree *ioctl_tree_execute(ioctl_tree * tree, ioctl_tree * last, IOCTL_REQUEST_TYPE id, void *arg, int *ret,
+			       ioctl_replay_state * state);
+int ioctl_tree_next_ret(ioctl_tree * tree, ioctl_tree * last, const ioctl_replay_state * state);
+
+/* Pre-order traversal without recursion, so that it works for trees with
+ * any number of nodes:
+ *
+ *   for (n = ioctl_tree_cursor_init(&c, tree); n != NULL; n = ioctl_tree_cursor_next(&c))
+ *
+ * The current node may be freed after the cursor advanced past it. Call
+ * ioctl_tree_cursor_clear() when stopping before the end. */
+typedef struct {
+    ioctl_tree *node;		/* current node, NULL at the end */
+    ioctl_node_list *pending;	/* next siblings of node's ancestors */
+} ioctl_tree_cursor;
+
+ioctl_tree *ioctl_tree_cursor_init(ioctl_tree_cursor * cursor, ioctl_tree * tree);
+ioctl_tree *ioctl_tree_cursor_next(ioctl_tree_cursor * cursor);
+void ioctl_tree_cursor_clear(ioctl_tree_cursor * cursor);
+
+ioctl_replay_state *ioctl_replay_state_new(void);
+void ioctl_replay_state_free(ioctl_replay_state * state);
 
 /* node lists */
 ioctl_node_list *ioctl_node_list_new(void);
@@ -97,6 +166,8 @@ ioctl_tree_next_wrap(ioctl_tree * tree, ioctl_tree * node)
 }
 
 int ioctl_data_size_by_id(IOCTL_REQUEST_TYPE id);
+/* name of a known ioctl, or NULL */
+const char *ioctl_name_by_id(IOCTL_REQUEST_TYPE id);
 
 /* database of known ioctls; return NULL for unknown ones */
 const ioctl_type *ioctl_type_get_by_id(IOCTL_REQUEST_TYPE id);
@@ -573,10 +573,12 @@ netlink_recvmsg(int sockfd, struct msghdr * msg, ssize_t ret)
 
 	/* fake sender to be netlink */
 	sender = (struct sockaddr_nl *)msg->msg_name;
-	sender->nl_family = AF_NETLINK;
-	sender->nl_pid = 0;
-	sender->nl_groups = 2;	/* UDEV_MONITOR_UDEV */
-	msg->msg_namelen = sizeof(sender);
+	if (sender != NULL) {
+	    sender->nl_family = AF_NETLINK;
+	    sender->nl_pid = 0;
+	    sender->nl_groups = 2;	/* UDEV_MONITOR_UDEV */
+	    msg->msg_namelen = sizeof(sender);
+	}
 
 	/* fake sender credentials to be uid 0 */
 	cmsg = CMSG_FIRSTHDR(msg);
@@ -1898,6 +1900,38 @@ __recvmsg64(int sockfd, struct msghdr * msg, int flags)
     return ret;
 }
 
+/* musl declares the flags as unsigned */
+#ifdef __GLIBC__
+typedef int recvmmsg_flags_t;
+#else
+typedef unsigned int recvmmsg_flags_t;
+#endif
+
+int
+recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, recvmmsg_flags_t flags, struct timespec *timeout)
+{
+    libc_func(recvmmsg, int, int, struct mmsghdr *, unsigned int, recvmmsg_flags_t, struct timespec *);
+    int ret = _recvmmsg(sockfd, msgvec, vlen, flags, timeout);
+
+    for (int i = 0; i < ret; ++i)
+	netlink_recvmsg(sockfd, &msgvec[i].msg_hdr, msgvec[i].msg_len);
+
+    return ret;
+}
+
+extern int __recvmmsg64(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout);
+int
+__recvmmsg64(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags, struct timespec *timeout)
+{
+    libc_func(__recvmmsg64, int, int, struct mmsghdr *, unsigned int, int, struct timespec *);
+    int ret = ___recvmmsg64(sockfd, msgvec, vlen, flags, timeout);
+
+    for (int i = 0; i < ret; ++i)
+	netlink_recvmsg(sockfd, &msgvec[i].msg_hdr, msgvec[i].msg_len);
+
+    return ret;
+}
+
 int
 socket(int domain, int type, int protocol)
 {
@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * uevent_monitor.c - Listen to the kernel or udev uevent netlink stream
+ *
+ * This is used by umockdev-record --uevents. Vala's linux.vapi does not cover
+ * struct sockaddr_nl, SCM_CREDENTIALS and the libudev monitor header, so do
+ * the socket handling here.
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+
+#include "uevent_monitor.h"
+
+#define UEVENT_BUFSIZE 16384
+
+/* netlink multicast groups */
+#define MONITOR_GROUP_KERNEL 1
+#define MONITOR_GROUP_UDEV   2
+
+/* same as in uevent_sender.c */
+#define UDEV_MONITOR_MAGIC                0xfeedcafe
+struct udev_monitor_netlink_header {
+    char prefix[8];
+    unsigned int magic;
+    unsigned int header_size;
+    unsigned int properties_off;
+    unsigned int properties_len;
+    unsigned int filter_subsystem_hash;
+    unsigned int filter_devtype_hash;
+    unsigned int filter_tag_bloom_hi;
+    unsigned int filter_tag_bloom_lo;
+};
+
+/**
+ * uevent_monitor_open:
+ * @udev: true for listening to the udev processed events, false for the
+ *        raw kernel events
+ *
+ * Returns: A non-blocking netlink socket, or -1 with errno set on failure.
+ */
+int
+uevent_monitor_open(bool udev)
+{
+    struct sockaddr_nl addr = {
+	.nl_family = AF_NETLINK,
+	.nl_groups = udev ? MONITOR_GROUP_UDEV : MONITOR_GROUP_KERNEL,
+    };
+    const int on = 1;
+    int fd;
+
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+	return -1;
+
+    /* we want to verify the sender, like libudev does */
+    if (setsockopt(fd, SOL_SOCKET, SO_PASSCRED, &on, sizeof on) < 0 ||
+	bind(fd, (struct sockaddr *) &addr, sizeof addr) < 0) {
+	int saved_errno = errno;
+	close(fd);
+	errno = saved_errno;
+	return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * uevent_monitor_receive:
+ * @fd: socket from uevent_monitor_open()
+ *
+ * Receive the next uevent. Messages which are not from the kernel or udevd,
+ * or are malformed, are skipped.
+ *
+ * Returns: A newly allocated string with the event's properties as
+ *          "KEY=VALUE\n" lines, or NULL with errno set if no message is
+ *          available (EAGAIN) or on error.
+ */
+char *
+uevent_monitor_receive(int fd)
+{
+    char buf[UEVENT_BUFSIZE];
+    char cred_msg[CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_nl sender;
+
+    for (;;) {
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof buf - 1 };
+	struct msghdr msg = {
+	    .msg_name = &sender,
+	    .msg_namelen = sizeof sender,
+	    .msg_iov = &iov,
+	    .msg_iovlen = 1,
+	    .msg_control = cred_msg,
+	    .msg_controllen = sizeof cred_msg,
+	};
+	struct cmsghdr *cmsg;
+	const char *props;
+	size_t props_len;
+	ssize_t len;
+	char *result;
+
+	len = recvmsg(fd, &msg, 0);
+	if (len < 0)
+	    return NULL;
+	if (len < 32 || (msg.msg_flags & MSG_TRUNC))
+	    continue;
+	buf[len] = '\0';
+
+	/* only trust root-owned senders */
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS ||
+	    ((struct ucred *) CMSG_DATA(cmsg))->uid != 0)
+	    continue;
+
+	if (memcmp(buf, "libudev", 8) == 0) {
+	    struct udev_monitor_netlink_header *nlh = (struct udev_monitor_netlink_header *) buf;
+
+	    if ((size_t) len < sizeof *nlh || ntohl(nlh->magic) != UDEV_MONITOR_MAGIC ||
+		nlh->properties_off < sizeof *nlh ||
+		(size_t) nlh->properties_off + nlh->properties_len > (size_t) len)
+		continue;
+	    props = buf + nlh->properties_off;
+	    props_len = nlh->properties_len;
+	} else {
+	    /* kernel messages start with "action@devpath" */
+	    size_t head_len = strlen(buf) + 1;
+
+	    if (sender.nl_pid != 0 || strchr(buf, '@') == NULL || head_len >= (size_t) len)
+		continue;
+	    props = buf + head_len;
+	    props_len = len - head_len;
+	}
+
+	/* NUL separated properties, convert to lines */
+	result = malloc(props_len + 2);
+	if (result == NULL)
+	    return NULL;
+	memcpy(result, props, props_len);
+	if (props_len > 0 && result[props_len - 1] == '\0')
+	    --props_len;
+	for (size_t i = 0; i < props_len; ++i)
+	    if (result[i] == '\0')
+		result[i] = '\n';
+	result[props_len] = '\n';
+	result[props_len + 1] = '\0';
+	return result;
+    }
+}
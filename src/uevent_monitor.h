@@ -0,0 +1,11 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * uevent_monitor.h - Listen to the kernel or udev uevent netlink stream
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+int uevent_monitor_open(bool udev);
+char *uevent_monitor_receive(int fd);
@@ -21,6 +21,7 @@
 #include <stdio.h>
 #include <assert.h>
 #include <limits.h>
+#include <stdint.h>
 #include <glob.h>
 #include <errno.h>
 #include <err.h>
@@ -36,39 +37,58 @@
 
 #define UEVENT_BUFSIZE 16384
 
+#define UDEV_MONITOR_MAGIC                0xfeedcafe
+struct udev_monitor_netlink_header {
+    /* "libudev" prefix to distinguish libudev and kernel messages */
+    char prefix[8];
+    /*
+     * magic to protect against daemon <-> library message format mismatch
+     * used in the kernel from socket filter rules; needs to be stored in network order
+     */
+    unsigned int magic;
+    /* total length of header structure known to the sender */
+    unsigned int header_size;
+    /* properties string buffer */
+    unsigned int properties_off;
+    unsigned int properties_len;
+    /*
+     * hashes of primary device properties strings, to let libudev subscribers
+     * use in-kernel socket filters; values need to be stored in network order
+     */
+    unsigned int filter_subsystem_hash;
+    unsigned int filter_devtype_hash;
+    unsigned int filter_tag_bloom_hi;
+    unsigned int filter_tag_bloom_lo;
+};
+
+/* one fully built message, queued for delivery */
+typedef struct {
+    struct udev_monitor_netlink_header nlh;
+    char properties[];
+} uevent_message;
+
 struct _uevent_sender {
     char *rootpath;
     char socket_glob[PATH_MAX];
     struct udev *udev;
-};
-
-uevent_sender *
-uevent_sender_open(const char *rootpath)
-{
-    uevent_sender *s;
-
-    assert(rootpath != NULL);
-    s = calloc(1, sizeof(uevent_sender));
-    if (!s)
-	err(EXIT_FAILURE, "uevent_sender_open: cannot allocate struct");
-    s->rootpath = strdupx(rootpath);
-    s->udev = udev_new();
-    snprintf(s->socket_glob, sizeof(s->socket_glob), "%s/event[0-9]*", rootpath);
 
-    return s;
-}
+    /* messages built by uevent_sender_send() which were not delivered yet */
+    unsigned batch_depth;
+    uevent_message **queue;
+    size_t queue_len;
+    size_t queue_capacity;
 
-void
-uevent_sender_close(uevent_sender * sender)
-{
-    udev_unref(sender->udev);
-    free(sender->rootpath);
-    free(sender);
-}
+    /* delivery statistics, counted per listener */
+    uint64_t delivered;
+    uint64_t dropped;
+};
 
+/* Deliver all queued messages to one listener, over a single connection */
 static void
-sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
+sendmsg_one(uevent_sender * sender, const char *path)
 {
+    uevent_message **messages = sender->queue;
+    size_t n_messages = sender->queue_len;
     struct sockaddr_un event_addr;
     int fd;
     int ret;
@@ -88,40 +108,55 @@ sendmsg_one(struct iovec *iov, size_t iov_len, const char *path)
 	    /* client side closed its monitor underneath us, so clean up and ignore */
 	    unlink(event_addr.sun_path);
 	    close(fd);
+	    sender->dropped += n_messages;
 	    return;
 	}
 	err(EXIT_FAILURE, "sendmsg_one: cannot connect to client's event socket");
     }
 
-    const struct msghdr msg = { .msg_name = &event_addr, .msg_iov = iov, .msg_iovlen = iov_len };
-    ssize_t count;
-    int retries;
-    for (retries = 0; retries < 5; ++retries) {
-	count = sendmsg(fd, &msg, 0);
-	if (count >= 0)
-	    break;
-	if (errno == ECONNREFUSED) {
-	    /* client side closed its monitor underneath us, so clean up and ignore */
-	    unlink(event_addr.sun_path);
-	    close(fd);
-	    return;
+    for (size_t i = 0; i < n_messages; ++i) {
+	struct iovec iov[2] = {
+	    { .iov_base = &messages[i]->nlh, .iov_len = sizeof(struct udev_monitor_netlink_header) },
+	    { .iov_base = messages[i]->properties, .iov_len = messages[i]->nlh.properties_len },
+	};
+	const struct msghdr msg = { .msg_name = &event_addr, .msg_iov = iov, .msg_iovlen = 2 };
+	ssize_t count;
+	int retries;
+	for (retries = 0; retries < 5; ++retries) {
+	    count = sendmsg(fd, &msg, 0);
+	    if (count >= 0)
+		break;
+	    if (errno == ECONNREFUSED) {
+		/* client side closed its monitor underneath us, so clean up and ignore */
+		unlink(event_addr.sun_path);
+		close(fd);
+		sender->dropped += n_messages - i;
+		return;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		/* temporary resource shortage, retry after a brief pause */
+		usleep(1000 * (retries + 1));  /* ms */
+		continue;
+	    }
+	    /* other errors are fatal */
+	    err(EXIT_FAILURE, "uevent_sender sendmsg_one: sendmsg failed");
 	}
-	if (errno == EAGAIN || errno == EWOULDBLOCK) {
-	    /* temporary resource shortage, retry after a brief pause */
-	    usleep(1000 * (retries + 1));  /* ms */
+	if (count < 0) {
+	    /* the kernel drops uevents for congested netlink listeners too (ENOBUFS) */
+	    fprintf(stderr, "WARNING: uevent_sender sendmsg_one: listener %s is congested, dropping event after %d retries\n",
+		    path, retries);
+	    sender->dropped++;
 	    continue;
 	}
-	/* other errors are fatal */
-	err(EXIT_FAILURE, "uevent_sender sendmsg_one: sendmsg failed");
+	/* printf("passed %zi bytes to event socket %s\n", count, path); */
+	sender->delivered++;
     }
-    if (count < 0)
-	err(EXIT_FAILURE, "uevent_sender sendmsg_one: sendmsg failed after %d retries", retries);
-    /* printf("passed %zi bytes to event socket %s\n", count, path); */
     close(fd);
 }
 
+/* Deliver all queued messages to all current listeners, and empty the queue */
 static void
-sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
+sendmsg_all(uevent_sender * sender)
 {
     glob_t gl;
     int res;
@@ -131,7 +166,7 @@ sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
     if (res == 0) {
 	size_t i;
 	for (i = 0; i < gl.gl_pathc; ++i)
-	    sendmsg_one(iov, iov_len, gl.gl_pathv[i]);
+	    sendmsg_one(sender, gl.gl_pathv[i]);
     } else {
 	/* ensure that we only fail due to that, not due to bad globs */
 	if (res != GLOB_NOMATCH)
@@ -139,31 +174,39 @@ sendmsg_all(uevent_sender * sender, struct iovec *iov, size_t iov_len)
     }
 
     globfree(&gl);
+
+    for (size_t i = 0; i < sender->queue_len; ++i)
+	free(sender->queue[i]);
+    sender->queue_len = 0;
 }
 
-#define UDEV_MONITOR_MAGIC                0xfeedcafe
-struct udev_monitor_netlink_header {
-    /* "libudev" prefix to distinguish libudev and kernel messages */
-    char prefix[8];
-    /*
-     * magic to protect against daemon <-> library message format mismatch
-     * used in the kernel from socket filter rules; needs to be stored in network order
-     */
-    unsigned int magic;
-    /* total length of header structure known to the sender */
-    unsigned int header_size;
-    /* properties string buffer */
-    unsigned int properties_off;
-    unsigned int properties_len;
-    /*
-     * hashes of primary device properties strings, to let libudev subscribers
-     * use in-kernel socket filters; values need to be stored in network order
-     */
-    unsigned int filter_subsystem_hash;
-    unsigned int filter_devtype_hash;
-    unsigned int filter_tag_bloom_hi;
-    unsigned int filter_tag_bloom_lo;
-};
+uevent_sender *
+uevent_sender_open(const char *rootpath)
+{
+    uevent_sender *s;
+
+    assert(rootpath != NULL);
+    s = calloc(1, sizeof(uevent_sender));
+    if (!s)
+	err(EXIT_FAILURE, "uevent_sender_open: cannot allocate struct");
+    s->rootpath = strdupx(rootpath);
+    s->udev = udev_new();
+    snprintf(s->socket_glob, sizeof(s->socket_glob), "%s/event[0-9]*", rootpath);
+
+    return s;
+}
+
+void
+uevent_sender_close(uevent_sender * sender)
+{
+    /* deliver what is left of an unfinished batch */
+    if (sender->queue_len > 0)
+	sendmsg_all(sender);
+    free(sender->queue);
+    udev_unref(sender->udev);
+    free(sender->rootpath);
+    free(sender);
+}
 
 /* taken from systemd/src/basic/MurmurHash2.c */
 static uint32_t
@@ -215,6 +258,61 @@ string_hash32(const char *str)
     return h;
 }
 
+/* taken from systemd/src/libsystemd/sd-device/device-monitor.c */
+static uint64_t
+string_bloom64(const char *str)
+{
+    uint64_t bits = 0;
+    uint32_t hash = string_hash32(str);
+
+    bits |= UINT64_C(1) << (hash & 63);
+    bits |= UINT64_C(1) << ((hash >> 6) & 63);
+    bits |= UINT64_C(1) << ((hash >> 12) & 63);
+    bits |= UINT64_C(1) << ((hash >> 18) & 63);
+    return bits;
+}
+
+/* Compute the tag bloom filter from the TAGS= and CURRENT_TAGS= lines of a
+ * newline separated property list; tags are colon separated, like ":seat:uaccess:" */
+static uint64_t
+tag_bloom_from_properties(const char *properties)
+{
+    uint64_t bits = 0;
+    const char *line = properties;
+
+    while (line != NULL && *line != '\0') {
+	const char *eol = strchr(line, '\n');
+	const char *tags = NULL;
+
+	if (eol == NULL)
+	    eol = line + strlen(line);
+	if (strncmp(line, "TAGS=", 5) == 0)
+	    tags = line + 5;
+	else if (strncmp(line, "CURRENT_TAGS=", 13) == 0)
+	    tags = line + 13;
+
+	while (tags != NULL && tags < eol) {
+	    const char *end = memchr(tags, ':', eol - tags);
+	    size_t len;
+	    char tag[256];
+
+	    if (end == NULL)
+		end = eol;
+	    len = end - tags;
+	    if (len > 0 && len < sizeof tag) {
+		memcpy(tag, tags, len);
+		tag[len] = '\0';
+		bits |= string_bloom64(tag);
+	    }
+	    tags = end + 1;
+	}
+
+	line = (*eol == '\n') ? eol + 1 : eol;
+    }
+
+    return bits;
+}
+
 static size_t
 append_property(char *array, size_t size, size_t offset, const char *name, const char *value)
 {
@@ -237,9 +335,10 @@ uevent_sender_send(uevent_sender * sender, const char *devpath, const char *acti
 {
     char buffer[UEVENT_BUFSIZE];
     size_t buffer_len = 0;
-    struct iovec iov[2];
+    uevent_message *message;
     const char *subsystem;
     const char *devtype;
+    uint64_t tag_bloom;
     char seqnumstr[20];
     struct udev_device *device;
     struct udev_monitor_netlink_header nlh;
@@ -293,20 +392,70 @@ uevent_sender_send(uevent_sender * sender, const char *devpath, const char *acti
     nlh.filter_subsystem_hash = htonl(string_hash32(subsystem));
     if (devtype != NULL)
 	nlh.filter_devtype_hash = htonl(string_hash32(devtype));
-    iov[0].iov_base = &nlh;
-    iov[0].iov_len = sizeof(struct udev_monitor_netlink_header);
+    tag_bloom = tag_bloom_from_properties(properties);
+    if (tag_bloom > 0) {
+	nlh.filter_tag_bloom_hi = htonl(tag_bloom >> 32);
+	nlh.filter_tag_bloom_lo = htonl(tag_bloom & 0xffffffff);
+    }
 
     udev_device_unref(device);
 
-    /* note, not setting nlh.filter_tag_bloom_{hi,lo} for now; if required, copy
-     * from libudev */
-
     /* add properties list */
-    nlh.properties_off = iov[0].iov_len;
+    nlh.properties_off = sizeof(struct udev_monitor_netlink_header);
     nlh.properties_len = buffer_len;
-    iov[1].iov_base = buffer;
-    iov[1].iov_len = buffer_len;
 
-    /* send message */
-    sendmsg_all(sender, iov, 2);
+    /* queue message */
+    message = mallocx(sizeof(uevent_message) + buffer_len);
+    message->nlh = nlh;
+    memcpy(message->properties, buffer, buffer_len);
+    if (sender->queue_len == sender->queue_capacity) {
+	sender->queue_capacity = sender->queue_capacity ? sender->queue_capacity * 2 : 16;
+	sender->queue = reallocarray(sender->queue, sender->queue_capacity, sizeof(uevent_message *));
+	if (sender->queue == NULL)
+	    err(EXIT_FAILURE, "uevent_sender_send: cannot allocate message queue");
+    }
+    sender->queue[sender->queue_len++] = message;
+
+    /* send it right away, unless we are collecting a batch */
+    if (sender->batch_depth == 0)
+	sendmsg_all(sender);
+}
+
+/**
+ * uevent_sender_begin_batch:
+ *
+ * Queue messages from subsequent uevent_sender_send() calls instead of
+ * delivering them right away. Batches can be nested; the messages get
+ * delivered in one pass by the outermost uevent_sender_commit_batch().
+ * A batch applies to all messages of the sender, so callers which share the
+ * sender between threads must keep other threads from sending in between.
+ */
+void
+uevent_sender_begin_batch(uevent_sender * sender)
+{
+    ++sender->batch_depth;
+}
+
+void
+uevent_sender_commit_batch(uevent_sender * sender)
+{
+    assert(sender->batch_depth > 0);
+    if (--sender->batch_depth == 0 && sender->queue_len > 0)
+	sendmsg_all(sender);
+}
+
+/**
+ * uevent_sender_get_stats:
+ *
+ * Get the number of messages which were passed to a listener, and the ones
+ * which got dropped because the listener went away or stayed congested.
+ * Both count each listener separately.
+ */
+void
+uevent_sender_get_stats(uevent_sender * sender, uint64_t *delivered, uint64_t *dropped)
+{
+    if (delivered != NULL)
+	*delivered = sender->delivered;
+    if (dropped != NULL)
+	*dropped = sender->dropped;
 }
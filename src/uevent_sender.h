@@ -19,10 +19,15 @@
 #ifndef __UEVENT_SENDER_H
 #    define __UEVENT_SENDER_H
 
+#include <stdint.h>
+
 typedef struct _uevent_sender uevent_sender;
 
 uevent_sender *uevent_sender_open(const char *rootpath);
 void uevent_sender_close(uevent_sender * sender);
 void uevent_sender_send(uevent_sender * sender, const char *devpath, const char *action, const char *properties);
+void uevent_sender_begin_batch(uevent_sender * sender);
+void uevent_sender_commit_batch(uevent_sender * sender);
+void uevent_sender_get_stats(uevent_sender * sender, uint64_t *delivered, uint64_t *dropped);
 
 #endif				/* __UEVENT_SENDER_H */
@@ -55,14 +55,97 @@ public class IoctlData : GLib.Object {
 
     private IOStream stream;
 
-    private IoctlData[] children;
+    /* Resolved pointers; only the first n_children entries are used, so that
+     * recycled objects keep their arrays. children_offset[i] is the offset of
+     * the pointer to children[i] in data. */
+    private IoctlData?[] children;
     private size_t[] children_offset;
+    private int n_children;
+    /* offset -> child, for structs with many pointers like SPI transfers */
+    private HashTable<void*, unowned IoctlData>? child_index;
+    private const int CHILD_INDEX_MIN = 8;
+
+    /* the client's pool that this got taken from */
+    internal IoctlDataPool? pool;
+
+    /* Ranges of data which got changed through update() or mark_dirty(), as
+     * start/end pairs; only the first n_dirty pairs are used. Once
+     * mark_dirty() got called, only these are written back, otherwise the
+     * changes are found by comparing with client_data. */
+    private size_t[] dirty_ranges;
+    private int n_dirty;
+    private bool dirty_tracked;
+    /* differences which are closer than this get written back together */
+    private const size_t MERGE_GAP = 32;
 
     internal IoctlData(IOStream stream)
     {
         this.stream = stream;
     }
 
+    private unowned IoctlData? find_child(size_t offset) {
+        if (child_index != null)
+            return child_index.lookup((void*) offset);
+
+        for (int i = 0; i < n_children; i++) {
+            if (children_offset[i] == offset)
+                return children[i];
+        }
+        return null;
+    }
+
+    private void add_child(size_t offset, IoctlData child) {
+        if (n_children == children.length) {
+            int size = n_children > 0 ? 2 * n_children : 4;
+            children.resize(size);
+            children_offset.resize(size);
+        }
+        children[n_children] = child;
+        children_offset[n_children] = offset;
+        n_children++;
+
+        if (child_index != null) {
+            child_index.insert((void*) offset, child);
+        } else if (n_children > CHILD_INDEX_MIN) {
+            child_index = new HashTable<void*, unowned IoctlData>(direct_hash, direct_equal);
+            for (int i = 0; i < n_children; i++)
+                child_index.insert((void*) children_offset[i], children[i]);
+        }
+    }
+
+    private void clear_children() {
+        for (int i = 0; i < n_children; i++)
+            children[i] = null;
+        n_children = 0;
+        child_index = null;
+    }
+
+    /* Prepare a recycled object for len bytes of new data */
+    internal void reset(size_t len) {
+        clear_children();
+        clear_dirty();
+        client_addr = 0;
+        if ((size_t) data.length == len)
+            Posix.memset(data, 0, len);
+        else
+            data = new uint8[len];
+    }
+
+    /* Hand this and the resolved children which nobody else holds a
+     * reference to back to their pool */
+    internal void recycle() {
+        IoctlDataPool? p = (owned) pool;
+
+        for (int i = 0; i < n_children; i++) {
+            if (children[i] != null && children[i].ref_count == 1)
+                children[i].recycle();
+        }
+        clear_children();
+
+        if (p != null)
+            p.put(this);
+    }
+
     /**
      * umockdev_ioctl_data_ref:
      * @self: A #UMockdevIoctlData
@@ -108,20 +191,22 @@ public class IoctlData : GLib.Object {
     public IoctlData? resolve(size_t offset, size_t len) throws IOError {
         IoctlData res;
 
-        for (int i = 0; i < children.length; i++) {
-            if (children_offset[i] == offset)
-                return children[i];
-        }
+        unowned IoctlData? existing = find_child(offset);
+        if (existing != null)
+            return existing;
 
         if (offset + sizeof(size_t) > data.length)
             return null;
 
-        res = new IoctlData(stream);
-        res.data = new uint8[len];
+        if (pool != null) {
+            res = pool.take(len);
+        } else {
+            res = new IoctlData(stream);
+            res.data = new uint8[len];
+        }
         res.client_addr = *((size_t*) &data[offset]);
 
-        children += res;
-        children_offset += offset;
+        add_child(offset, res);
 
         /* Don't try to resolve null pointers. */
         if (res.client_addr == 0 || len == 0)
@@ -129,6 +214,8 @@ public class IoctlData : GLib.Object {
 
         *((size_t*) &data[offset]) = (size_t) res.data;
 
+        if (pool != null)
+            pool.resolves++;
         res.load_data();
 
         return res;
@@ -154,15 +241,11 @@ public class IoctlData : GLib.Object {
      * Since: 0.16
      */
     public bool set_ptr(size_t offset, IoctlData child) {
-
-        foreach (size_t o in children_offset) {
-            assert(o != offset);
-        }
+        assert(find_child(offset) == null);
 
         assert(offset + sizeof(size_t) <= data.length);
 
-        children += child;
-        children_offset += offset;
+        add_child(offset, child);
 
         *((size_t*) &data[offset]) = (size_t) child.data;
 
@@ -189,8 +272,7 @@ public class IoctlData : GLib.Object {
     public bool reload() throws IOError {
         load_data();
 
-        children.resize(0);
-        children_offset.resize(0);
+        clear_children();
 
         return true;
     }
@@ -212,6 +294,65 @@ public class IoctlData : GLib.Object {
         assert(offset + new_data.length <= data.length);
 
         Posix.memcpy(&data[offset], new_data, new_data.length);
+        /* remember the range in case the caller also uses mark_dirty(), but
+         * keep comparing all data, as update() users may also change the
+         * data directly */
+        add_dirty_range(offset, new_data.length);
+    }
+
+    /**
+     * umockdev_ioctl_data_mark_dirty:
+     * @self: A #UMockdevIoctlData
+     * @offset: Offset into data
+     * @length: Number of changed bytes
+     *
+     * Declare that a range of the data got modified. By default, the whole
+     * data gets compared to the client's memory to find the changes that
+     * need to be synced back to the client. Once this got called, only the
+     * marked ranges (and the ones set with umockdev_ioctl_update()) are synced
+     * back, which saves comparing and copying large buffers; so if you use
+     * this, you need to mark all changes that you make directly to the data.
+     *
+     * Since: 0.20
+     */
+    public void mark_dirty(size_t offset, size_t length) {
+        dirty_tracked = true;
+        add_dirty_range(offset, length);
+    }
+
+    private void add_dirty_range(size_t offset, size_t length) {
+        size_t start = offset;
+        size_t end = offset + length;
+
+        assert(end <= data.length);
+        if (length == 0)
+            return;
+
+        /* merge with overlapping or adjacent ranges */
+        for (int i = 0; i < n_dirty;) {
+            if (dirty_ranges[2 * i] <= end && start <= dirty_ranges[2 * i + 1]) {
+                if (dirty_ranges[2 * i] < start)
+                    start = dirty_ranges[2 * i];
+                if (dirty_ranges[2 * i + 1] > end)
+                    end = dirty_ranges[2 * i + 1];
+                n_dirty--;
+                dirty_ranges[2 * i] = dirty_ranges[2 * n_dirty];
+                dirty_ranges[2 * i + 1] = dirty_ranges[2 * n_dirty + 1];
+            } else {
+                i++;
+            }
+        }
+
+        if (2 * n_dirty + 2 > dirty_ranges.length)
+            dirty_ranges.resize(n_dirty > 0 ? 4 * n_dirty : 8);
+        dirty_ranges[2 * n_dirty] = start;
+        dirty_ranges[2 * n_dirty + 1] = end;
+        n_dirty++;
+    }
+
+    private void clear_dirty() {
+        n_dirty = 0;
+        dirty_tracked = false;
     }
 
     /**
@@ -240,7 +381,9 @@ public class IoctlData : GLib.Object {
         if (client_addr == 0)
             return;
 
-        client_data = new uint8[data.length];
+        if (client_data == null || client_data.length != data.length)
+            client_data = new uint8[data.length];
+        clear_dirty();
 
         args[0] = 5; /* READ_MEM */
         args[1] = client_addr;
@@ -250,6 +393,9 @@ public class IoctlData : GLib.Object {
         input.read_all(client_data, null, null);
 
         Posix.memcpy(data, client_data, data.length);
+
+        if (pool != null)
+            pool.read_mem_bytes += data.length;
     }
 
     /*
@@ -257,52 +403,198 @@ public class IoctlData : GLib.Object {
      * pointers are submitted in terms of the client.
      */
     internal async void flush() throws GLib.Error {
-        uint8[] submit_data = data;
-
-        for (int i = 0; i < children.length; i++) {
+        for (int i = 0; i < n_children; i++)
             yield children[i].flush();
 
-            *((size_t*) &submit_data[children_offset[i]]) = children[i].client_addr;
-        }
-
-        if (client_addr != 0 &&
-            submit_data.length == client_data.length &&
-            Posix.memcmp(submit_data, client_data, submit_data.length) != 0) {
+        if (client_addr == 0 || data.length != client_data.length)
+            return;
 
-            OutputStream output = stream.get_output_stream();
-            ulong args[3];
+        OutputStream output = stream.get_output_stream();
+        size_t[] ranges = changed_ranges();
+        ulong args[3];
 
+        for (int i = 0; i < ranges.length; i += 2) {
             args[0] = 6; /* WRITE_MEM */
-            args[1] = client_addr;
-            args[2] = submit_data.length;
+            args[1] = client_addr + ranges[i];
+            args[2] = ranges[i + 1] - ranges[i];
 
             yield output.write_all_async((uint8[])args, 0, null, null);
-            yield output.write_all_async(submit_data, 0, null, null);
+            yield output.write_all_async(client_data[ranges[i]:ranges[i + 1]], 0, null, null);
+            count_written(args[2]);
         }
+        clear_dirty();
     }
 
-    internal void flush_sync() throws IOError {
-        uint8[] submit_data = data;
+    /*
+     * Like flush(), but instead of writing, append the client addresses and
+     * data slices of the WRITE_MEM requests to addrs and slices, so that the
+     * caller can send them together with other data.
+     */
+    internal void collect_writes(ref size_t[] addrs, ref OutputVector[] slices) {
+        for (int i = 0; i < n_children; i++)
+            children[i].collect_writes(ref addrs, ref slices);
 
-        for (int i = 0; i < children.length; i++) {
-            children[i].flush_sync();
+        if (client_addr == 0 || data.length != client_data.length)
+            return;
 
-            *((ulong*) &submit_data[children_offset[i]]) = children[i].client_addr;
+        size_t[] ranges = changed_ranges();
+
+        for (int i = 0; i < ranges.length; i += 2) {
+            OutputVector slice = { &client_data[ranges[i]], ranges[i + 1] - ranges[i] };
+            addrs += client_addr + ranges[i];
+            slices += slice;
+            count_written(slice.size);
         }
+        clear_dirty();
+    }
+
+    private void count_written(size_t len) {
+        if (pool != null)
+            pool.write_mem_bytes += len;
+    }
+
+    internal void flush_sync() throws IOError {
+        for (int i = 0; i < n_children; i++)
+            children[i].flush_sync();
 
-        if (client_addr != 0 &&
-            submit_data.length == client_data.length &&
-            Posix.memcmp(submit_data, client_data, submit_data.length) != 0) {
+        if (client_addr == 0 || data.length != client_data.length)
+            return;
 
-            OutputStream output = stream.get_output_stream();
-            ulong args[3];
+        OutputStream output = stream.get_output_stream();
+        size_t[] ranges = changed_ranges();
+        ulong args[3];
 
+        for (int i = 0; i < ranges.length; i += 2) {
             args[0] = 6; /* WRITE_MEM */
-            args[1] = client_addr;
-            args[2] = submit_data.length;
+            args[1] = client_addr + ranges[i];
+            args[2] = ranges[i + 1] - ranges[i];
 
             output.write_all((uint8[])args, null, null);
-            output.write_all(submit_data, null, null);
+            output.write_all(client_data[ranges[i]:ranges[i + 1]], null, null);
+            count_written(args[2]);
+        }
+        clear_dirty();
+    }
+
+    /* Let the resolved pointers in data point to the client's memory, or
+     * back to the local copies; pointers which did not get resolved (NULL or
+     * zero length) always keep the client address. */
+    private void set_child_pointers(bool client) {
+        for (int i = 0; i < n_children; i++) {
+            unowned IoctlData c = children[i];
+            bool resolved = c.client_addr != 0 && c.data.length > 0;
+            *((size_t*) &data[children_offset[i]]) = (client || !resolved) ? c.client_addr : (size_t) c.data;
+        }
+    }
+
+    /*
+     * Find the ranges of data which differ from the client's memory, as
+     * start/end pairs, and copy them into client_data, which then has the
+     * bytes to write back. Resolved pointers are compared in terms of the
+     * client.
+     */
+    private size_t[] changed_ranges() {
+        size_t[] ranges = {};
+        size_t len = data.length;
+
+        set_child_pointers(true);
+
+        if (dirty_tracked) {
+            for (int i = 0; i < n_dirty; i++) {
+                ranges += dirty_ranges[2 * i];
+                ranges += dirty_ranges[2 * i + 1];
+            }
+            /* pointers which got changed by set_ptr() */
+            for (int i = 0; i < n_children; i++) {
+                size_t o = children_offset[i];
+                if (Posix.memcmp(&data[o], &client_data[o], sizeof(size_t)) != 0) {
+                    ranges += o;
+                    ranges += o + sizeof(size_t);
+                }
+            }
+        } else {
+            size_t i = 0;
+
+            while (i < len) {
+                /* skip equal blocks quickly */
+                while (i + 64 <= len && Posix.memcmp(&data[i], &client_data[i], 64) == 0)
+                    i += 64;
+                while (i < len && data[i] == client_data[i])
+                    i++;
+                if (i == len)
+                    break;
+
+                /* extend the range until there are enough equal bytes, as
+                 * every write has some overhead */
+                size_t start = i;
+                size_t end = i + 1;
+                for (i = end; i < len && i < end + MERGE_GAP; i++) {
+                    if (data[i] != client_data[i])
+                        end = i + 1;
+                }
+                ranges += start;
+                ranges += end;
+            }
+        }
+
+        for (int i = 0; i < ranges.length; i += 2)
+            Posix.memcpy(&client_data[ranges[i]], &data[ranges[i]], ranges[i + 1] - ranges[i]);
+
+        set_child_pointers(false);
+        return ranges;
+    }
+}
+
+/* Free IoctlData objects of a client. Clients tend to do the same requests
+ * over and over, so the objects and their buffers get reused instead of
+ * allocating new ones for every request. Pooled objects do not reference the
+ * pool, so there is no reference cycle. */
+internal class IoctlDataPool : GLib.Object {
+    private const uint MAX_FREE = 64;
+
+    private IOStream stream;
+    private GenericArray<IoctlData> free_list = new GenericArray<IoctlData>();
+
+    /* client traffic of the current request, for IoctlBase.get_stats() */
+    public uint64 read_mem_bytes;
+    public uint64 write_mem_bytes;
+    public uint64 resolves;
+
+    public IoctlDataPool(IOStream stream)
+    {
+        this.stream = stream;
+    }
+
+    public IoctlData take(size_t len) {
+        IoctlData res = null;
+
+        lock (free_list) {
+            if (free_list.length > 0) {
+                res = free_list[free_list.length - 1];
+                free_list.remove_index_fast(free_list.length - 1);
+            }
+        }
+
+        if (res != null) {
+            res.reset(len);
+        } else {
+            res = new IoctlData(stream);
+            res.data = new uint8[len];
+        }
+        res.pool = this;
+        return res;
+    }
+
+    public void reset_counters() {
+        read_mem_bytes = 0;
+        write_mem_bytes = 0;
+        resolves = 0;
+    }
+
+    public void put(IoctlData data) {
+        lock (free_list) {
+            if (free_list.length < MAX_FREE)
+                free_list.add(data);
         }
     }
 }
@@ -350,6 +642,7 @@ public class IoctlClient : GLib.Object {
     private IoctlBase handler;
     private IOStream stream;
     private GLib.MainContext _ctx;
+    private IoctlDataPool pool;
 
     [Description(nick = "device node", blurb = "The device node the client opened")]
     public string devnode { get; }
@@ -367,13 +660,29 @@ public class IoctlClient : GLib.Object {
 
     private ulong _cmd;
     private bool _abort;
+    /* a handler is running; handlers may still hold references to the data
+     * of a request they completed, so recycle that after they returned */
+    private bool _dispatching;
+    private IoctlData? _done_arg;
     private long result;
     private int result_errno;
 
+    /* for IoctlBase.get_stats() */
+    private ulong _stats_cmd;
+    private ulong _stats_request;
+    private bool _unhandled;
+    private int64 _start_time;
+    private int64 _latency;
+
+    /* signal ids, to avoid looking up the names for every request */
+    private static uint handle_ioctl_signal;
+    private static uint handle_read_signal;
+    private static uint handle_write_signal;
+
     static construct {
-        GLib.Signal.@new("handle-ioctl", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
-        GLib.Signal.@new("handle-read", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
-        GLib.Signal.@new("handle-write", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
+        handle_ioctl_signal = GLib.Signal.@new("handle-ioctl", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
+        handle_read_signal = GLib.Signal.@new("handle-read", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
+        handle_write_signal = GLib.Signal.@new("handle-write", typeof(IoctlClient), GLib.SignalFlags.RUN_LAST, 0, signal_accumulator_true_handled, null, null, typeof(bool), 0);
     }
 
     /**
@@ -448,9 +757,30 @@ public class IoctlClient : GLib.Object {
 
         this.result = res;
         this.result_errno = errno_;
+        this._latency = get_monotonic_time() - _start_time;
 
-        /* Push us into the correct main context. */
-        _ctx.invoke(complete_idle);
+        /* Handlers usually answer right away from their signal handler, i. e.
+         * in our own context; then there is no need to go through the main
+         * loop. Otherwise push us into the correct main context, which also
+         * serializes us with a still running complete_async(). */
+        if (_ctx.is_owner() && !stream.get_output_stream().has_pending()) {
+            try {
+                complete_inline();
+            } catch (GLib.Error e) {
+                /* The client did not get the result, so disconnect it instead
+                 * of letting it wait for it forever. It is normal that the
+                 * client went away. */
+                if (!(e is IOError.BROKEN_PIPE))
+                    warning("Error completing request: %s", e.message);
+                if (!stream.is_closed()) {
+                    try {
+                        stream.close();
+                    } catch (IOError ce) {}
+                }
+            }
+        } else {
+            _ctx.invoke(complete_idle);
+        }
     }
 
     /**
@@ -485,17 +815,123 @@ public class IoctlClient : GLib.Object {
             args[2] = 0;
         }
 
-        /* Nullify request information */
+        record_stats();
+        finish_request();
+
+        yield output.write_all_async((uint8[])args, 0, null, null);
+
+        /* And, finally re-queue ourself for receiving. */
+        read_ioctl.begin();
+    }
+
+    /* Synchronous version of complete_async(), which sends the changed data
+     * and the result with a single sendmsg(). */
+    private void complete_inline() throws GLib.Error {
+        size_t[] addrs = {};
+        OutputVector[] slices = {};
+
+        _arg.collect_writes(ref addrs, ref slices);
+
+        /* WRITE_MEM header and data for each slice, then DONE/ABORT */
+        ulong[] headers = new ulong[3 * slices.length + 3];
+        OutputVector[] vectors = new OutputVector[2 * slices.length + 1];
+        for (int i = 0; i < slices.length; i++) {
+            headers[3 * i] = 6; /* WRITE_MEM */
+            headers[3 * i + 1] = addrs[i];
+            headers[3 * i + 2] = slices[i].size;
+            vectors[2 * i].buffer = &headers[3 * i];
+            vectors[2 * i].size = 3 * sizeof(ulong);
+            vectors[2 * i + 1] = slices[i];
+        }
+
+        int n = 3 * slices.length;
+        if (!_abort) {
+            headers[n] = 3; /* DONE */
+            headers[n + 1] = result;
+            headers[n + 2] = result_errno;
+        } else {
+            headers[n] = 0xff; /* ABORT */
+            headers[n + 1] = 0;
+            headers[n + 2] = 0;
+        }
+        vectors[vectors.length - 1].buffer = &headers[n];
+        vectors[vectors.length - 1].size = 3 * sizeof(ulong);
+
+        /* account before the client can see the result; the vectors point
+         * into _arg, so send before recycling it */
+        record_stats();
+        try {
+            send_vectors(vectors);
+        } finally {
+            finish_request();
+        }
+
+        read_ioctl.begin();
+    }
+
+    /* sendmsg() fails with EMSGSIZE for more than IOV_MAX (1024 on Linux)
+     * vectors */
+    private const int MAX_VECTORS = 1024;
+
+    private void send_vectors(OutputVector[] vectors) throws GLib.Error {
+        OutputStream output = stream.get_output_stream();
+        SocketConnection? conn = stream as SocketConnection;
+
+        for (int start = 0; start < vectors.length; start += MAX_VECTORS) {
+            int end = int.min(start + MAX_VECTORS, vectors.length);
+            size_t sent = 0;
+
+            if (conn != null) {
+                try {
+                    sent = (size_t) conn.socket.send_message(null, vectors[start:end], null, 0);
+                } catch (GLib.Error e) {
+                    /* nothing got sent; the plain writes below report the
+                     * error if it is not specific to sendmsg() */
+                    sent = 0;
+                }
+            }
+
+            /* write whatever did not fit into the socket buffer */
+            for (int i = start; i < end; i++) {
+                OutputVector v = vectors[i];
+                if (sent >= v.size) {
+                    sent -= v.size;
+                    continue;
+                }
+                unowned uint8[] buf = (uint8[]) v.buffer;
+                buf.length = (int) v.size;
+                output.write_all(buf[sent:buf.length], null, null);
+                sent = 0;
+            }
+        }
+    }
+
+    private void record_stats() {
+        handler.record_request(_stats_cmd, _stats_request, _unhandled, result, result_errno, _latency, pool);
+    }
+
+    /* Nullify request information; reuse the data objects for the next
+     * request, unless a handler kept a reference to them */
+    private void finish_request() {
         _cmd = 0;
         _request = 0;
-        _arg = null;
+        if (_dispatching)
+            _done_arg = (owned) _arg;
+        else
+            recycle_arg((owned) _arg);
         result = 0;
         result_errno = 0;
+    }
 
-        yield output.write_all_async((uint8[])args, 0, null, null);
+    private void recycle_arg(owned IoctlData? done_arg) {
+        if (done_arg != null && done_arg.ref_count == 1)
+            done_arg.recycle();
+    }
 
-        /* And, finally re-queue ourself for receiving. */
-        read_ioctl.begin();
+    /* The handler returned and dropped its references to the request data */
+    private void end_dispatch() {
+        _dispatching = false;
+        recycle_arg((owned) _done_arg);
     }
 
     /* Start listening on the given stream.
@@ -526,16 +962,19 @@ public class IoctlClient : GLib.Object {
 
         assert(args[0] == 1 || args[0] == 7 || args[0] == 8);
         _cmd = args[0];
+        _start_time = get_monotonic_time();
+        _stats_cmd = args[0];
+        _stats_request = args[0] == 1 ? args[1] : 0;
+        _unhandled = false;
+        pool.reset_counters();
 
         if (args[0] == 1) {
             _request = args[1];
-            _arg = new IoctlData(stream);
-            _arg.data = new uint8[sizeof(ulong)];
+            _arg = pool.take(sizeof(ulong));
             *(ulong*) _arg.data = args[2];
         } else {
             _request = 0;
-            _arg = new IoctlData(stream);
-            _arg.data = new uint8[args[2]];
+            _arg = pool.take((size_t) args[2]);
             _arg.client_addr = args[1];
 
             try {
@@ -548,22 +987,23 @@ public class IoctlClient : GLib.Object {
         }
 
         bool handled = false;
+        _dispatching = true;
 
+        uint client_signal;
         if (args[0] == 1)
-            GLib.Signal.emit_by_name(this, "handle-ioctl", out handled);
+            client_signal = handle_ioctl_signal;
         else if (args[0] == 7)
-            GLib.Signal.emit_by_name(this, "handle-read", out handled);
+            client_signal = handle_read_signal;
         else
-            GLib.Signal.emit_by_name(this, "handle-write", out handled);
-
-        if (!handled) {
-            if (args[0] == 1)
-                GLib.Signal.emit_by_name(handler, "handle-ioctl", this, out handled);
-            else if (args[0] == 7)
-                GLib.Signal.emit_by_name(handler, "handle-read", this, out handled);
-            else
-                GLib.Signal.emit_by_name(handler, "handle-write", this, out handled);
-        }
+            client_signal = handle_write_signal;
+
+        /* Per-client handlers are rare; without any, the emission would only
+         * run the accumulator and return false. */
+        if (GLib.SignalHandler.has_pending(this, client_signal, 0, false))
+            GLib.Signal.emit(this, client_signal, 0, out handled);
+
+        if (!handled)
+            handled = handler.dispatch(args[0], this);
 
         if (!handled && args[0] == 1) {
             /* No specific handler for this ioctl. First try stateless ioctls
@@ -582,7 +1022,9 @@ public class IoctlClient : GLib.Object {
             } catch (IOError e) {
                 warning("Error resolving IOCtl data: %s", e.message);
 
+                _unhandled = true;
                 complete(-100, 0);
+                end_dispatch();
                 return;
             }
 
@@ -594,7 +1036,7 @@ public class IoctlClient : GLib.Object {
             }
 
             /* Try handling with ioctl tree (stateless ioctls like USB) */
-            tree.execute(null, _request, *(void**) _arg.data, out ret);
+            tree.execute(null, _request, *(void**) _arg.data, out ret, null);
             my_errno = Posix.errno;  /* Capture errno (may be set by tree.execute) */
 
             if (ret == -1) {
@@ -613,10 +1055,15 @@ public class IoctlClient : GLib.Object {
                 my_errno = 0;
             }
 
+            /* the fallbacks did not know the ioctl either */
+            _unhandled = ret == -1 && my_errno == Posix.ENOTTY;
             complete(ret, my_errno);
         } else if (!handled) {
+            _unhandled = true;
             complete(-100, 0);
         }
+
+        end_dispatch();
     }
 
     private bool complete_idle()
@@ -647,6 +1094,7 @@ public class IoctlClient : GLib.Object {
         this.stream = stream;
         this._devnode = devnode;
         this._ctx = GLib.MainContext.get_thread_default();
+        this.pool = new IoctlDataPool(stream);
 
         /* FIXME: There must be a better way to do this in vala? */
         GLib.Signal.connect_object(this.stream, "notify::closed", (GLib.Callback) notify_closed_cb, this, GLib.ConnectFlags.SWAPPED);
@@ -763,6 +1211,62 @@ private class StartListenClosure {
     }
 }
 
+/* Counters for one kind of request, see IoctlBase.get_stats() */
+private class IoctlRequestStats {
+    /* latency buckets for less than 1, 2, 4, ... µs; the last one has the rest */
+    private const int N_BUCKETS = 24;
+
+    public uint64 count;
+    public uint64 unhandled;
+    public uint64 enotty;
+    public uint64 time_total;
+    public uint64 time_max;
+    public uint64 read_mem_bytes;
+    public uint64 write_mem_bytes;
+    public uint64 resolves;
+    public uint64[] histogram = new uint64[N_BUCKETS];
+
+    public void add(int64 latency, bool unhandled, bool enotty, IoctlDataPool pool) {
+        uint64 t = latency > 0 ? (uint64) latency : 0;
+        int bucket = 0;
+
+        while (bucket < N_BUCKETS - 1 && t >= ((uint64) 1 << bucket))
+            bucket++;
+
+        count++;
+        if (unhandled)
+            this.unhandled++;
+        if (enotty)
+            this.enotty++;
+        time_total += t;
+        if (t > time_max)
+            time_max = t;
+        histogram[bucket]++;
+        read_mem_bytes += pool.read_mem_bytes;
+        write_mem_bytes += pool.write_mem_bytes;
+        resolves += pool.resolves;
+    }
+
+    public Variant to_variant() {
+        var dict = new VariantBuilder(VariantType.VARDICT);
+        Variant[] buckets = new Variant[N_BUCKETS];
+
+        for (int i = 0; i < N_BUCKETS; i++)
+            buckets[i] = new Variant.uint64(histogram[i]);
+
+        dict.add("{sv}", "count", new Variant.uint64(count));
+        dict.add("{sv}", "unhandled", new Variant.uint64(unhandled));
+        dict.add("{sv}", "enotty", new Variant.uint64(enotty));
+        dict.add("{sv}", "time-total", new Variant.uint64(time_total));
+        dict.add("{sv}", "time-max", new Variant.uint64(time_max));
+        dict.add("{sv}", "histogram", new Variant.array(VariantType.UINT64, buckets));
+        dict.add("{sv}", "read-mem-bytes", new Variant.uint64(read_mem_bytes));
+        dict.add("{sv}", "write-mem-bytes", new Variant.uint64(write_mem_bytes));
+        dict.add("{sv}", "resolves", new Variant.uint64(resolves));
+        return dict.end();
+    }
+}
+
 
 [ CCode(cname="G_STRUCT_OFFSET(UMockdevIoctlBaseClass, handle_ioctl)") ]
 extern const int IOCTL_BASE_HANDLE_IOCTL_OFFSET;
@@ -774,20 +1278,135 @@ extern const int IOCTL_BASE_HANDLE_WRITE_OFFSET;
 public class IoctlBase: GLib.Object {
     private HashTable<string,Cancellable> listeners;
 
+    /* ioctl request code -> counters */
+    private HashTable<void*, IoctlRequestStats> ioctl_stats;
+    private IoctlRequestStats read_stats;
+    private IoctlRequestStats write_stats;
+
+    private static uint handle_ioctl_signal;
+    private static uint handle_read_signal;
+    private static uint handle_write_signal;
+
     static construct {
-        GLib.Signal.@new("handle-ioctl", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_IOCTL_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
-        GLib.Signal.@new("handle-read", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_READ_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
-        GLib.Signal.@new("handle-write", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_WRITE_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
+        handle_ioctl_signal = GLib.Signal.@new("handle-ioctl", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_IOCTL_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
+        handle_read_signal = GLib.Signal.@new("handle-read", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_READ_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
+        handle_write_signal = GLib.Signal.@new("handle-write", typeof(IoctlBase), GLib.SignalFlags.RUN_LAST, IOCTL_BASE_HANDLE_WRITE_OFFSET, signal_accumulator_true_handled, null, null, typeof(bool), 1, typeof(IoctlClient));
+    }
+
+    /*
+     * Run the handler for a request of the given type (1: ioctl, 7: read,
+     * otherwise write). The signal class closure just calls the virtual
+     * method, so skip the emission if nobody connected to the signal.
+     */
+    internal bool dispatch(ulong type, IoctlClient client)
+    {
+        bool handled = false;
+        uint sig;
+
+        if (type == 1)
+            sig = handle_ioctl_signal;
+        else if (type == 7)
+            sig = handle_read_signal;
+        else
+            sig = handle_write_signal;
+
+        if (GLib.SignalHandler.has_pending(this, sig, 0, false)) {
+            GLib.Signal.emit(this, sig, 0, client, out handled);
+            return handled;
+        }
+
+        if (type == 1)
+            return handle_ioctl(client);
+        else if (type == 7)
+            return handle_read(client);
+        else
+            return handle_write(client);
     }
 
     construct {
         listeners = new HashTable<string,Cancellable>(str_hash, str_equal);
+        ioctl_stats = new HashTable<void*, IoctlRequestStats>(direct_hash, direct_equal);
+        read_stats = new IoctlRequestStats();
+        write_stats = new IoctlRequestStats();
     }
 
     ~IoctlBase()
     {
     }
 
+    /* Account a completed request of the given type (1: ioctl, 7: read,
+     * otherwise write); pool has the client traffic of the request */
+    internal void record_request(ulong type, ulong request, bool unhandled, long res, int errno_,
+                                 int64 latency, IoctlDataPool pool)
+    {
+        bool enotty = res == -1 && errno_ == Posix.ENOTTY;
+
+        lock (ioctl_stats) {
+            unowned IoctlRequestStats stats;
+
+            if (type == 1) {
+                stats = ioctl_stats.lookup((void*) request);
+                if (stats == null) {
+                    var s = new IoctlRequestStats();
+                    stats = s;
+                    ioctl_stats.insert((void*) request, (owned) s);
+                }
+            } else if (type == 7) {
+                stats = read_stats;
+            } else {
+                stats = write_stats;
+            }
+
+            stats.add(latency, unhandled, enotty, pool);
+        }
+    }
+
+    /**
+     * umockdev_ioctl_base_get_stats:
+     * @self: A #UMockdevIoctlBase
+     *
+     * Get statistics about the requests that clients of this handler sent so
+     * far, e. g. to find out which ioctls dominate the time of a test. The
+     * result maps the request ("read", "write", or the ioctl name; unknown
+     * ioctls are given as hex number) to a dictionary with these uint64
+     * values:
+     *
+     *  - count: Number of requests
+     *  - unhandled: Requests which no handler accepted, and for ioctls which
+     *    the built-in fallbacks could not answer either
+     *  - enotty: Requests which failed with ENOTTY
+     *  - time-total, time-max: Time from receiving the request until its
+     *    completion, in µs
+     *  - histogram: Array with the number of requests which took less than
+     *    2^i µs at index i; the last element counts all slower ones
+     *  - read-mem-bytes, write-mem-bytes: Data read from and written to the
+     *    client's memory
+     *  - resolves: Number of pointers which got resolved, i. e. round trips
+     *    to the client
+     *
+     * This call is thread-safe.
+     *
+     * Returns: (transfer full): A #GVariant of type "a{sa{sv}}"
+     * Since: 0.20
+     */
+    public Variant get_stats()
+    {
+        var builder = new VariantBuilder(new VariantType("a{sa{sv}}"));
+
+        lock (ioctl_stats) {
+            ioctl_stats.foreach((request, stats) => {
+                unowned string? name = IoctlTree.name_by_id((ulong) request);
+                builder.add("{s@a{sv}}", name ?? "0x%lX".printf((ulong) request), stats.to_variant());
+            });
+            if (read_stats.count > 0)
+                builder.add("{s@a{sv}}", "read", read_stats.to_variant());
+            if (write_stats.count > 0)
+                builder.add("{s@a{sv}}", "write", write_stats.to_variant());
+        }
+
+        return builder.end();
+    }
+
     internal async void socket_listen(SocketListener listener, string devnode)
     {
         Cancellable cancellable;
@@ -891,19 +1510,139 @@ public class IoctlBase: GLib.Object {
     }
 }
 
-/* Mirror of ioctl_tree.c usbdevfs_reapurb_execute submit_urb static variable */
-private IoctlData? last_submit_urb = null;
+[Compact]
+private class IoctlRecordingCacheEntry {
+    public WeakRef recording;
+}
+
+/* A loaded ioctl recording. This does not change after loading, so that all
+ * handlers which replay the same file (for several devices, or in several
+ * testbeds) share one instance; the replay position is kept in each client. */
+internal class IoctlRecording : GLib.Object {
+
+    /* device node from the @DEV header, null if there is none */
+    public string? device;
+    /* format from the @DEV header; empty for ioctl trees */
+    public string format = "";
+    /* for ioctl trees; null if the recording has no ioctls */
+    public IoctlTree.Tree? tree;
+    /* for other formats, which the handler parses by itself */
+    public string? contents;
+
+    /* recordings which are currently loaded, by file identity */
+    private static HashTable<string, IoctlRecordingCacheEntry>? cache = null;
+    /* number of times that a file got parsed; locked with cache */
+    private static uint n_loads = 0;
+
+    /* Test hook to check that recordings get shared */
+    internal static uint get_n_loads()
+    {
+        lock (cache) {
+            return n_loads;
+        }
+    }
+
+    /* Return the already loaded recording for this file, or load it. Files
+     * which got modified since get loaded again. */
+    public static IoctlRecording load(string path) throws GLib.Error
+    {
+        var info = File.new_for_path(path).query_info(
+            FileAttribute.UNIX_DEVICE + "," + FileAttribute.UNIX_INODE + "," + FileAttribute.STANDARD_SIZE + "," +
+            FileAttribute.TIME_MODIFIED + "," + FileAttribute.TIME_MODIFIED_USEC,
+            FileQueryInfoFlags.NONE);
+        string key = "%u:%s:%s:%s.%u".printf(info.get_attribute_uint32(FileAttribute.UNIX_DEVICE),
+                                             info.get_attribute_uint64(FileAttribute.UNIX_INODE).to_string(),
+                                             info.get_size().to_string(),
+                                             info.get_attribute_uint64(FileAttribute.TIME_MODIFIED).to_string(),
+                                             info.get_attribute_uint32(FileAttribute.TIME_MODIFIED_USEC));
+
+        lock (cache) {
+            if (cache == null)
+                cache = new HashTable<string, IoctlRecordingCacheEntry>(str_hash, str_equal);
+
+            unowned IoctlRecordingCacheEntry? entry = cache.lookup(key);
+            if (entry != null) {
+                var existing = entry.recording.get() as IoctlRecording;
+                if (existing != null) {
+                    debug("IoctlRecording: reusing loaded recording %s", path);
+                    return existing;
+                }
+            }
+
+            var recording = new IoctlRecording(path);
+            n_loads++;
+
+            // drop the entries of recordings which are not used any more
+            cache.foreach_remove((k, e) => e.recording.get() == null);
+            var new_entry = new IoctlRecordingCacheEntry();
+            new_entry.recording.set(recording);
+            cache.replace(key, (owned) new_entry);
+
+            return recording;
+        }
+    }
+
+    private IoctlRecording(string path) throws GLib.Error
+    {
+        this.device = IoctlTree.compiled_device(path);
+        if (this.device != null) {
+            this.tree = new IoctlTree.Tree.from_compiled(path);
+            return;
+        }
+
+        Posix.FILE? f = Decompress.fopen(path);
+        if (f == null)
+            throw new GLib.Error(IOError.quark(), IOError.from_errno(Posix.errno),
+                                 "Cannot open %s: %s", path, Posix.strerror(Posix.errno));
+        string? line = null;
+        int c;
+
+        // Grab information from header file; only consume the header, as the
+        // parsers below need to start at the first record
+
+        // Ignore any leading comments
+        while ((c = f.getc()) == '#') {
+            do {
+                c = f.getc();
+            } while (c != '\n' && c != Posix.FILE.EOF);
+        }
+
+        // Next should be our @DEV <devicenode> header
+        if (c == '@')
+            line = UMockdevUtils.read_line(f);
+        else
+            f.ungetc(c);
+
+        // MatchInfo does not copy the subject string, so keep it alive
+        string? header = line != null ? "@" + line : null;
+        MatchInfo header_matcher = null;
+        if (header != null && (new Regex("^@DEV (.*?)( \\((?P<format>[^)]*)\\))?(\n|$)")).match(header, 0, out header_matcher)) {
+            this.device = header_matcher.fetch(1);
+            this.format = header_matcher.fetch_named("format") ?? "";
+        }
+
+        if (this.format == "SPI") {
+            var text = new StringBuilder();
+            while ((line = UMockdevUtils.read_line(f)) != null)
+                text.append(line);
+            this.contents = text.str;
+        } else {
+            this.tree = new IoctlTree.Tree(f);
+        }
+    }
+}
 
 internal class IoctlTreeHandler : IoctlBase {
 
-    private IoctlTree.Tree tree;
+    private IoctlRecording recording;
+    private unowned IoctlTree.Tree? tree;
 
-    public IoctlTreeHandler(string file)
+    public IoctlTreeHandler(IoctlRecording recording)
     {
         base ();
 
-        Posix.FILE f = Posix.FILE.open(file, "r");
-        tree = new IoctlTree.Tree(f);
+        this.recording = recording;
+        this.tree = recording.tree;
     }
 
     public override bool handle_ioctl(IoctlClient client) {
@@ -922,10 +1661,16 @@ internal class IoctlTreeHandler : IoctlBase {
         }
 
         last = client.get_data("last");
+        /* per client state for ioctls which span several requests */
+        unowned IoctlTree.ReplayState? state = client.get_data("replay-state");
+        if (state == null) {
+            client.set_data("replay-state", new IoctlTree.ReplayState());
+            state = client.get_data("replay-state");
+        }
 
         try {
             if (request == Ioctl.CROS_EC_DEV_IOCXCMD_V2) {
-                size += tree.next_ret(last);
+                size += tree.next_ret(last, state);
             }
 
             if (size > 0)
@@ -953,7 +1698,7 @@ internal class IoctlTreeHandler : IoctlBase {
         } else {
             Posix.errno = Posix.ENOTTY;
         }
-        last = tree.execute(last, request, *(void**) client.arg.data, out ret);
+        last = tree.execute(last, request, *(void**) client.arg.data, out ret, state);
         my_errno = Posix.errno;
         Posix.errno = 0;
         if (last != null)
@@ -963,21 +1708,24 @@ internal class IoctlTreeHandler : IoctlBase {
             my_errno = 0;
         }
 
+        /* Mirror of the submitted URB in the C replay state; it needs to stay
+         * alive until it gets reaped */
         if (request == Ioctl.USBDEVFS_SUBMITURB && ret == 0) {
-            last_submit_urb = data;
+            client.set_data("submit-urb", data);
         }
 
-        if ((request == Ioctl.USBDEVFS_REAPURB || request == Ioctl.USBDEVFS_REAPURBNDELAY) && last_submit_urb != null) {
+        unowned IoctlData? submit_urb = client.get_data("submit-urb");
+        if ((request == Ioctl.USBDEVFS_REAPURB || request == Ioctl.USBDEVFS_REAPURBNDELAY) && submit_urb != null) {
             /* Parameter points to a pointer, check whether that is a pointer
              * to our last submit urb. If so, update it so the client sees
              * the right information.
              * This should only happen for REAPURB, but it does not hurt to
              * just always check.
              */
-            if (*(void**) data.data == (void*) last_submit_urb.data) {
-                data.set_ptr(0, last_submit_urb);
+            if (*(void**) data.data == (void*) submit_urb.data) {
+                data.set_ptr(0, submit_urb);
 
-                last_submit_urb = null;
+                client.steal_data<IoctlData>("submit-urb");
             }
         }
 
@@ -993,6 +1741,21 @@ internal class IoctlTreeRecorder : IoctlBase {
     string logfile;
     string device;
     private IoctlTree.Tree tree;
+    private Posix.FILE? journal_file;
+
+    /* Write the recording in the compiled binary format */
+    public bool compiled { get; set; default = false; }
+
+    /* Fold runs of identical requests into repeat blocks when writing */
+    public bool compact { get; set; default = false; }
+
+    /* Append every recorded request to logfile + ".journal" right away, so
+     * that a crash of the recording process does not lose the recording. The
+     * journal gets merged into logfile when the recorder is finished, or
+     * when the next recorder for the same file sees its first client. */
+    public bool journal { get; set; default = false; }
+
+    private bool journal_recovered;
 
     public IoctlTreeRecorder(string device, string file)
     {
@@ -1003,13 +1766,43 @@ internal class IoctlTreeRecorder : IoctlBase {
         this.logfile = file;
         this.device = device;
         log = Posix.FILE.open(logfile, "r");
-        if (log == null)
+        if (log != null) {
+            if (IoctlTree.compiled_device(logfile) != null)
+                error("cannot append to the compiled ioctl recording %s", logfile);
+
+            /* Check @DEV header and parse log */
+            if (log.scanf("@DEV %ms\n", &existing_device_path) == 1 && existing_device_path != device)
+                error("attempt to record two different devices to the same ioctl recording");
+            tree = new IoctlTree.Tree(log);
+        }
+    }
+
+    private string journal_path() {
+        return logfile + ".journal";
+    }
+
+    /* Merge a journal which a crashed recorder left behind. This must not
+     * happen in the constructor, as the log gets written with the format
+     * properties, which are only set after construction. */
+    private void recover_journal() {
+        string? journal_device = null;
+
+        if (journal_recovered)
+            return;
+        journal_recovered = true;
+
+        Posix.FILE f = Posix.FILE.open(journal_path(), "r");
+        if (f == null)
             return;
 
-        /* Check @DEV header and parse log */
-        if (log.scanf("@DEV %ms\n", &existing_device_path) == 1 && existing_device_path != device)
+        if (f.scanf("@DEV %ms\n", &journal_device) == 1 && journal_device != device)
             error("attempt to record two different devices to the same ioctl recording");
-        tree = new IoctlTree.Tree(log);
+        debug("Recovering ioctl recording journal %s", journal_path());
+        tree.read_journal(f);
+
+        /* write the canonical log now, so that the journal can start afresh */
+        write_log = true;
+        flush_log();
     }
 
     ~IoctlTreeRecorder()
@@ -1018,7 +1811,7 @@ internal class IoctlTreeRecorder : IoctlBase {
     }
 
     private void flush_log() {
-        Posix.FILE log;
+        Posix.FILE? log;
 
         /* Only write log file if we ever saw a client. */
         if (!write_log)
@@ -1026,9 +1819,38 @@ internal class IoctlTreeRecorder : IoctlBase {
 
         assert (device != null);
 
-        log = Posix.FILE.open(logfile, "w+");
-        log.printf("@DEV %s\n", device);
-        tree.write(log);
+        if (compact)
+            tree.compact();
+
+        /* Replace the log atomically, so that a crash in between leaves the
+         * previous log and the journal intact. */
+        string tmpfile = logfile + ".tmp";
+        log = Posix.FILE.open(tmpfile, "w+");
+        if (log == null)
+            error("Cannot create ioctl recording %s: %m", tmpfile);
+        if (compiled) {
+            if (tree.write_compiled(log, device) < 0)
+                error("Cannot write compiled ioctl recording %s: %m", tmpfile);
+        } else {
+            log.printf("@DEV %s\n", device);
+            tree.write(log);
+        }
+        if (log.flush() != 0 || Posix.fsync(log.fileno()) != 0)
+            error("Cannot write ioctl recording %s: %m", tmpfile);
+        log = null;
+        if (FileUtils.rename(tmpfile, logfile) != 0)
+            error("Cannot rename %s to %s: %m", tmpfile, logfile);
+
+        /* the journal is only needed until the log is complete */
+        journal_file = null;
+        FileUtils.unlink(journal_path());
+    }
+
+    private void open_journal() {
+        journal_file = Posix.FILE.open(journal_path(), "a");
+        if (journal_file == null)
+            error("Cannot open ioctl recording journal %s: %m", journal_path());
+        journal_file.printf("@DEV %s\n", device);
     }
 
     public override bool handle_ioctl(IoctlClient client) {
@@ -1087,6 +1909,11 @@ internal class IoctlTreeRecorder : IoctlBase {
         /* Record */
         node = new IoctlTree.Tree.from_bin(request, *(void**) client.arg.data, ret);
         if (node != null) {
+            if (journal) {
+                if (journal_file == null)
+                    open_journal();
+                node.write_journal(journal_file);
+            }
             tree.insert((owned) node);
         }
 
@@ -1097,6 +1924,7 @@ internal class IoctlTreeRecorder : IoctlBase {
     }
 
     public override void client_connected(IoctlClient client) {
+        recover_journal();
         write_log = true;
     }
 }
@@ -70,7 +70,10 @@ internal class IoctlUsbPcapHandler : IoctlBase {
         this.bus = bus;
         this.device = device;
 
-        rec = new pcap.pcap.open_offline(file, errbuf);
+        Posix.FILE? f = Decompress.fopen(file);
+        if (f == null)
+            error("Cannot open %s: %m", file);
+        rec = new pcap.pcap.fopen_offline((owned) f, errbuf);
 
         if (rec.datalink() != dlt.USB_LINUX_MMAPPED)
             error("Only DLT_USB_LINUX_MMAPPED recordings are supported!");
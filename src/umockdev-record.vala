@@ -115,10 +115,7 @@ format_hex(uint8[] bytes, int len=-1)
 {
     if (len < 0)
         len = bytes.length;
-    var result = new StringBuilder();
-    for (int i = 0; i < len; ++i)
-        result.append_printf("%02X", bytes[i]);
-    return result.str;
+    return Hex.encode(bytes[0:len]);
 }
 
 static void
@@ -348,7 +345,9 @@ record_ioctl(string root_dir, string arg)
     if (!is_block && devnum.has_prefix("153:"))
         handler = new UMockdev.IoctlSpiRecorder(dev, outfile);
     else
-        handler = new UMockdev.IoctlTreeRecorder(dev, outfile);
+        handler = new UMockdev.IoctlTreeRecorder(dev, outfile) {
+            compiled = opt_ioctl_compiled, compact = opt_compact, journal = opt_ioctl_journal
+        };
 
     string sockpath = Path.build_filename(root_dir, "ioctl", dev);
     handler.register_path(null, dev, sockpath);
@@ -356,6 +355,67 @@ record_ioctl(string root_dir, string arg)
     return handler;
 }
 
+// Read a text ioctl tree recording and its device
+static IoctlTree.Tree
+read_ioctl_tree(string source, out string device)
+{
+    string? line;
+
+    Posix.FILE? f = Decompress.fopen(source);
+    if (f == null)
+        error("Cannot open %s: %m", source);
+
+    // ignore leading comments, then there must be a @DEV header
+    do {
+        line = read_line(f);
+    } while (line != null && line.has_prefix("#"));
+    if (line == null || !line.has_prefix("@DEV "))
+        error("%s has no @DEV header", source);
+    device = line.substring(5).strip();
+    if (device.has_suffix(")"))
+        error("%s is not an ioctl tree recording, cannot convert it", source);
+
+    var tree = new IoctlTree.Tree(f);
+    if (tree == null)
+        error("%s has no valid ioctl records", source);
+    return tree;
+}
+
+// Convert a text ioctl recording into the compiled binary format
+static void
+compile_ioctl(string source, string dest)
+{
+    string device;
+    var tree = read_ioctl_tree(source, out device);
+
+    if (opt_compact)
+        tree.compact();
+
+    Posix.FILE output = Posix.FILE.open(dest, "w");
+    if (output == null)
+        error("Cannot create %s: %m", dest);
+    if (tree.write_compiled(output, device) < 0)
+        error("Cannot write %s: %m", dest);
+}
+
+// Fold repeated ioctls of a text ioctl recording into repeat blocks
+static void
+compact_ioctl(string source, string dest)
+{
+    string device;
+    var tree = read_ioctl_tree(source, out device);
+
+    tree.compact();
+
+    Posix.FILE output = Posix.FILE.open(dest, "w");
+    if (output == null)
+        error("Cannot create %s: %m", dest);
+    output.printf("@DEV %s\n", device);
+    tree.write(output);
+    if (output.flush() != 0 || output.error() != 0)
+        error("Cannot write %s: %m", dest);
+}
+
 // Record reads/writes for given device into outfile
 static uint record_script_counter = 0;
 static void
@@ -374,24 +434,97 @@ record_script(string arg, string format)
     record_script_counter++;
 }
 
+static FileStream? uevents_file = null;
+static int64 uevents_start;
+
+static bool
+record_uevents_cb (int fd, IOCondition condition)
+{
+    string? props;
+    while ((props = UeventMonitor.receive (fd)) != null) {
+        int64 t = get_monotonic_time () - uevents_start;
+        string? action = null;
+        string? devpath = null;
+        string env = "";
+
+        foreach (unowned string line in props.split ("\n")) {
+            if (line.has_prefix ("ACTION="))
+                action = line.substring (7);
+            else if (line.has_prefix ("DEVPATH="))
+                devpath = line.substring (8);
+            else if (line.length > 0)
+                env += "E: " + line + "\n";
+        }
+        if (action == null || devpath == null) {
+            debug ("Ignoring uevent without ACTION or DEVPATH: %s", props);
+            continue;
+        }
+
+        uevents_file.printf ("U: %" + int64.FORMAT + ".%06" + int64.FORMAT + " %s %s\n%s",
+                             t / 1000000, t % 1000000, action, devpath, env);
+        uevents_file.flush ();
+    }
+    if (errno != Posix.EAGAIN)
+        warning ("Cannot receive uevent: %s", strerror (errno));
+
+    return Source.CONTINUE;
+}
+
+static void
+record_uevents (string path)
+{
+    uevents_file = FileStream.open (path, "w");
+    if (uevents_file == null)
+        error ("Cannot create %s: %m", path);
+
+    int fd = UeventMonitor.open (!opt_uevents_kernel);
+    if (fd < 0)
+        error ("Cannot open uevent netlink socket: %m");
+
+    uevents_file.printf ("# umockdev uevent recording, source: %s\n", opt_uevents_kernel ? "kernel" : "udev");
+    uevents_start = get_monotonic_time ();
+    Unix.fd_add (fd, IOCondition.IN, record_uevents_cb);
+}
+
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_devices;
 static bool opt_all = false;
 static string? opt_ioctl = null;
+static bool opt_ioctl_compiled = false;
+static bool opt_ioctl_journal = false;
+static string? opt_compile_ioctl = null;
+static bool opt_compact = false;
+static string? opt_compact_ioctl = null;
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_script;
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_evemu_events;
+static string? opt_uevents = null;
+static bool opt_uevents_kernel = false;
 static bool opt_version = false;
 
 const GLib.OptionEntry[] options = {
     {"all", 'a', 0, OptionArg.NONE, ref opt_all, "Record all devices"},
     {"ioctl", 'i', 0, OptionArg.FILENAME, ref opt_ioctl,
      "Trace ioctls on the device, record into given file. In this case, all positional arguments are a command (and its arguments) to run that gets traced.", "devname=FILE"},
+    {"ioctl-compiled", 0, 0, OptionArg.NONE, ref opt_ioctl_compiled,
+     "With --ioctl, write the recording in the compiled binary format, which loads faster but is specific to this machine's architecture."},
+    {"ioctl-journal", 0, 0, OptionArg.NONE, ref opt_ioctl_journal,
+     "With --ioctl, append each ioctl to FILE.journal as it happens, so that the recording survives a crash. The journal gets merged into FILE at the end, or by the next recording into FILE."},
+    {"compile-ioctl", 0, 0, OptionArg.FILENAME, ref opt_compile_ioctl,
+     "Convert the ioctl recording given as positional argument into the compiled binary format, and write it into given file.", "FILE"},
+    {"compact", 0, 0, OptionArg.NONE, ref opt_compact,
+     "With --ioctl or --compile-ioctl, fold runs of identical consecutive ioctls into repeat blocks, which makes recordings of polling devices much smaller."},
+    {"compact-ioctl", 0, 0, OptionArg.FILENAME, ref opt_compact_ioctl,
+     "Fold runs of identical consecutive ioctls in the ioctl recording given as positional argument into repeat blocks, and write the result into given file.", "FILE"},
     {"script", 's', 0, OptionArg.FILENAME_ARRAY, ref opt_script,
      "Trace reads and writes on the device, record into given file. In this case, all positional arguments are a command (and its arguments) to run that gets traced. Can be specified multiple times.", "devname=FILE"},
     {"evemu-events", 'e', 0, OptionArg.FILENAME_ARRAY, ref opt_evemu_events,
      "Trace evdev event reads on the device, record into given file in EVEMU event format. In this case, all positional arguments are a command (and its arguments) to run that gets traced. Can be specified multiple times.", "devname=FILE"},
+    {"uevents", 'U', 0, OptionArg.FILENAME, ref opt_uevents,
+     "Record the udev uevent stream with timestamps into given file, until the command exits or the recording gets interrupted with Control-C. In this case, all positional arguments are an optional command (and its arguments) to run.", "FILE"},
+    {"uevents-kernel", 0, 0, OptionArg.NONE, ref opt_uevents_kernel,
+     "With --uevents, record the raw kernel uevents instead of the ones processed by udev."},
     {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_devices, "Path of a device in /dev or /sys, or command and arguments with --ioctl.", "DEVICE [...]"},
     {"version", 0, 0, OptionArg.NONE, ref opt_version, "Output version information and exit"},
     { null }
@@ -428,16 +561,40 @@ main (string[] args)
         return 0;
     }
 
+    if (opt_compile_ioctl != null) {
+        if (opt_devices.length != 1 || opt_all || opt_ioctl != null || opt_uevents != null)
+            error("--compile-ioctl needs exactly one ioctl recording as argument and no other mode.");
+        compile_ioctl(opt_devices[0], opt_compile_ioctl);
+        return 0;
+    }
+
+    if (opt_compact_ioctl != null) {
+        if (opt_devices.length != 1 || opt_all || opt_ioctl != null || opt_uevents != null)
+            error("--compact-ioctl needs exactly one ioctl recording as argument and no other mode.");
+        compact_ioctl(opt_devices[0], opt_compact_ioctl);
+        return 0;
+    }
+
     if (opt_all && opt_devices.length > 0)
         error("Specifying a device list together with --all is invalid.");
-    if (!opt_all && opt_devices.length == 0)
+    if (opt_uevents_kernel && opt_uevents == null)
+        error("--uevents-kernel requires --uevents");
+    if (opt_ioctl_compiled && opt_ioctl == null)
+        error("--ioctl-compiled requires --ioctl");
+    if (opt_ioctl_journal && opt_ioctl == null)
+        error("--ioctl-journal requires --ioctl");
+    if (opt_compact && opt_ioctl == null)
+        error("--compact requires --ioctl or --compile-ioctl");
+    if (opt_uevents != null && opt_all)
+        error("--uevents cannot be used together with --all");
+    if (!opt_all && opt_devices.length == 0 && opt_uevents == null)
         error("Need to specify at least one device or --all.");
     if ((opt_ioctl != null || opt_script.length > 0 || opt_evemu_events.length > 0) &&
         (opt_all || opt_devices.length < 1))
         error("For recording ioctls or scripts you have to specify a command to run");
 
     // device dump mode
-    if (opt_ioctl == null && opt_script.length == 0 && opt_evemu_events.length == 0) {
+    if (opt_ioctl == null && opt_script.length == 0 && opt_evemu_events.length == 0 && opt_uevents == null) {
         // Evaluate --all and resolve devices
         if (opt_all)
             opt_devices = all_devices();
@@ -449,6 +606,25 @@ main (string[] args)
         return 0;
     }
 
+    loop = new GLib.MainLoop(null);
+
+    if (opt_uevents != null) {
+        record_uevents (opt_uevents);
+
+        // without a command, record until we get interrupted
+        if (opt_devices.length == 0) {
+#if VALA_0_40
+            Unix.signal_add (Posix.Signal.INT, () => { loop.quit (); return Source.REMOVE; });
+            Unix.signal_add (Posix.Signal.TERM, () => { loop.quit (); return Source.REMOVE; });
+#else
+            Unix.signal_add (Posix.SIGINT, () => { loop.quit (); return Source.REMOVE; });
+            Unix.signal_add (Posix.SIGTERM, () => { loop.quit (); return Source.REMOVE; });
+#endif
+            loop.run ();
+            return 0;
+        }
+    }
+
     // in ioctl/script recording mode opt_devices is the command to run
 
     string? preload = Environment.get_variable("LD_PRELOAD");
@@ -478,7 +654,6 @@ main (string[] args)
 
     // we want to run opt_program as a subprocess instead of execve()ing, so
     // that we can run device script threads in the background
-    loop = new GLib.MainLoop(null);
     try {
         child_pid = spawn_process_under_test (opt_devices, child_watch_cb);
     } catch (Error e) {
@@ -33,6 +33,10 @@ static string[] opt_unix_stream;
 [CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_evemu_events;
 [CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_uevents;
+static double opt_uevents_speed = 1.0;
+static bool opt_ioctl_stats = false;
+[CCode (array_length=false, array_null_terminated=true)]
 static string[] opt_program;
 static bool opt_version = false;
 
@@ -55,6 +59,14 @@ const GLib.OptionEntry[] options = {
     {"evemu-events", 'e', 0, OptionArg.FILENAME_ARRAY, ref opt_evemu_events,
      "Load an evemu .events file into the testbed. Can be specified multiple times.",
      "devname=eventsfilename"},
+    {"uevents", 'U', 0, OptionArg.FILENAME_ARRAY, ref opt_uevents,
+     "Replay an umockdev-record uevent recording into the testbed while the program runs. Can be specified multiple times.",
+     "filename"},
+    {"uevents-speed", 0, 0, OptionArg.DOUBLE, ref opt_uevents_speed,
+     "Speed factor for replaying --uevents recordings; 0 replays them as fast as possible (default: 1)",
+     "factor"},
+    {"ioctl-stats", 0, 0, OptionArg.NONE, ref opt_ioctl_stats,
+     "Print statistics about the emulated ioctl, read, and write requests to stderr at exit", null},
     {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_program, "", ""},
     {"version", 0, 0, OptionArg.NONE, ref opt_version, "Output version information and exit"},
     { null }
@@ -72,9 +84,55 @@ child_watch_cb (Pid pid, int status)
     loop.quit();
 }
 
+static uint64
+stats_value (Variant request_stats, string key)
+{
+    Variant? v = request_stats.lookup_value (key, VariantType.UINT64);
+    return v != null ? v.get_uint64 () : 0;
+}
+
+// one line per device and request, the most expensive ones first
+static void
+print_ioctl_stats (Variant stats)
+{
+    stderr.printf ("%-30s %-30s %10s %10s %10s %12s %10s %10s %12s %12s %10s\n",
+                   "device", "request", "count", "unhandled", "ENOTTY", "total ms",
+                   "mean µs", "max µs", "read bytes", "written bytes", "resolves");
+
+    for (size_t i = 0; i < stats.n_children (); ++i) {
+        Variant dev_stats = stats.get_child_value (i);
+        string dev = dev_stats.get_child_value (0).get_string ();
+        Variant requests = dev_stats.get_child_value (1);
+
+        var rows = new List<Variant> ();
+        for (size_t j = 0; j < requests.n_children (); ++j)
+            rows.append (requests.get_child_value (j));
+        rows.sort ((a, b) => {
+            uint64 ta = stats_value (a.get_child_value (1), "time-total");
+            uint64 tb = stats_value (b.get_child_value (1), "time-total");
+            return ta < tb ? 1 : (ta > tb ? -1 : 0);
+        });
+
+        foreach (unowned Variant row in rows) {
+            string request = row.get_child_value (0).get_string ();
+            Variant r = row.get_child_value (1);
+            uint64 count = stats_value (r, "count");
+            uint64 total = stats_value (r, "time-total");
+
+            stderr.printf ("%-30s %-30s %10s %10s %10s %12.1f %10.1f %10s %12s %12s %10s\n",
+                           dev, request, count.to_string (), stats_value (r, "unhandled").to_string (),
+                           stats_value (r, "enotty").to_string (), total / 1000.0,
+                           count > 0 ? (double) total / count : 0.0, stats_value (r, "time-max").to_string (),
+                           stats_value (r, "read-mem-bytes").to_string (), stats_value (r, "write-mem-bytes").to_string (),
+                           stats_value (r, "resolves").to_string ());
+        }
+    }
+}
+
 static int
 main (string[] args)
 {
+    string[] orig_args = args;
     var oc = new OptionContext ("-- program [args..]");
     oc.set_summary ("Run a program under an umockdev testbed.");
     oc.add_main_entries (options, null);
@@ -90,6 +148,10 @@ main (string[] args)
         return 0;
     }
 
+    // sending the replayed uevents needs the mocked /sys
+    if (opt_uevents.length > 0)
+        ensure_preloaded (orig_args);
+
     string? preload = Environment.get_variable ("LD_PRELOAD");
     if (preload == null)
         preload = "";
@@ -185,6 +247,18 @@ main (string[] args)
         }
     }
 
+    string[] uevents = {};
+    foreach (var path in opt_uevents) {
+        string contents;
+        try {
+            FileUtils.get_contents (path, out contents);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot open %s: %s\n", path, e.message);
+            return 1;
+        }
+        uevents += contents;
+    }
+
     if (opt_program.length == 0) {
         stderr.printf ("No program specified. See --help for how to use umockdev-run\n");
         return 1;
@@ -199,8 +273,26 @@ main (string[] args)
         error("Cannot run %s: %s", opt_program[0], e.message);
     }
 
+    // uevent replay starts with the program, as the recorded timing is relative to that
+    for (int i = 0; i < uevents.length; ++i) {
+        try {
+            testbed.load_uevents_from_string (uevents[i], opt_uevents_speed);
+        } catch (Error e) {
+            stderr.printf ("Error: Invalid uevent recording %s: %s\n", opt_uevents[i], e.message);
+#if VALA_0_40
+            Posix.kill (child_pid, Posix.Signal.TERM);
+#else
+            Posix.kill (child_pid, Posix.SIGTERM);
+#endif
+            return 1;
+        }
+    }
+
     loop.run();
 
+    if (opt_ioctl_stats)
+        print_ioctl_stats (testbed.get_ioctl_stats ());
+
     // free the testbed here already, so that it gets cleaned up before raise()
     testbed = null;
 
@@ -20,25 +20,16 @@ namespace UMockdev {
 
 using Ioctl;
 
-private static uint8
-spi_hexdigit (char c)
-{
-    return (c >= 'a') ? (c - 'a' + 10) :
-           (c >= 'A') ? (c - 'A' + 10) :
-           (c - '0');
-}
-
 private static uint8[]
 spi_decode_hex (string data) throws IOError
 {
     /* hex digits must come in pairs */
     if (data.length % 2 != 0)
         throw new IOError.PARTIAL_INPUT("malformed hexadecimal value: %s", data);
-    var len = data.length;
-    uint8[] bin = new uint8[len / 2];
+    uint8[] bin = new uint8[data.length / 2];
 
-    for (uint i = 0; i < bin.length; ++i)
-        bin[i] = (spi_hexdigit (data[i*2]) << 4) | spi_hexdigit (data[i*2+1]);
+    if (Hex.decode (data, data.length, bin) != (size_t) data.length)
+        throw new IOError.INVALID_DATA("malformed hexadecimal value: %s", data);
 
     return bin;
 }
@@ -127,19 +118,12 @@ internal class IoctlSpiHandler : IoctlSpiBase {
     long replay_chunk;
     long replay_byte;
 
-    public IoctlSpiHandler(string file)
+    /* Parse an already read recording */
+    public IoctlSpiHandler.from_string(string contents)
     {
-        string val;
         base ();
 
-        // Open SPI file
-        try {
-            FileUtils.get_contents(file, out val);
-        } catch (GLib.Error e) {
-            error("Could not read %s: %s", file, e.message);
-        }
-
-        string[] lines = val.split("\n");
+        string[] lines = contents.split("\n");
         unowned TransferChunk* chunk = null;
         foreach (unowned string line in lines) {
             if (line.length == 0)
@@ -427,9 +411,7 @@ internal class IoctlSpiRecorder : IoctlSpiBase {
     }
 
     void write_hex(uint8[] buf) {
-        foreach (uint8 c in buf) {
-            log.printf("%02x", c);
-        }
+        log.puts(Hex.encode(buf, true));
     }
 
     internal override long handle_read_write(IoctlData? tx, IoctlData? rx, bool keep_cs_high) {
@@ -0,0 +1,273 @@
+/**
+ * umockdev-uevent-storm: Generate uevent load against a testbed
+ *
+ * Copyright (C) 2026 umockdev contributors
+ *
+ * umockdev is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * umockdev is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using UMockdevUtils;
+
+[CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_device;
+[CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_action;
+[CCode (array_length=false, array_null_terminated=true)]
+static string[] opt_program;
+static string? opt_sequence = null;
+static int opt_devices = 0;
+static int opt_count = 10000;
+static double opt_rate = 0;
+static int opt_listeners = 1;
+static int opt_delay = 1000;
+static bool opt_version = false;
+
+const GLib.OptionEntry[] options = {
+    {"device", 'd', 0, OptionArg.FILENAME_ARRAY, ref opt_device,
+     "Load an umockdev-record device description into the testbed and send events for its devices. Can be specified multiple times.",
+     "filename"},
+    {"devices", 'n', 0, OptionArg.INT, ref opt_devices,
+     "Create N synthetic devices and send events for them.", "N"},
+    {"action", 'a', 0, OptionArg.STRING_ARRAY, ref opt_action,
+     "Action to send; multiple actions are cycled through (default: change)", "action"},
+    {"sequence", 's', 0, OptionArg.FILENAME, ref opt_sequence,
+     "Replay a file with \"action devpath\" lines instead of cycling devices and actions.", "filename"},
+    {"count", 'c', 0, OptionArg.INT, ref opt_count,
+     "Number of events to send (default: 10000)", "N"},
+    {"rate", 'r', 0, OptionArg.DOUBLE, ref opt_rate,
+     "Target rate in events per second; 0 sends as fast as possible (default)", "N"},
+    {"listeners", 'l', 0, OptionArg.INT, ref opt_listeners,
+     "Number of internal listeners which drain the events (default: 1)", "N"},
+    {"delay", 0, 0, OptionArg.INT, ref opt_delay,
+     "Milliseconds to wait after starting the program before sending events (default: 1000)", "ms"},
+    {"", 0, 0, OptionArg.STRING_ARRAY, ref opt_program, "", ""},
+    {"version", 0, 0, OptionArg.NONE, ref opt_version, "Output version information and exit"},
+    { null }
+};
+
+/* Drains one emulated netlink socket, so that the load does not get
+ * throttled by a full socket buffer. */
+class Listener {
+    public static int received;
+
+    private Socket socket;
+    private Thread<void*> thread;
+    private int running = 1;
+
+    public Listener (string path) throws Error
+    {
+        FileUtils.unlink (path);
+        this.socket = new Socket (SocketFamily.UNIX, SocketType.DATAGRAM, SocketProtocol.DEFAULT);
+        this.socket.bind (new UnixSocketAddress (path), true);
+        this.thread = new Thread<void*> ("listener", this.run);
+    }
+
+    public void stop ()
+    {
+        AtomicInt.set (ref this.running, 0);
+        this.thread.join ();
+    }
+
+    private void* run ()
+    {
+        uint8 buf[8192];
+        while (AtomicInt.get (ref this.running) != 0) {
+            try {
+                if (this.socket.condition_timed_wait (IOCondition.IN, 100000) &&
+                    this.socket.receive (buf) > 0)
+                    AtomicInt.inc (ref received);
+            } catch (Error e) {
+                if (!(e is IOError.TIMED_OUT))
+                    stderr.printf ("Warning: listener receive failed: %s\n", e.message);
+            }
+        }
+        return null;
+    }
+}
+
+static int
+main (string[] args)
+{
+    string[] orig_args = args;
+    var oc = new OptionContext ("[-- program [args..]]");
+    oc.set_summary ("Send a storm of uevents to an umockdev testbed and report the throughput.");
+    oc.add_main_entries (options, null);
+    try {
+        oc.parse (ref args);
+    } catch (Error e) {
+        stderr.printf("Error: %s\nRun %s --help for how to use this program\n", e.message, args[0]);
+        return 1;
+    }
+
+    if (opt_version) {
+        stdout.printf("%s\n", Config.VERSION);
+        return 0;
+    }
+
+    if (opt_count < 0 || opt_devices < 0 || opt_listeners < 0 || opt_rate < 0) {
+        stderr.printf ("Error: --count, --devices, --listeners, and --rate must not be negative\n");
+        return 1;
+    }
+
+    // sending uevents needs the mocked /sys
+    ensure_preloaded (orig_args);
+
+    var testbed = new UMockdev.Testbed ();
+    string[] devpaths = {};
+    string[] actions = {};
+
+    foreach (var path in opt_device) {
+        string record;
+        try {
+            FileUtils.get_contents (path, out record);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot open %s: %s\n", path, e.message);
+            return 1;
+        }
+        try {
+            testbed.add_from_string (record);
+        } catch (Error e) {
+            stderr.printf ("Error: Invalid record file %s: %s\n", path, e.message);
+            return 1;
+        }
+        foreach (unowned string line in record.split ("\n"))
+            if (line.has_prefix ("P: "))
+                devpaths += "/sys" + line.substring (3);
+    }
+
+    for (int i = 0; i < opt_devices; ++i)
+        devpaths += testbed.add_devicev ("misc", "storm%i".printf (i), null, {}, {});
+
+    if (opt_sequence != null) {
+        if (devpaths.length > 0 || opt_action.length > 0) {
+            stderr.printf ("Error: --sequence cannot be combined with --device, --devices, or --action\n");
+            return 1;
+        }
+        string contents;
+        try {
+            FileUtils.get_contents (opt_sequence, out contents);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot open %s: %s\n", opt_sequence, e.message);
+            return 1;
+        }
+        foreach (unowned string raw_line in contents.split ("\n")) {
+            string line = raw_line.strip ();
+            if (line.length == 0 || line[0] == '#')
+                continue;
+            string[] parts = line.split (" ", 2); // action, devpath
+            if (parts.length != 2 || !parts[1].has_prefix ("/sys/")) {
+                stderr.printf ("Error: Invalid line in %s, expected \"action /sys/devpath\": %s\n", opt_sequence, line);
+                return 1;
+            }
+            // create devices which the sequence refers to, but which do not exist yet
+            if (!FileUtils.test (Path.build_filename (testbed.get_root_dir (), parts[1]), FileTest.IS_DIR)) {
+                try {
+                    testbed.add_from_string ("P: %s\nE: SUBSYSTEM=misc\n".printf (parts[1].substring (4)));
+                } catch (Error e) {
+                    stderr.printf ("Error: Cannot create device %s: %s\n", parts[1], e.message);
+                    return 1;
+                }
+            }
+            actions += parts[0];
+            devpaths += parts[1];
+        }
+    } else {
+        foreach (var a in opt_action)
+            actions += a;
+        if (actions.length == 0)
+            actions += "change";
+    }
+
+    if (devpaths.length == 0) {
+        stderr.printf ("Error: No devices to send events for; use --device, --devices, or --sequence\n");
+        return 1;
+    }
+
+    Listener[] listeners = {};
+    for (int i = 0; i < opt_listeners; ++i) {
+        // high numbers to not collide with the fd based sockets of the preload library
+        string path = Path.build_filename (testbed.get_root_dir (), "event%i".printf (1000000 + i));
+        try {
+            listeners += new Listener (path);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot create listener %s: %s\n", path, e.message);
+            return 1;
+        }
+    }
+
+    // the program inherits the preload library from us
+    Pid child_pid = 0;
+    if (opt_program.length > 0) {
+        try {
+            Process.spawn_async (null, opt_program, null,
+                                 SpawnFlags.SEARCH_PATH | SpawnFlags.CHILD_INHERITS_STDIN | SpawnFlags.DO_NOT_REAP_CHILD,
+                                 null, out child_pid);
+        } catch (Error e) {
+            stderr.printf ("Error: Cannot run %s: %s\n", opt_program[0], e.message);
+            return 1;
+        }
+        // give the program some time to set up its udev monitor
+        Thread.usleep (opt_delay * 1000);
+    }
+
+    var stats = new VariantDict (testbed.uevent_storm (devpaths, actions, opt_count, opt_rate));
+
+    // let the listeners catch up
+    Thread.usleep (200000);
+    foreach (var l in listeners)
+        l.stop ();
+
+    // the program must survive the storm; we stop it with SIGTERM
+    bool child_failed = false;
+    if (child_pid != 0) {
+        int status = 0;
+#if VALA_0_40
+        int sigterm = Posix.Signal.TERM;
+#else
+        int sigterm = Posix.SIGTERM;
+#endif
+        if (Posix.waitpid (child_pid, out status, Posix.WNOHANG) != child_pid) {
+#if VALA_0_40
+            Posix.kill (child_pid, Posix.Signal.TERM);
+#else
+            Posix.kill (child_pid, Posix.SIGTERM);
+#endif
+            Posix.waitpid (child_pid, out status, 0);
+            if (Process.if_signaled (status) && Process.term_sig (status) == sigterm)
+                status = 0;
+        }
+        Process.close_pid (child_pid);
+
+        if (Process.if_signaled (status)) {
+            stderr.printf ("Error: %s got killed by signal %i\n", opt_program[0], Process.term_sig (status));
+            child_failed = true;
+        } else if (Process.exit_status (status) != 0) {
+            stderr.printf ("Error: %s exited with code %i\n", opt_program[0], Process.exit_status (status));
+            child_failed = true;
+        }
+    }
+
+    stdout.printf ("events:            %" + uint64.FORMAT + "\n", stats.lookup_value ("events", VariantType.UINT64).get_uint64 ());
+    stdout.printf ("duration:          %.3f s\n", stats.lookup_value ("seconds", VariantType.DOUBLE).get_double ());
+    stdout.printf ("rate:              %.0f events/s\n", stats.lookup_value ("events-per-second", VariantType.DOUBLE).get_double ());
+    foreach (var p in new string[] {"p50", "p90", "p99", "max"})
+        stdout.printf ("latency %-4s       %" + uint64.FORMAT + " µs\n", p,
+                       stats.lookup_value ("latency-" + p, VariantType.UINT64).get_uint64 ());
+    stdout.printf ("delivered:         %" + uint64.FORMAT + "\n", stats.lookup_value ("delivered", VariantType.UINT64).get_uint64 ());
+    stdout.printf ("dropped:           %" + uint64.FORMAT + "\n", stats.lookup_value ("dropped", VariantType.UINT64).get_uint64 ());
+    if (listeners.length > 0)
+        stdout.printf ("received:          %i (internal listeners)\n", AtomicInt.get (ref Listener.received));
+
+    return child_failed ? 1 : 0;
+}
@@ -38,6 +38,39 @@ remove_dir (string path, bool remove_toplevel=true)
         checked_remove(path);
 }
 
+// Read the next line including its line break, if there is one, or return null
+// at the end of the file. Unlike FILE.gets(), this does not split long lines.
+public string?
+read_line (Posix.FILE f)
+{
+    var line = new StringBuilder ();
+    int c;
+
+    while ((c = f.getc ()) != Posix.FILE.EOF) {
+        line.append_c ((char) c);
+        if (c == '\n')
+            break;
+    }
+    return line.len > 0 ? line.str : null;
+}
+
+// Re-execute the current program under the preload library, unless it already
+// runs under it. Tools which send uevents themselves need this, as the uevent
+// sender resolves devices through the mocked /sys. @argv must be the original,
+// unparsed command line.
+public void
+ensure_preloaded (string[] argv)
+{
+    string? preload = Environment.get_variable ("LD_PRELOAD");
+    if (preload != null && preload.contains ("libumockdev-preload"))
+        return;
+
+    checked_setenv ("LD_PRELOAD", "libumockdev-preload.so.0" + (preload == null ? "" : ":" + preload));
+    debug ("re-executing %s under the preload library", argv[0]);
+    Posix.execv ("/proc/self/exe", argv);
+    error ("Cannot re-execute %s under the preload library: %m", argv[0]);
+}
+
 private static Pid process_under_test;
 private static ChildWatchFunc process_under_test_watch_cb;
 
@@ -39,6 +39,16 @@ static void checked_mkdir_with_parents (string path, int mode)
         error("cannot create directory with parents %s: %m", path);
 }
 
+/* Open a recording file which is optionally xz or zstd compressed */
+static DataInputStream open_recording (string path) throws GLib.Error
+{
+    Posix.FILE? f = Decompress.fopen(path);
+    if (f == null)
+        throw new GLib.Error(IOError.quark(), IOError.from_errno(Posix.errno),
+                             "Cannot open %s: %s", path, Posix.strerror(Posix.errno));
+    return new DataInputStream(new RecordingInputStream((owned) f));
+}
+
 /**
  * SECTION:umockdev
  * @title: umockdev
@@ -84,6 +94,11 @@ create_worker_thread(MainLoop loop)
 }
 
 public class Testbed: GLib.Object {
+    static construct {
+        /* create it before any thread can look at it */
+        bus_lookup_table = create_bus_lookup();
+    }
+
     /**
      * umockdev_testbed_new:
      *
@@ -112,17 +127,18 @@ public class Testbed: GLib.Object {
         this.dev_fd = new HashTable<string, int> (str_hash, str_equal);
         this.dev_script_runner = new HashTable<string, ScriptRunner> (str_hash, str_equal);
         this.custom_handlers = new HashTable<string, IoctlBase> (str_hash, str_equal);
+        this.loaded_handlers = new HashTable<string, IoctlBase> (str_hash, str_equal);
 
         checked_setenv ("UMOCKDEV_DIR", this.root_dir);
 
-        this.worker_ctx = new MainContext();
-        this.worker_loop = new MainLoop(this.worker_ctx);
-        this.worker_thread = create_worker_thread(this.worker_loop);
+        this.ev_sender = new UeventSender.sender(this.root_dir);
+        this.uevent_batches = new HashTable<void*, UeventBatch> (direct_hash, direct_equal);
 
         /* Create fallback ioctl handler */
         IoctlBase handler = new IoctlBase();
         string sockpath = Path.build_filename(this.root_dir, "ioctl", "_default");
-        handler.register_path(this.worker_ctx, "_default", sockpath);
+        handler.register_path(this.get_worker_context(), "_default", sockpath);
+        this.loaded_handlers.insert("_default", handler);
 
         debug("Created udev test bed %s", this.root_dir);
     }
@@ -134,6 +150,10 @@ public class Testbed: GLib.Object {
             r.stop ();
         this.dev_script_runner.remove_all();
 
+        foreach (var r in this.uevent_replayers)
+            r.stop ();
+        this.uevent_replayers = {};
+
         this.custom_handlers.foreach((key, val) => {
             val.unregister_path(key);
         });
@@ -153,7 +173,8 @@ public class Testbed: GLib.Object {
 
         debug ("Removing test bed %s", this.root_dir);
         remove_dir (this.root_dir);
-        this.worker_loop.quit();
+        foreach (unowned MainLoop loop in this.worker_loops)
+            loop.quit();
         Environment.unset_variable("UMOCKDEV_DIR");
     }
 
@@ -186,6 +207,47 @@ public class Testbed: GLib.Object {
         return this.sys_dir;
     }
 
+    /**
+     * umockdev_testbed_set_worker_threads:
+     * @self: A #UMockdevTestbed.
+     * @n_threads: Number of worker threads; must be at least 1
+     *
+     * Set the number of threads which run the ioctl, read, and write handlers
+     * of emulated devices. The devices get spread over the worker threads, so
+     * that a slow handler (or a recording which waits for the real device)
+     * does not stall the emulation of the other devices. All clients of one
+     * device are handled in the same thread. But a #UMockdevIoctlBase which
+     * is attached to several devices can run in several threads at the same
+     * time, so it needs to lock any state which it shares between its
+     * clients.
+     *
+     * This only affects devices which get added afterwards. The default is a
+     * single worker thread.
+     *
+     * Since: 0.20
+     */
+    public void set_worker_threads(uint n_threads)
+    {
+        assert (n_threads > 0);
+        this.n_worker_threads = n_threads;
+    }
+
+    /* Main context for the handlers of a new device; worker threads get
+     * started on demand, and devices assigned to them round-robin. */
+    private MainContext get_worker_context()
+    {
+        uint i = this.next_worker++ % this.n_worker_threads;
+
+        if (i >= this.worker_loops.length) {
+            MainLoop loop = new MainLoop(new MainContext());
+            this.worker_threads += create_worker_thread(loop);
+            this.worker_loops += loop;
+            i = this.worker_loops.length - 1;
+        }
+
+        return this.worker_loops[i].get_context();
+    }
+
     /**
      * umockdev_testbed_set_attribute:
      * @self: A #UMockdevTestbed.
@@ -213,6 +275,7 @@ public class Testbed: GLib.Object {
      */
     public void set_attribute_binary(string devpath, string name, uint8[] value)
     {
+        this.sys_lock.lock();
         var attr_path = Path.build_filename(this.root_dir, devpath, name);
         if ("/" in name) {
             string d = Path.get_dirname(attr_path);
@@ -224,6 +287,7 @@ public class Testbed: GLib.Object {
         } catch (FileError e) {
             error("Cannot write attribute file: %s", e.message);
         }
+        this.sys_lock.unlock();
     }
 
     /**
@@ -269,12 +333,14 @@ public class Testbed: GLib.Object {
      */
     public void set_attribute_link(string devpath, string name, string value)
     {
+        this.sys_lock.lock();
         var path = Path.build_filename(this.root_dir, devpath, name);
         var dir = Path.get_dirname(path);
         checked_mkdir_with_parents(dir, 0755);
         if (FileUtils.symlink(value, path) < 0) {
             error("Cannot create symlink %s: %m", path);
         }
+        this.sys_lock.unlock();
     }
 
     private string get_attribute(string devpath, string name)
@@ -338,6 +404,7 @@ public class Testbed: GLib.Object {
      */
     public new void set_property(string devpath, string name, string value)
     {
+        this.sys_lock.lock();
         var uevent_path = Path.build_filename(this.root_dir, devpath, "uevent");
         string props = "";
         string real_value;
@@ -376,6 +443,7 @@ public class Testbed: GLib.Object {
         } catch (GLib.Error e) {
             error("Cannot update uevent file: %s", e.message);
         }
+        this.sys_lock.unlock();
     }
 
     /**
@@ -412,16 +480,19 @@ public class Testbed: GLib.Object {
                                          [CCode(array_null_terminated=true, array_length=false)] string[] attributes,
                                          [CCode(array_null_terminated=true, array_length=false)] string[] properties)
     {
+        this.sys_lock.lock();
         string dev_path;
         string? dev_node = null;
 
         if (parent != null) {
             if (!parent.has_prefix("/sys/")) {
                 critical("add_devicev(): parent device %s does not start with /sys/", parent);
+                this.sys_lock.unlock();
                 return null;
             }
             if (!FileUtils.test(parent, FileTest.IS_DIR)) {
                 critical("add_devicev(): parent device %s does not exist", parent);
+                this.sys_lock.unlock();
                 return null;
             }
             dev_path = Path.build_filename(parent, name);
@@ -511,6 +582,7 @@ public class Testbed: GLib.Object {
         if (attributes.length % 2 != 0)
             warning("add_devicev: Ignoring attribute key '%s' without value", attributes[attributes.length-1]);
 
+        this.sys_lock.unlock();
         return dev_path;
     }
 
@@ -636,20 +708,29 @@ public class Testbed: GLib.Object {
      */
     public void remove_device (string syspath)
     {
+        this.sys_lock.lock();
         string real_path = Path.build_filename(this.root_dir, syspath);
 
         if (!FileUtils.test(real_path, FileTest.IS_DIR)) {
             critical("umockdev_testbed_remove_device(): device %s does not exist", syspath);
+            this.sys_lock.unlock();
             return;
         }
 
         string path = Path.build_filename(real_path, "uevent");
         if (!FileUtils.test(path, FileTest.IS_REGULAR)) {
             critical("umockdev_testbed_remove_device(): device %s does not appear to be a device", syspath);
+            this.sys_lock.unlock();
             return;
         }
 
-        remove_with_children(syspath);
+        this.begin_uevent_batch();
+        try {
+            remove_with_children(syspath);
+        } finally {
+            this.commit_uevent_batch();
+        }
+        this.sys_lock.unlock();
     }
 
     private void remove_with_children (string syspath)
@@ -786,9 +867,17 @@ public class Testbed: GLib.Object {
             error("Internal error, cannot create regex: %s", e.message);
         }
 
+        /* deliver all "add" uevents in one go */
         string cur_data = data;
-        while (cur_data[0] != '\0')
-            cur_data = this.add_dev_from_string (cur_data);
+        this.sys_lock.lock();
+        this.begin_uevent_batch();
+        try {
+            while (cur_data[0] != '\0')
+                cur_data = this.add_dev_from_string (cur_data);
+        } finally {
+            this.commit_uevent_batch();
+            this.sys_lock.unlock();
+        }
 
         return true;
     }
@@ -822,13 +911,15 @@ public class Testbed: GLib.Object {
      * @action: "add", "remove", or "change"
      *
      * Generate an uevent for a device.
+     *
+     * Like the kernel does for netlink sockets, an uevent gets dropped for a
+     * listener whose socket buffer stays full for several milliseconds, with a
+     * warning on stderr, instead of blocking the test. It also gets dropped for
+     * listeners which went away. Use umockdev_testbed_get_uevent_stats() to
+     * check for that.
      */
     public void uevent (string devpath, string action)
     {
-        UeventSender.sender ev_sender = null;
-        ev_sender = new UeventSender.sender(this.root_dir);
-        assert(ev_sender != null);
-
         debug("umockdev_testbed_uevent: sending uevent %s for device %s", action, devpath);
 
         var uevent_path = Path.build_filename(this.root_dir, devpath, "uevent");
@@ -838,7 +929,199 @@ public class Testbed: GLib.Object {
         } catch (FileError e) {
             debug("uevent: devpath %s has no uevent file: %s",  devpath, e.message);
         }
-        ev_sender.send(devpath, action, properties);
+
+        lock (this.ev_sender) {
+            unowned UeventBatch? batch = this.uevent_batches.lookup ((void*) Thread.self<void*> ());
+            if (batch != null) {
+                batch.devpaths += devpath;
+                batch.actions += action;
+                batch.properties += properties;
+            } else {
+                this.ev_sender.send(devpath, action, properties);
+            }
+        }
+    }
+
+    /**
+     * umockdev_testbed_begin_uevent_batch:
+     * @self: A #UMockdevTestbed.
+     *
+     * Start collecting uevents instead of delivering them right away. All
+     * uevents from subsequent umockdev_testbed_uevent() calls, including the
+     * ones which are implicitly generated when adding or removing devices,
+     * are queued until umockdev_testbed_commit_uevent_batch(), which then
+     * delivers them to all listeners in a single pass, in the original order.
+     *
+     * Batches can be nested; the events get delivered with the outermost
+     * commit. Batches belong to the calling thread; uevents of other threads
+     * are still delivered right away.
+     *
+     * Since: 0.20
+     */
+    public void begin_uevent_batch ()
+    {
+        void* thread = (void*) Thread.self<void*> ();
+        lock (this.ev_sender) {
+            unowned UeventBatch? batch = this.uevent_batches.lookup (thread);
+            if (batch == null) {
+                this.uevent_batches.insert (thread, new UeventBatch ());
+                batch = this.uevent_batches.lookup (thread);
+            }
+            batch.depth++;
+        }
+    }
+
+    /**
+     * umockdev_testbed_commit_uevent_batch:
+     * @self: A #UMockdevTestbed.
+     *
+     * Finish a batch started with umockdev_testbed_begin_uevent_batch(). If
+     * this is the outermost batch, deliver all queued uevents.
+     *
+     * Since: 0.20
+     */
+    public void commit_uevent_batch ()
+    {
+        void* thread = (void*) Thread.self<void*> ();
+        lock (this.ev_sender) {
+            unowned UeventBatch? batch = this.uevent_batches.lookup (thread);
+            assert (batch != null);
+            if (--batch.depth > 0)
+                return;
+
+            this.ev_sender.begin_batch();
+            for (int i = 0; i < batch.devpaths.length; i++)
+                this.ev_sender.send(batch.devpaths[i], batch.actions[i], batch.properties[i]);
+            this.ev_sender.commit_batch();
+            this.uevent_batches.remove (thread);
+        }
+    }
+
+    /**
+     * umockdev_testbed_uevent_batch:
+     * @self: A #UMockdevTestbed.
+     * @devpaths: (array zero-terminated=1): Device paths, as returned by #umockdev_testbed_add_device()
+     * @action: "add", "remove", or "change"
+     *
+     * Generate the same uevent for several devices, and deliver them to all
+     * listeners in one pass. This is considerably faster than calling
+     * umockdev_testbed_uevent() for each device.
+     *
+     * Since: 0.20
+     */
+    public void uevent_batch ([CCode(array_null_terminated=true, array_length=false)] string[] devpaths, string action)
+    {
+        this.begin_uevent_batch();
+        foreach (unowned string devpath in devpaths)
+            this.uevent(devpath, action);
+        this.commit_uevent_batch();
+    }
+
+    /**
+     * umockdev_testbed_uevent_storm:
+     * @self: A #UMockdevTestbed.
+     * @devpaths: (array zero-terminated=1): Device paths, as returned by #umockdev_testbed_add_device()
+     * @actions: (array zero-terminated=1): Actions to cycle through, like "add", "remove", or "change"
+     * @n_events: Number of uevents to generate
+     * @rate: Target rate in events per second, or 0 to send as fast as possible
+     *
+     * Generate a uevent load for benchmarking udev consumers. Event number i
+     * is sent for @devpaths[i % len(@devpaths)] with action
+     * @actions[i % len(@actions)]; if both arrays have the same length, this
+     * replays them as a sequence of (device, action) pairs.
+     *
+     * Returns: (transfer full): A vardict with the number of sent "events"
+     * (t), the "delivered" and "dropped" deliveries summed over all listeners
+     * (t), the elapsed "seconds" (d), the achieved "events-per-second" (d),
+     * and the send latency percentiles "latency-p50", "latency-p90",
+     * "latency-p99", and "latency-max" in µs (t).
+     *
+     * Since: 0.20
+     */
+    public Variant uevent_storm ([CCode(array_null_terminated=true, array_length=false)] string[] devpaths,
+                                 [CCode(array_null_terminated=true, array_length=false)] string[] actions,
+                                 uint n_events, double rate)
+    {
+        assert (devpaths.length > 0);
+        assert (actions.length > 0);
+
+        uint64 delivered_before, dropped_before, delivered_after, dropped_after;
+        lock (this.ev_sender) {
+            this.ev_sender.get_stats(out delivered_before, out dropped_before);
+        }
+
+        var latencies = new int64[n_events];
+        int64 start = get_monotonic_time();
+        for (uint i = 0; i < n_events; ++i) {
+            if (rate > 0) {
+                int64 due = start + (int64) (i * 1000000.0 / rate);
+                int64 now = get_monotonic_time();
+                if (due > now)
+                    Thread.usleep((ulong) (due - now));
+            }
+            int64 t = get_monotonic_time();
+            this.uevent(devpaths[i % devpaths.length], actions[i % actions.length]);
+            latencies[i] = get_monotonic_time() - t;
+        }
+        double seconds = (get_monotonic_time() - start) / 1000000.0;
+
+        lock (this.ev_sender) {
+            this.ev_sender.get_stats(out delivered_after, out dropped_after);
+        }
+
+        Posix.qsort(latencies, n_events, sizeof(int64), (a, b) => {
+            int64 x = *(int64*) a;
+            int64 y = *(int64*) b;
+            return x < y ? -1 : (x > y ? 1 : 0);
+        });
+
+        var result = new VariantDict();
+        result.insert_value("events", new Variant.uint64(n_events));
+        result.insert_value("delivered", new Variant.uint64(delivered_after - delivered_before));
+        result.insert_value("dropped", new Variant.uint64(dropped_after - dropped_before));
+        result.insert_value("seconds", new Variant.double(seconds));
+        result.insert_value("events-per-second", new Variant.double(seconds > 0 ? n_events / seconds : 0));
+        result.insert_value("latency-p50", new Variant.uint64(percentile(latencies, 50)));
+        result.insert_value("latency-p90", new Variant.uint64(percentile(latencies, 90)));
+        result.insert_value("latency-p99", new Variant.uint64(percentile(latencies, 99)));
+        result.insert_value("latency-max", new Variant.uint64(percentile(latencies, 100)));
+        return result.end();
+    }
+
+    /**
+     * umockdev_testbed_get_uevent_stats:
+     * @self: A #UMockdevTestbed.
+     *
+     * Get the number of uevent deliveries of this testbed so far. Every
+     * listener counts separately, i. e. one uevent with two listeners results
+     * in two deliveries.
+     *
+     * Returns: (transfer full): A vardict with the number of "delivered" (t)
+     * and "dropped" (t) deliveries. Deliveries get dropped for listeners
+     * which stay congested or which went away, see umockdev_testbed_uevent().
+     *
+     * Since: 0.20
+     */
+    public Variant get_uevent_stats ()
+    {
+        uint64 delivered, dropped;
+        lock (this.ev_sender) {
+            this.ev_sender.get_stats(out delivered, out dropped);
+        }
+
+        var result = new VariantDict();
+        result.insert_value("delivered", new Variant.uint64(delivered));
+        result.insert_value("dropped", new Variant.uint64(dropped));
+        return result.end();
+    }
+
+    /* nearest-rank percentile of a sorted array */
+    private static uint64 percentile(int64[] sorted, uint p)
+    {
+        if (sorted.length == 0)
+            return 0;
+        int rank = (int) ((p * sorted.length + 99) / 100);
+        return (uint64) sorted[rank > 0 ? rank - 1 : 0];
     }
 
     /**
@@ -861,7 +1144,7 @@ public class Testbed: GLib.Object {
         assert (!this.custom_handlers.contains (dev));
 
         string sockpath = Path.build_filename(this.root_dir, "ioctl", dev);
-        handler.register_path(this.worker_ctx, dev, sockpath);
+        handler.register_path(this.get_worker_context(), dev, sockpath);
 
         this.custom_handlers.insert(dev, handler);
 
@@ -905,75 +1188,41 @@ public class Testbed: GLib.Object {
      *
      * Load an ioctl record file for a particular device into the testbed.
      * ioctl records can be created with umockdev-record --ioctl.
-     * They can optionally be xz compressed to save space (but then are
-     * required to have an .xz file name suffix).
+     * They can optionally be xz or zstd compressed to save space; they get
+     * decompressed while loading them.
+     *
+     * The recording gets parsed once while loading it; it does not get copied
+     * into the testbed. Loading the same unmodified file again, e. g. for
+     * another device or in another testbed, shares the already parsed
+     * recording. Recordings in the compiled binary format (umockdev-record
+     * --ioctl-compiled or --compile-ioctl) get used in place, without parsing
+     * them.
      *
      * Returns: %TRUE on success, %FALSE if the data is invalid and an error
      *          occurred.
      */
     public bool load_ioctl (string? dev, string recordfile) throws GLib.Error, FileError, IOError, RegexError
     {
-        string format = "";
-        DataInputStream recording;
         // Apparently valac isn't smart enough to turn a parameter into an owned
         // variable when we assign to it, so we need an explicit copy here.
         string? owned_dev = dev;
 
-        if (recordfile.has_suffix(".xz")) {
-            try {
-                string contents;
-                int exit;
-                Process.spawn_sync(null, {"xz", "-cd", recordfile}, null,
-                                   SpawnFlags.SEARCH_PATH,
-                                   null,
-                                   out contents,
-                                   null,
-                                   out exit);
-                assert(exit == 0);
-                recording = new DataInputStream(new MemoryInputStream.from_data(contents.data, null));
-            } catch (SpawnError e) {
-                error("Cannot call xz to decompress %s: %s", recordfile, e.message);
-            }
-        } else
-            recording = new DataInputStream(File.new_for_path(recordfile).read());
-
-        // Grab information from header file
-
-        // Ignore any leading comments
-        string line = recording.read_line();
-        while (line != null && line.has_prefix("#"))
-            line = recording.read_line();
-
-        // Next must be our @DEV <devicenode> header
-        MatchInfo header_matcher = null;
-        if (line != null && (new Regex("^@DEV (.*?)( \\((?P<format>[^)]*)\\))?(\n|$)")).match(line, 0, out header_matcher)) {
-            if (owned_dev == null)
-                owned_dev = header_matcher.fetch(1);
-
-            format = header_matcher.fetch_named("format");
-        } else if (owned_dev == null) {
+        // the same recording is only parsed once, and shared between handlers
+        var recording = IoctlRecording.load(recordfile);
+        if (owned_dev == null)
+            owned_dev = recording.device;
+        if (owned_dev == null)
             error("null passed for device node, but recording %s has no @DEV header", recordfile);
-        }
-
-        recording.seek(0, SeekType.SET);
-
-        string dest = Path.build_filename(this.root_dir, "ioctl", owned_dev + ".tree");
-        checked_mkdir_with_parents(Path.get_dirname(dest), 0755);
-
-        string? contents = recording.read_upto("", 0, null);
-        if (contents == null)
-            contents = "";
-        if (!FileUtils.set_contents(dest, contents))
-            return false;
 
         IoctlBase handler;
-        if (format == "SPI")
-            handler = new IoctlSpiHandler(dest);
+        if (recording.format == "SPI")
+            handler = new IoctlSpiHandler.from_string(recording.contents);
         else
-            handler = new IoctlTreeHandler(dest);
+            handler = new IoctlTreeHandler(recording);
 
         string sockpath = Path.build_filename(this.root_dir, "ioctl", owned_dev);
-        handler.register_path(this.worker_ctx, owned_dev, sockpath);
+        handler.register_path(this.get_worker_context(), owned_dev, sockpath);
+        this.loaded_handlers.insert(owned_dev, handler);
 
         return true;
     }
@@ -1011,11 +1260,43 @@ public class Testbed: GLib.Object {
         checked_mkdir_with_parents(Path.get_dirname(sockpath), 0755);
 
         IoctlUsbPcapHandler handler = new IoctlUsbPcapHandler(recordfile, busnum, devnum);
-        handler.register_path(this.worker_ctx, owned_dev, sockpath);
+        handler.register_path(this.get_worker_context(), owned_dev, sockpath);
+        this.loaded_handlers.insert(owned_dev, handler);
 
         return true;
     }
 
+    /**
+     * umockdev_testbed_get_ioctl_stats:
+     * @self: A #UMockdevTestbed.
+     *
+     * Get statistics about the ioctl, read, and write requests to emulated
+     * devices, for all loaded recordings and attached #UMockdevIoctlBase
+     * handlers which got any requests so far. Requests to devices without
+     * such a handler appear as "_default" device.
+     *
+     * Returns: (transfer full): A #GVariant of type "a{sa{sa{sv}}}", which
+     *   maps the device path to the result of umockdev_ioctl_base_get_stats().
+     * Since: 0.20
+     */
+    public Variant get_ioctl_stats()
+    {
+        var builder = new VariantBuilder(new VariantType("a{sa{sa{sv}}}"));
+        HFunc<string,IoctlBase> add = (dev, handler) => {
+            Variant stats = handler.get_stats();
+            if (stats.n_children() > 0)
+                builder.add("{s@a{sa{sv}}}", dev, stats);
+        };
+
+        /* keys must be unique; an attached handler overrides a loaded one */
+        this.loaded_handlers.foreach((dev, handler) => {
+            if (!this.custom_handlers.contains(dev))
+                add(dev, handler);
+        });
+        this.custom_handlers.foreach(add);
+        return builder.end();
+    }
+
     /**
      * umockdev_testbed_load_script:
      * @self: A #UMockdevTestbed.
@@ -1034,9 +1315,7 @@ public class Testbed: GLib.Object {
     public bool load_script (string? dev, string recordfile)
         throws GLib.Error, FileError, IOError, RegexError
     {
-        return this.load_script_from_stream(dev,
-                                            new DataInputStream(File.new_for_path(recordfile).read()),
-                                            recordfile);
+        return this.load_script_from_stream(dev, open_recording(recordfile), recordfile);
     }
 
     /**
@@ -1174,9 +1453,7 @@ public class Testbed: GLib.Object {
     public bool load_evemu_events (string? dev, string eventsfile)
         throws GLib.Error, FileError, IOError, RegexError
     {
-        return this.load_evemu_events_from_stream(dev,
-                                                  new DataInputStream(File.new_for_path(eventsfile).read()),
-                                                  eventsfile);
+        return this.load_evemu_events_from_stream(dev, open_recording(eventsfile), eventsfile);
     }
 
     public bool load_evemu_events_from_string (string? dev, string events)
@@ -1244,6 +1521,185 @@ public class Testbed: GLib.Object {
         return load_script_from_string(owned_dev, script);
     }
 
+    /**
+     * umockdev_testbed_load_uevents:
+     * @self: A #UMockdevTestbed.
+     * @eventsfile: Path of a uevent recording from umockdev-record --uevents
+     * @speed: Replay speed factor: 1.0 replays with the recorded timing, 2.0
+     *         twice as fast, and so on; 0 sends all events as fast as possible.
+     * @error: return location for a GError, or %NULL
+     *
+     * Replay a recorded uevent stream in the background. The recording has one
+     * block per event:
+     *
+     *  U: sec.usec action devpath
+     *  E: KEY=VALUE
+     *  ...
+     *
+     * The timestamps are relative to the start of the recording, and replay
+     * starts right away. Devices which do not exist yet are created with the
+     * recorded properties (including a device node if there are DEVNAME,
+     * MAJOR, and MINOR properties), existing ones get their properties updated
+     * to the recorded ones, and "remove" events remove the device. Events for
+     * paths outside of /devices/, like modules, are skipped.
+     *
+     * Use umockdev_testbed_wait_uevents() to wait until the replay finished.
+     *
+     * Returns: %TRUE on success, %FALSE if @eventsfile is invalid and an error
+     *          occurred.
+     * Since: 0.20
+     */
+    public bool load_uevents (string eventsfile, double speed) throws GLib.Error
+    {
+        string contents;
+        FileUtils.get_contents(eventsfile, out contents);
+        return this.load_uevents_from_string(contents, speed);
+    }
+
+    /**
+     * umockdev_testbed_load_uevents_from_string:
+     * @self: A #UMockdevTestbed.
+     * @events: uevent recording, in the format described in umockdev_testbed_load_uevents()
+     * @speed: Replay speed factor, see umockdev_testbed_load_uevents()
+     * @error: return location for a GError, or %NULL
+     *
+     * Replay a recorded uevent stream in the background.
+     *
+     * Returns: %TRUE on success, %FALSE if @events is invalid and an error
+     *          occurred.
+     * Since: 0.20
+     */
+    public bool load_uevents_from_string (string events, double speed) throws GLib.Error
+    {
+        var event_re = new Regex("^U: ([0-9]+)\\.([0-9]{6}) +([^ ]+) +(/[^ ]*)$");
+        RecordedUevent[] recorded = {};
+        RecordedUevent? cur = null;
+        MatchInfo match;
+        int lineno = 0;
+
+        if (speed < 0)
+            throw new UMockdev.Error.VALUE("invalid uevent replay speed %f", speed);
+
+        foreach (unowned string line in events.split("\n")) {
+            lineno++;
+            if (line.length == 0 || line[0] == '#')
+                continue;
+
+            if (event_re.match(line, 0, out match)) {
+                cur = new RecordedUevent();
+                cur.time = int64.parse(match.fetch(1)) * 1000000 + int64.parse(match.fetch(2));
+                cur.action = match.fetch(3);
+                cur.devpath = match.fetch(4);
+                recorded += cur;
+            } else if (line.has_prefix("E: ") && line.index_of_char('=') > 3 && cur != null) {
+                string prop = line.substring(3);
+                /* the sender generates these itself */
+                if (!prop.has_prefix("ACTION=") && !prop.has_prefix("DEVPATH=") && !prop.has_prefix("SEQNUM="))
+                    cur.properties += prop;
+            } else {
+                throw new UMockdev.Error.PARSE("invalid line %i in uevent recording: %s", lineno, line);
+            }
+        }
+
+        this.uevent_replayers += new UeventReplayer(this, recorded, speed);
+        return true;
+    }
+
+    /**
+     * umockdev_testbed_wait_uevents:
+     * @self: A #UMockdevTestbed.
+     *
+     * Wait until all uevent streams loaded with umockdev_testbed_load_uevents()
+     * have been replayed.
+     *
+     * Since: 0.20
+     */
+    public void wait_uevents ()
+    {
+        foreach (var r in this.uevent_replayers)
+            r.wait();
+        this.uevent_replayers = {};
+    }
+
+    internal void replay_uevent (RecordedUevent ev)
+    {
+        this.sys_lock.lock();
+        if (!ev.devpath.has_prefix("/devices/")) {
+            debug("replay_uevent: skipping %s event for %s", ev.action, ev.devpath);
+            this.sys_lock.unlock();
+            return;
+        }
+
+        string syspath = "/sys" + ev.devpath;
+        bool exists = FileUtils.test(Path.build_filename(this.root_dir, syspath, "uevent"), FileTest.IS_REGULAR);
+
+        if (ev.action == "remove") {
+            if (exists)
+                this.remove_device(syspath);
+            else
+                debug("replay_uevent: ignoring remove event for unknown device %s", syspath);
+            this.sys_lock.unlock();
+            return;
+        }
+
+        string[] props = {};
+        string? subsystem = null;
+        string? devname = null;
+        string? major = null;
+        string? minor = null;
+        foreach (unowned string p in ev.properties) {
+            string[] kv = p.split("=", 2);
+            props += kv[0];
+            props += kv[1];
+            switch (kv[0]) {
+                case "SUBSYSTEM": subsystem = kv[1]; break;
+                case "DEVNAME": devname = kv[1]; break;
+                case "MAJOR": major = kv[1]; break;
+                case "MINOR": minor = kv[1]; break;
+            }
+        }
+
+        if (!exists) {
+            if (subsystem == null) {
+                warning("replay_uevent: cannot create device %s without SUBSYSTEM property", syspath);
+                this.sys_lock.unlock();
+                return;
+            }
+            string? majmin = (major != null && minor != null) ? major + ":" + minor : null;
+            string[] attrs = {};
+            if (majmin != null) {
+                attrs += "dev";
+                attrs += majmin + "\n";
+            }
+            debug("replay_uevent: creating device %s for %s event", syspath, ev.action);
+            this.add_devicev_no_uevent(subsystem, ev.devpath.substring(9), null, attrs, props);
+
+            if (devname != null && majmin != null) {
+                if (devname.has_prefix("/dev/"))
+                    devname = devname.substring(5);
+                try {
+                    this.create_node_for_device(subsystem, Path.build_filename(this.root_dir, "dev", devname),
+                                                {}, majmin, null);
+                } catch (UMockdev.Error e) {
+                    warning("replay_uevent: cannot create device node %s: %s", devname, e.message);
+                }
+            }
+        } else {
+            string uevent_props = "";
+            for (int i = 0; i < props.length; i += 2) {
+                /* the kernel sets DEVNAME without prefix */
+                if (props[i] == "DEVNAME" && props[i+1].has_prefix("/dev/"))
+                    uevent_props += "DEVNAME=" + props[i+1].substring(5) + "\n";
+                else
+                    uevent_props += props[i] + "=" + props[i+1] + "\n";
+            }
+            this.set_attribute(syspath, "uevent", uevent_props);
+        }
+
+        this.uevent(syspath, ev.action);
+        this.sys_lock.unlock();
+    }
+
     private static HashTable<string, string> bus_lookup_table;
 
     private static HashTable<string, string> create_bus_lookup() {
@@ -1385,10 +1841,6 @@ public class Testbed: GLib.Object {
     }
 
     private static bool subsystem_is_bus(string subsystem) {
-        if (bus_lookup_table == null) {
-            bus_lookup_table = create_bus_lookup();
-        }
-
         return bus_lookup_table.contains(subsystem);
     }
 
@@ -1682,9 +2134,11 @@ public class Testbed: GLib.Object {
      */
     public void clear()
     {
+        this.sys_lock.lock();
         remove_dir (this.root_dir, false);
         // /sys should always exist
         checked_mkdir_with_parents(this.sys_dir, 0755);
+        this.sys_lock.unlock();
     }
 
     /**
@@ -1716,18 +2170,28 @@ public class Testbed: GLib.Object {
 
     private string root_dir;
     private string sys_dir;
+    /* for changing the sys tree, as uevent replay threads do that as well as
+     * the test itself */
+    private RecMutex sys_lock = RecMutex ();
     private Regex re_record_val;
     private Regex re_record_keyval;
     private Regex re_record_optval;
     private HashTable<string,int> dev_fd;
     private HashTable<string,ScriptRunner> dev_script_runner;
+    private UeventReplayer[] uevent_replayers;
     private SocketServer socket_server = null;
+    private UeventSender.sender ev_sender;
+    /* open uevent batches by thread; locked with ev_sender */
+    private HashTable<void*,UeventBatch> uevent_batches;
 
     private HashTable<string,IoctlBase> custom_handlers;
+    /* handlers from load_ioctl() and load_pcap(), for get_ioctl_stats() */
+    private HashTable<string,IoctlBase> loaded_handlers;
 
-    private Thread<void> worker_thread;
-    private MainContext worker_ctx;
-    private MainLoop worker_loop;
+    private uint n_worker_threads = 1;
+    private uint next_worker = 0;
+    private Thread<void>[] worker_threads;
+    private MainLoop[] worker_loops;
 }
 
 
@@ -1752,25 +2216,16 @@ make_dotdots (string path)
     return dots;
 }
 
-private static uint8
-hexdigit (char c)
-{
-    return (c >= 'a') ? (c - 'a' + 10) :
-           (c >= 'A') ? (c - 'A' + 10) :
-           (c - '0');
-}
-
 private static uint8[]
 decode_hex (string data) throws UMockdev.Error
 {
     /* hex digits must come in pairs */
     if (data.length % 2 != 0)
         throw new UMockdev.Error.PARSE("malformed hexadecimal value: %s", data);
-    var len = data.length;
-    uint8[] bin = new uint8[len / 2];
+    uint8[] bin = new uint8[data.length / 2];
 
-    for (uint i = 0; i < bin.length; ++i)
-        bin[i] = (hexdigit (data[i*2]) << 4) | hexdigit (data[i*2+1]);
+    if (Hex.decode (data, data.length, bin) != (size_t) data.length)
+        throw new UMockdev.Error.PARSE("malformed hexadecimal value: %s", data);
 
     return bin;
 }
@@ -1801,6 +2256,101 @@ find_devnode (string devpath)
     return devname;
 }
 
+internal class RecordedUevent {
+    public int64 time;      /* µs since start of recording */
+    public string action;
+    public string devpath;  /* without /sys */
+    public string[] properties = {};  /* KEY=VALUE */
+}
+
+/* uevents which a thread queued between begin_uevent_batch() and
+ * commit_uevent_batch() */
+private class UeventBatch {
+    public int depth;
+    public string[] devpaths = {};
+    public string[] actions = {};
+    public string[] properties = {};
+}
+
+private class UeventReplayer {
+    public UeventReplayer (Testbed testbed, RecordedUevent[] events, double speed)
+    {
+        this.testbed = testbed;
+        this.events = events;
+        this.speed = speed;
+        this.running = true;
+
+        this.thread = new Thread<void*> ("uevent-replay", this.run);
+    }
+
+    ~UeventReplayer ()
+    {
+        this.stop ();
+    }
+
+    /* abort the replay */
+    public void stop ()
+    {
+        this.mutex.lock ();
+        this.running = false;
+        this.cond.signal ();
+        this.mutex.unlock ();
+
+        this.join ();
+    }
+
+    /* wait until all events were sent */
+    public void wait ()
+    {
+        this.join ();
+    }
+
+    /* the thread can only be joined once, but both stop() and wait() need to */
+    private void join ()
+    {
+        this.join_mutex.lock ();
+        if (this.thread != null) {
+            this.thread.join ();
+            this.thread = null;
+        }
+        this.join_mutex.unlock ();
+    }
+
+    private void* run ()
+    {
+        int64 start = get_monotonic_time ();
+
+        foreach (var ev in this.events) {
+            this.mutex.lock ();
+            if (this.speed > 0) {
+                int64 due = start + (int64) (ev.time / this.speed);
+                while (this.running && get_monotonic_time () < due)
+                    this.cond.wait_until (this.mutex, due);
+            }
+            bool stopped = !this.running;
+            this.mutex.unlock ();
+            if (stopped)
+                return null;
+
+            this.testbed.replay_uevent (ev);
+        }
+
+        this.mutex.lock ();
+        this.running = false;
+        this.mutex.unlock ();
+        return null;
+    }
+
+    private unowned Testbed testbed;
+    private RecordedUevent[] events;
+    private double speed;
+    private bool running;
+    private Mutex mutex = Mutex ();
+    private Cond cond = Cond ();
+    private Mutex join_mutex = Mutex ();
+    private Thread<void*>? thread;
+}
+
 private class ScriptRunner {
 
     /**
@@ -2231,6 +2781,30 @@ private class SocketServer {
     private int ctrl_w;
 }
 
+/* Input stream on top of decompress_fopen(), which decompresses while reading */
+private class RecordingInputStream : InputStream {
+    private Posix.FILE? file;
+
+    public RecordingInputStream (owned Posix.FILE file)
+    {
+        this.file = (owned) file;
+    }
+
+    public override ssize_t read (uint8[] buffer, Cancellable? cancellable = null) throws IOError
+    {
+        size_t len = this.file.read (buffer, 1, buffer.length);
+        if (len == 0 && this.file.error () != 0)
+            throw new IOError.FAILED ("Cannot read recording: %s", Posix.strerror (Posix.errno));
+        return (ssize_t) len;
+    }
+
+    public override bool close (Cancellable? cancellable = null) throws IOError
+    {
+        this.file = null;
+        return true;
+    }
+}
+
 /**
  * SECTION:functions
  * @title: global functions
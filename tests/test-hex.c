@@ -0,0 +1,154 @@
+/* SPDX-License-Identifier: LGPL-2.1-or-later */
+/*
+ * test-hex - Tests for the conversion between binary data and hex strings
+ *
+ * This gets built twice: with the SSE2/NEON code, and with the scalar code
+ * only.
+ */
+
+#include <glib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hex.h"
+
+/* two SIMD blocks of decoding, plus odd tails */
+#define MAX_LEN 64
+/* offsets for testing unaligned data */
+#define MAX_OFFSET 3
+
+static void
+reference_encode(const uint8_t *data, size_t len, char *out, bool lowercase)
+{
+    for (size_t i = 0; i < len; ++i)
+	snprintf(out + 2 * i, 3, lowercase ? "%02x" : "%02X", data[i]);
+}
+
+static void
+t_roundtrip(void)
+{
+    uint8_t data[MAX_LEN + MAX_OFFSET];
+    uint8_t decoded[MAX_LEN + MAX_OFFSET];
+    char hex[2 * MAX_LEN + MAX_OFFSET];
+    char expected[2 * MAX_LEN + 1];
+
+    for (size_t i = 0; i < sizeof(data); ++i)
+	data[i] = (uint8_t) (i * 37 + 11);
+
+    for (int lowercase = 0; lowercase <= 1; ++lowercase) {
+	for (size_t offset = 0; offset <= MAX_OFFSET; ++offset) {
+	    for (size_t len = 0; len <= MAX_LEN; ++len) {
+		reference_encode(data + offset, len, expected, lowercase);
+
+		memset(hex, 'x', sizeof(hex));
+		hex_encode(data + offset, len, hex + offset, lowercase);
+		g_assert(memcmp(hex + offset, expected, 2 * len) == 0);
+		/* nothing behind the output got touched */
+		if (offset + 2 * len < sizeof(hex))
+		    g_assert_cmpint(hex[offset + 2 * len], ==, 'x');
+
+		char *s = hex_encode_string(data + offset, len, lowercase);
+		g_assert_cmpint(strlen(s), ==, 2 * len);
+		g_assert(memcmp(s, expected, 2 * len) == 0);
+		free(s);
+
+		memset(decoded, 0, sizeof(decoded));
+		g_assert_cmpuint(hex_decode(hex + offset, 2 * len, decoded + offset), ==, 2 * len);
+		g_assert(memcmp(decoded + offset, data + offset, len) == 0);
+	    }
+	}
+    }
+}
+
+static void
+t_all_bytes(void)
+{
+    uint8_t data[256], decoded[256];
+    char hex[513];
+
+    for (size_t i = 0; i < sizeof(data); ++i)
+	data[i] = (uint8_t) i;
+
+    hex_encode(data, sizeof(data), hex, false);
+    g_assert(memcmp(hex, "000102030405060708090A0B0C0D0E0F10", 34) == 0);
+    g_assert(memcmp(hex + 480, "F0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF", 32) == 0);
+    g_assert_cmpuint(hex_decode(hex, 512, decoded), ==, 512);
+    g_assert(memcmp(decoded, data, sizeof(data)) == 0);
+
+    hex_encode(data, sizeof(data), hex, true);
+    g_assert(memcmp(hex + 480, "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff", 32) == 0);
+    g_assert_cmpuint(hex_decode(hex, 512, decoded), ==, 512);
+    g_assert(memcmp(decoded, data, sizeof(data)) == 0);
+}
+
+static void
+t_decode_mixed_case(void)
+{
+    const char hex[] = "aBcDeF0123456789AbCdEf0123456789abcdefABCDEF";
+    uint8_t decoded[sizeof(hex) / 2];
+
+    g_assert_cmpuint(hex_decode(hex, sizeof(hex) - 1, decoded), ==, sizeof(hex) - 1);
+    g_assert_cmpuint(decoded[0], ==, 0xAB);
+    g_assert_cmpuint(decoded[2], ==, 0xEF);
+    g_assert_cmpuint(decoded[11], ==, 0x01);
+    g_assert_cmpuint(decoded[16], ==, 0xAB);
+    g_assert_cmpuint(decoded[21], ==, 0xEF);
+}
+
+static void
+t_decode_odd(void)
+{
+    uint8_t decoded[2] = { 0, 0 };
+
+    /* the last digit has no partner */
+    g_assert_cmpuint(hex_decode("41F", 3, decoded), ==, 3);
+    g_assert_cmpuint(decoded[0], ==, 0x41);
+    g_assert_cmpuint(decoded[1], ==, 0);
+
+    g_assert_cmpuint(hex_decode("", 0, decoded), ==, 0);
+}
+
+static void
+t_decode_invalid(void)
+{
+    /* neighbours of the valid ranges, and non-ASCII ones which become
+     * letters when only looking at the low 7 bits */
+    const char invalid[] = { '/', ':', '@', 'G', '`', 'g', ' ', '\0', '\n', '\x80', '\xC1', '\xE1', '\xFF' };
+    uint8_t data[MAX_LEN], decoded[MAX_LEN];
+    char hex[2 * MAX_LEN];
+
+    for (size_t i = 0; i < sizeof(data); ++i)
+	data[i] = (uint8_t) (i * 53 + 7);
+    hex_encode(data, sizeof(data), hex, false);
+
+    for (size_t pos = 0; pos < sizeof(hex); ++pos) {
+	for (size_t i = 0; i < sizeof(invalid); ++i) {
+	    char orig = hex[pos];
+
+	    hex[pos] = invalid[i];
+	    memset(decoded, 0, sizeof(decoded));
+	    g_assert_cmpuint(hex_decode(hex, sizeof(hex), decoded), ==, pos);
+	    hex[pos] = orig;
+
+	    /* everything before the invalid digit got decoded */
+	    g_assert(memcmp(decoded, data, pos / 2) == 0);
+	}
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/umockdev-hex/roundtrip", t_roundtrip);
+    g_test_add_func("/umockdev-hex/all_bytes", t_all_bytes);
+    g_test_add_func("/umockdev-hex/decode_mixed_case", t_decode_mixed_case);
+    g_test_add_func("/umockdev-hex/decode_odd", t_decode_odd);
+    g_test_add_func("/umockdev-hex/decode_invalid", t_decode_invalid);
+
+    return g_test_run();
+}
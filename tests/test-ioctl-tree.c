@@ -21,11 +21,14 @@
 #include <glib.h>
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/ioctl.h>
 #include <termios.h>
 #include <linux/usbdevice_fs.h>
 #include <linux/input.h>
+#include <linux/hidraw.h>
 
 #include "ioctl_tree.h"
 
@@ -118,6 +121,10 @@ t_type_get_by(void)
     g_assert(ioctl_type_get_by_id(EVIOCGABS(ABS_WHEEL)) == t);
     g_assert(ioctl_type_get_by_id(EVIOCGABS(ABS_MAX)) == t);
 
+    g_assert_cmpstr(ioctl_name_by_id(USBDEVFS_REAPURBNDELAY), ==, "USBDEVFS_REAPURBNDELAY");
+    g_assert_cmpstr(ioctl_name_by_id(EVIOCGABS(ABS_X)), ==, "EVIOCGABS");
+    g_assert(ioctl_name_by_id(-1) == NULL);
+
     g_assert(ioctl_type_get_by_name("EVIOCGABS", &id) == t);
     g_assert(ioctl_type_get_by_name("EVIOCGABS(0)", &id) == t);
     g_assert_cmpuint(id, ==, (IOCTL_REQUEST_TYPE) EVIOCGABS(ABS_X));
@@ -130,6 +137,21 @@ t_type_get_by(void)
     g_assert_cmpstr(t->name, ==, "EVIOCGBIT");
     g_assert(ioctl_type_get_by_id(EVIOCGBIT(EV_KEY, 20)) == t);
     g_assert(ioctl_type_get_by_id(EVIOCGBIT(EV_PWR, 1000)) == t);
+    g_assert(ioctl_type_get_by_name("EVIOCGBIT(5)", &id) == t);
+    g_assert_cmpuint(id, ==, (IOCTL_REQUEST_TYPE) EVIOCGBIT(EV_SW, 32));
+
+    /* right after the EVIOCGBIT range comes EVIOCGABS */
+    g_assert_cmpstr(ioctl_type_get_by_id(EVIOCGBIT(EV_MAX + 1, 32))->name, ==, "EVIOCGABS");
+    /* same type and number, but different direction */
+    g_assert(ioctl_type_get_by_id(EVIOCSABS(0)) == NULL);
+
+    t = ioctl_type_get_by_id(HIDIOCGRAWNAME(64));
+    g_assert(t != NULL);
+    g_assert_cmpstr(t->name, ==, "HIDIOCGRAWNAME");
+    g_assert(ioctl_type_get_by_name("HIDIOCGRAWNAME", NULL) == t);
+    /* prefixes of names do not match */
+    g_assert(ioctl_type_get_by_name("HIDIOCGRAW", NULL) == NULL);
+    g_assert(ioctl_type_get_by_name("HIDIOCGRAW(1)", NULL) == NULL);
 }
 
 #define assert_node(n,p,c,nx) \
@@ -286,6 +308,82 @@ t_read(void)
     fclose(f);
 }
 
+static void
+t_read_invalid_length(void)
+{
+    static const char negative[] =
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 00000000\n"
+	"USBDEVFS_REAPURB 0 1 2 0 0 -1 4 0 00000000\n";
+    ioctl_tree *tree;
+    FILE *f;
+
+    /* a negative buffer length must not get turned into a huge allocation;
+     * reading stops at the invalid node */
+    f = tmpfile();
+    g_assert_cmpint(fwrite(negative, strlen(negative), 1, f), ==, 1);
+    rewind(f);
+    tree = ioctl_tree_read(f);
+    fclose(f);
+    g_assert(tree != NULL);
+    g_assert(tree->next == NULL);
+    g_assert(tree->child == NULL);
+    ioctl_tree_free(tree);
+
+    /* same for nodes which are not read into an arena */
+    g_assert(ioctl_tree_new_from_text("USBDEVFS_REAPURB 0 1 2 0 0 -1 4 0 00000000") == NULL);
+    g_assert(ioctl_tree_new_from_text("USBDEVFS_REAPURB 0 1 2 0 0 -2147483648 4 0 00") == NULL);
+}
+
+static void
+t_read_large(void)
+{
+    GString *str = g_string_new(NULL);
+    FILE *f;
+    char *contents;
+    size_t contents_len;
+    ioctl_tree *tree, *t;
+    int i, n;
+
+    /* enough nodes to span several allocation chunks, and a buffer which is
+     * larger than a chunk */
+    for (i = 0; i < 3000; ++i)
+	g_string_append_printf(str, "USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 %08X\n", i);
+    g_string_append(str, " USBDEVFS_REAPURB 0 1 129 0 0 100000 100000 0 ");
+    for (i = 0; i < 100000; ++i)
+	g_string_append_printf(str, "%02X", i & 0xFF);
+    g_string_append_c(str, '\n');
+
+    f = tmpfile();
+    g_assert_cmpint(fwrite(str->str, str->len, 1, f), ==, 1);
+    rewind(f);
+    tree = ioctl_tree_read(f);
+    fclose(f);
+    g_assert(tree != NULL);
+
+    for (t = tree, n = 0; t->next != NULL; t = t->next)
+	++n;
+    g_assert_cmpint(n, ==, 2999);
+    g_assert(t->child != NULL);
+    g_assert_cmpint(((struct usbdevfs_urb *) t->child->data)->buffer_length, ==, 100000);
+    g_assert_cmpint(((unsigned char *) ((struct usbdevfs_urb *) t->child->data)->buffer)[99999], ==, 99999 & 0xFF);
+
+    /* insert separately allocated nodes into it */
+    ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &out1, 0));
+    ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &in1a, 0));
+
+    f = open_memstream(&contents, &contents_len);
+    ioctl_tree_write(f, tree);
+    fclose(f);
+    g_assert(g_str_has_prefix(contents, str->str));
+    g_assert_cmpstr(contents + str->len, ==,
+		    "USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+		    " USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n");
+
+    free(contents);
+    ioctl_tree_free(tree);
+    g_string_free(str, TRUE);
+}
+
 #define assert_ci(n,d) { \
     struct usbdevfs_connectinfo *nd = n->data;      \
     g_assert (n->type->id == USBDEVFS_CONNECTINFO); \
@@ -305,6 +403,55 @@ t_read(void)
     g_assert (memcmp (nd->buffer, (urb)->buffer, nd->buffer_length) == 0);   \
 }
 
+static void
+t_insert_dedup(void)
+{
+    ioctl_tree *tree = get_test_tree();
+    ioctl_tree *t;
+    struct usbdevfs_connectinfo c;
+    int i;
+
+    /* equal() compares the whole struct including padding */
+    memset(&c, 0, sizeof(c));
+
+    /* equal nodes in a tree which was read from a file */
+    t = ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &out2, 0);
+    g_assert(ioctl_tree_insert(tree, t) == tree);
+    g_assert(ioctl_node_list_get(tree->last_added, -1) == tree->next->next);
+    /* the return value does not matter for equality */
+    t = ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &ci2, 0);
+    g_assert(ioctl_tree_insert(tree, t) == tree);
+    assert_ci(ioctl_node_list_get(tree->last_added, -1), &ci2);
+    /* input URBs are never equal */
+    t = ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &in1a, 0);
+    g_assert(ioctl_tree_insert(tree, t) == tree);
+    g_assert(ioctl_node_list_get(tree->last_added, -1) == t);
+    /* ... and get appended to the children of the previous (output) URB */
+    g_assert(t->parent == tree->next->next);
+    g_assert(tree->next->next->child->next->next == t);
+    g_assert(t->next == NULL);
+    t = ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &in1b, 0);
+    ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &out1, 0));
+    ioctl_tree_insert(tree, t);
+    g_assert(t->parent == tree->next);
+    g_assert(tree->next->child->next == t);
+
+    /* lots of nodes, with duplicates */
+    for (i = 0; i < 10000; ++i) {
+	c.devnum = i % 1000;
+	ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &c, 0));
+	if (i >= 1000)
+	    g_assert_cmpint(((struct usbdevfs_connectinfo *) ioctl_node_list_get(tree->last_added, -1)->data)->devnum, ==, c.devnum);
+    }
+    for (i = 0, t = tree; t != NULL; t = t->next)
+	if (t->id == USBDEVFS_CONNECTINFO)
+	    ++i;
+    /* ci and ci2 are already in the tree, the others are 1000 new ones */
+    g_assert_cmpint(i, ==, 2 + 1000 - 2);
+
+    ioctl_tree_free(tree);
+}
+
 static void
 t_iteration(void)
 {
@@ -338,6 +485,53 @@ t_iteration(void)
     ioctl_tree_free(tree);
 }
 
+static void
+t_cursor(void)
+{
+    ioctl_tree *tree = get_test_tree();
+    ioctl_tree_cursor cursor;
+    ioctl_tree *i, *expected = tree;
+    struct usbdevfs_connectinfo c = { 0, 0 };
+    FILE *f;
+    int n;
+
+    /* same order as ioctl_tree_next() */
+    for (i = ioctl_tree_cursor_init(&cursor, tree), n = 0; i != NULL; i = ioctl_tree_cursor_next(&cursor), ++n) {
+	g_assert(i == expected);
+	expected = ioctl_tree_next(expected);
+    }
+    g_assert(expected == NULL);
+    g_assert_cmpint(n, ==, 10);
+    g_assert(cursor.pending == NULL);
+
+    /* stopping early */
+    g_assert(ioctl_tree_cursor_init(&cursor, tree) == tree);
+    g_assert(ioctl_tree_cursor_next(&cursor) == tree->next);
+    g_assert(ioctl_tree_cursor_next(&cursor) == tree->next->child);
+    ioctl_tree_cursor_clear(&cursor);
+    g_assert(cursor.pending == NULL);
+    ioctl_tree_free(tree);
+
+    /* empty tree */
+    g_assert(ioctl_tree_cursor_init(&cursor, NULL) == NULL);
+    g_assert(ioctl_tree_cursor_next(&cursor) == NULL);
+
+    /* lots of top level nodes do not need a deep stack */
+    tree = NULL;
+    for (n = 0; n < 300000; ++n) {
+	c.devnum = n;
+	tree = ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &c, 0));
+    }
+    f = fopen("/dev/null", "w");
+    g_assert(f != NULL);
+    ioctl_tree_write(f, tree);
+    fclose(f);
+    i = ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &c, 0);
+    g_assert(ioctl_tree_find_equal(tree, i) == tree->last_sibling);
+    ioctl_tree_free(i);
+    ioctl_tree_free(tree);
+}
+
 static void
 init_urb(struct usbdevfs_urb *urb, const struct usbdevfs_urb *orig)
 {
@@ -359,7 +553,8 @@ init_urb(struct usbdevfs_urb *urb, const struct usbdevfs_urb *orig)
 }
 
 static void
-t_execute_check_outurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_tree ** last)
+t_execute_check_outurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_tree ** last,
+		       ioctl_replay_state * state)
 {
     char urbbuf[15];
     struct usbdevfs_urb urb;
@@ -368,13 +563,13 @@ t_execute_check_outurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl
 
     urb.buffer = urbbuf;
     init_urb(&urb, orig);
-    *last = ioctl_tree_execute(tree, *last, USBDEVFS_SUBMITURB, &urb, &ret);
+    *last = ioctl_tree_execute(tree, *last, USBDEVFS_SUBMITURB, &urb, &ret, state);
     g_assert(*last != NULL);
     g_assert(ret == 0);
     g_assert(urb.buffer == urbbuf);
 
     /* now reap it */
-    *last = ioctl_tree_execute(tree, *last, USBDEVFS_REAPURB, &urb_ret, &ret);
+    *last = ioctl_tree_execute(tree, *last, USBDEVFS_REAPURB, &urb_ret, &ret, state);
     g_assert(ret == 0);
     g_assert(urb_ret == &urb);
     g_assert_cmpint(urb.actual_length, ==, orig->actual_length);
@@ -382,7 +577,8 @@ t_execute_check_outurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl
 }
 
 static void
-t_execute_check_inurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_tree ** last)
+t_execute_check_inurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_tree ** last,
+		      ioctl_replay_state * state)
 {
     char urbbuf[15];
     struct usbdevfs_urb urb;
@@ -392,7 +588,7 @@ t_execute_check_inurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_
     urb.buffer = urbbuf;
     init_urb(&urb, orig);
 
-    *last = ioctl_tree_execute(tree, *last, USBDEVFS_SUBMITURB, &urb, &ret);
+    *last = ioctl_tree_execute(tree, *last, USBDEVFS_SUBMITURB, &urb, &ret, state);
     g_assert(*last != NULL);
     g_assert(ret == 0);
     g_assert(urb.buffer == urbbuf);
@@ -401,7 +597,7 @@ t_execute_check_inurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_
     g_assert_cmpint(urb.actual_length, ==, 0);
 
     /* now reap */
-    *last = ioctl_tree_execute(tree, *last, USBDEVFS_REAPURB, &urb_ret, &ret);
+    *last = ioctl_tree_execute(tree, *last, USBDEVFS_REAPURB, &urb_ret, &ret, state);
     g_assert(*last != NULL);
     g_assert(ret == 0);
     g_assert(urb_ret == &urb);
@@ -412,65 +608,375 @@ t_execute_check_inurb(const struct usbdevfs_urb *orig, ioctl_tree * tree, ioctl_
 static void
 t_execute(void)
 {
+    ioctl_replay_state state = { NULL, NULL };
     ioctl_tree *tree = get_test_tree();
     ioctl_tree *last = NULL;
     int ret;
     struct usbdevfs_connectinfo ci;
 
     /* should first get CI, then CI2 */
-    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &ci, &ret);
+    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &ci, &ret, &state);
     g_assert(last == tree);
     g_assert(ret == 0);
     g_assert_cmpint(ci.devnum, ==, 11);
     g_assert_cmpint(ci.slow, ==, 0);
 
-    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &ci, &ret);
+    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &ci, &ret, &state);
     g_assert(last != NULL);
     g_assert(ret == 42);
     g_assert_cmpint(ci.devnum, ==, 12);
     g_assert_cmpint(ci.slow, ==, 0);
 
     /* output URB, should leave buffer untouched */
-    t_execute_check_outurb(&s_out1, tree, &last);
+    t_execute_check_outurb(&s_out1, tree, &last, &state);
     g_assert(last == tree->next);
     /* now get the input */
-    t_execute_check_inurb(&s_in1a, tree, &last);
+    t_execute_check_inurb(&s_in1a, tree, &last, &state);
     g_assert(last == tree->next->child);
 
     /* jump to out2 */
-    t_execute_check_outurb(&s_out2, tree, &last);
+    t_execute_check_outurb(&s_out2, tree, &last, &state);
     /* get in2[abc], but interject unknown ioctl */
-    t_execute_check_inurb(&s_in2a, tree, &last);
-    g_assert(ioctl_tree_execute(tree, last, TCGETS, NULL, &ret) == NULL);
-    t_execute_check_inurb(&s_in2b, tree, &last);
-    t_execute_check_inurb(&s_in2c, tree, &last);
+    t_execute_check_inurb(&s_in2a, tree, &last, &state);
+    g_assert(ioctl_tree_execute(tree, last, TCGETS, NULL, &ret, &state) == NULL);
+    t_execute_check_inurb(&s_in2b, tree, &last, &state);
+    t_execute_check_inurb(&s_in2c, tree, &last, &state);
 
     /* URB with last == NULL */
     last = NULL;
-    t_execute_check_outurb(&s_out1, tree, &last);
+    t_execute_check_outurb(&s_out1, tree, &last, &state);
     g_assert(last == tree->next);
 
     ioctl_tree_free(tree);
 }
 
+static void
+t_execute_concurrent(void)
+{
+    ioctl_tree *tree = get_test_tree();
+    ioctl_tree *last1 = NULL, *last2 = NULL;
+    ioctl_replay_state state1 = { NULL, NULL }, state2 = { NULL, NULL };
+    char urbbuf1[15], urbbuf2[15];
+    struct usbdevfs_urb urb1, urb2;
+    struct usbdevfs_urb *urb_ret;
+    int ret;
+
+    /* two clients submit URBs before either of them reaps */
+    urb1.buffer = urbbuf1;
+    init_urb(&urb1, &s_out1);
+    urb2.buffer = urbbuf2;
+    init_urb(&urb2, &s_out2);
+    last1 = ioctl_tree_execute(tree, last1, USBDEVFS_SUBMITURB, &urb1, &ret, &state1);
+    g_assert(last1 == tree->next);
+    last2 = ioctl_tree_execute(tree, last2, USBDEVFS_SUBMITURB, &urb2, &ret, &state2);
+    g_assert(last2 == tree->next->next);
+
+    /* each one reaps its own URB */
+    ioctl_tree_execute(tree, last2, USBDEVFS_REAPURB, &urb_ret, &ret, &state2);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(urb_ret == &urb2);
+    ioctl_tree_execute(tree, last1, USBDEVFS_REAPURB, &urb_ret, &ret, &state1);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(urb_ret == &urb1);
+
+    /* nothing left to reap */
+    errno = 0;
+    ioctl_tree_execute(tree, last1, USBDEVFS_REAPURB, &urb_ret, &ret, &state1);
+    g_assert_cmpint(ret, ==, -1);
+    g_assert_cmpint(errno, ==, EAGAIN);
+
+    ioctl_tree_free(tree);
+}
+
 static void
 t_execute_unknown(void)
 {
+    ioctl_replay_state state = { NULL, NULL };
     ioctl_tree *tree = get_test_tree();
     struct usbdevfs_urb unknown_urb = { 1, 9, 0, 0, "yo!", 3, 3 };
     int ret;
 
     /* not found with last != NULL */
-    g_assert(ioctl_tree_execute(tree, tree->next, USBDEVFS_SUBMITURB, &unknown_urb, &ret) == NULL);
+    g_assert(ioctl_tree_execute(tree, tree->next, USBDEVFS_SUBMITURB, &unknown_urb, &ret, &state) == NULL);
     /* not found with last == NULL */
-    g_assert(ioctl_tree_execute(tree, NULL, USBDEVFS_SUBMITURB, &unknown_urb, &ret) == NULL);
+    g_assert(ioctl_tree_execute(tree, NULL, USBDEVFS_SUBMITURB, &unknown_urb, &ret, &state) == NULL);
+
+    ioctl_tree_free(tree);
+}
+
+static void
+t_compiled(void)
+{
+    ioctl_tree *tree = get_test_tree();
+    ioctl_tree *compiled, *last = NULL;
+    ioctl_replay_state state = { NULL, NULL };
+    char path[] = "/tmp/test-ioctl-tree.XXXXXX";
+    char contents[1000];
+    char *device;
+    uint64_t nodes_offset, bad_offset;
+    FILE *f;
+    int fd;
+
+    fd = mkstemp(path);
+    g_assert_cmpint(fd, >=, 0);
+    f = fdopen(fd, "w");
+    g_assert_cmpint(ioctl_tree_write_compiled(f, "/dev/bus/usb/001/011", tree), ==, 0);
+    fclose(f);
+    ioctl_tree_free(tree);
+
+    device = ioctl_tree_compiled_device(path);
+    g_assert_cmpstr(device, ==, "/dev/bus/usb/001/011");
+    free(device);
+
+    /* writes back the original text */
+    compiled = ioctl_tree_read_compiled(path);
+    g_assert(compiled != NULL);
+    f = tmpfile();
+    ioctl_tree_write(f, compiled);
+    rewind(f);
+    memset(contents, 0, sizeof(contents));
+    g_assert_cmpint(fread(contents, 1, sizeof(contents), f), >, 10);
+    g_assert_cmpstr(contents, ==, test_tree_str);
+    fclose(f);
+
+    /* has the right structure */
+    assert_urb(compiled->next->child->child, &s_in1b);
+    g_assert(compiled->next->child->child->parent == compiled->next->child);
+    g_assert(compiled->next->parent == NULL);
+
+    /* ... and executes */
+    t_execute_check_outurb(&s_out1, compiled, &last, &state);
+    g_assert(last == compiled->next);
+    t_execute_check_inurb(&s_in1a, compiled, &last, &state);
+    g_assert(last == compiled->next->child);
+    ioctl_tree_free(compiled);
+
+    /* node tables which are misaligned or outside of the file get rejected,
+     * also if the end overflows; the offset is at byte 40 of the header */
+    tree = get_test_tree();
+    f = fopen(path, "w");
+    g_assert_cmpint(ioctl_tree_write_compiled(f, "/dev/bus/usb/001/011", tree), ==, 0);
+    fclose(f);
+    ioctl_tree_free(tree);
+    fd = open(path, O_RDWR);
+    g_assert_cmpint(fd, >=, 0);
+    g_assert_cmpint(pread(fd, &nodes_offset, sizeof(nodes_offset), 40), ==, sizeof(nodes_offset));
+    bad_offset = nodes_offset + 4;
+    g_assert_cmpint(pwrite(fd, &bad_offset, sizeof(bad_offset), 40), ==, sizeof(bad_offset));
+    g_assert(ioctl_tree_read_compiled(path) == NULL);
+    bad_offset = UINT64_MAX & ~(uint64_t) 7;
+    g_assert_cmpint(pwrite(fd, &bad_offset, sizeof(bad_offset), 40), ==, sizeof(bad_offset));
+    g_assert(ioctl_tree_read_compiled(path) == NULL);
+    g_assert(ioctl_tree_compiled_device(path) == NULL);
+    close(fd);
+
+    /* text recordings are not compiled trees */
+    f = fopen(path, "w");
+    g_assert_cmpint(fwrite(test_tree_str, strlen(test_tree_str), 1, f), ==, 1);
+    fclose(f);
+    g_assert(ioctl_tree_compiled_device(path) == NULL);
+    g_assert(ioctl_tree_read_compiled(path) == NULL);
+
+    unlink(path);
+}
+
+static void
+t_execute_many(void)
+{
+    ioctl_replay_state state = { NULL, NULL };
+    ioctl_tree *tree = NULL, *last = NULL, *ci_last, *n;
+    struct usbdevfs_connectinfo c = { 0, 0 };
+    struct usbdevfs_urb urb = { 1, 2, 0, 0, "what", 4, 4 };
+    struct usbdevfs_urb *urbp = &urb;
+    int i, ret;
+
+    /* interleave lots of top-level nodes for different ioctls; this creates
+     * CI0, URB1, CI1, URB2, CI2, URB3, CI3, URB4, CI4, CI5, ... CI199 as
+     * equal URBs are not inserted again */
+    for (i = 0; i < 200; ++i) {
+	c.devnum = i;
+	tree = ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &c, i));
+	urb.buffer_length = urb.actual_length = 1 + i % 4;
+	tree = ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &urbp, 0));
+    }
+
+    /* CONNECTINFO gets answered in order, starting after the last executed node */
+    for (i = 0; i < 200; ++i) {
+	last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &c, &ret, &state);
+	g_assert(last != NULL);
+	g_assert_cmpint(c.devnum, ==, i);
+	g_assert_cmpint(ret, ==, i);
+    }
+    ci_last = last;
+    /* ... and wraps around */
+    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &c, &ret, &state);
+    g_assert(last == tree);
+    g_assert_cmpint(c.devnum, ==, 0);
+
+    /* SUBMITURB is answered by REAPURB nodes after last */
+    urb.buffer_length = urb.actual_length = 3;
+    n = ioctl_tree_execute(tree, last, USBDEVFS_SUBMITURB, &urb, &ret, &state);
+    g_assert(n != NULL);
+    g_assert(n == ioctl_tree_next(ioctl_tree_next(ioctl_tree_next(ioctl_tree_next(ioctl_tree_next(tree))))));
+    g_assert_cmpint(((struct usbdevfs_urb *) n->data)->buffer_length, ==, 3);
+    g_assert(ioctl_tree_execute(tree, n, USBDEVFS_REAPURB, &urbp, &ret, &state) != NULL);
+    g_assert_cmpint(ret, ==, 0);
+
+    /* continue after the URB node */
+    g_assert(ioctl_tree_execute(tree, n, USBDEVFS_CONNECTINFO, &c, &ret, &state) != NULL);
+    g_assert_cmpint(c.devnum, ==, 3);
+
+    /* new nodes get found after inserting them */
+    c.devnum = 1000;
+    tree = ioctl_tree_insert(tree, ioctl_tree_new_from_bin(USBDEVFS_CONNECTINFO, &c, 0));
+    g_assert(ioctl_tree_execute(tree, ci_last, USBDEVFS_CONNECTINFO, &c, &ret, &state) == ci_last->next);
+    g_assert_cmpint(c.devnum, ==, 1000);
+
+    ioctl_tree_free(tree);
+}
+
+static void
+t_compact(void)
+{
+    static const char orig[] =
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	"USBDEVFS_CONNECTINFO 0 0B00000000000000\n"
+	"USBDEVFS_CONNECTINFO 0 0B00000000000000\n"
+	"USBDEVFS_CONNECTINFO 0 0B00000000000000\n"
+	"USBDEVFS_CONNECTINFO 42 0C00000000000000\n"
+#else
+	"USBDEVFS_CONNECTINFO 0 0000000B00000000\n"
+	"USBDEVFS_CONNECTINFO 0 0000000B00000000\n"
+	"USBDEVFS_CONNECTINFO 0 0000000B00000000\n"
+	"USBDEVFS_CONNECTINFO 42 0000000C00000000\n"
+#endif
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+	" USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n"
+	"  USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n"
+	"   USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n"
+	"    USBDEVFS_REAPURB 0 1 129 0 0 10 9 0 616E6474686174FFC0\n";
+    static const char compacted[] =
+	"@REPEAT 3\n"
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	"USBDEVFS_CONNECTINFO 0 0B00000000000000\n"
+	"USBDEVFS_CONNECTINFO 42 0C00000000000000\n"
+#else
+	"USBDEVFS_CONNECTINFO 0 0000000B00000000\n"
+	"USBDEVFS_CONNECTINFO 42 0000000C00000000\n"
+#endif
+	"USBDEVFS_REAPURB 0 1 2 0 0 4 4 0 77686174\n"
+	"@REPEAT 3\n"
+	" USBDEVFS_REAPURB 0 1 129 0 0 10 4 0 74686973\n"
+	"  USBDEVFS_REAPURB 0 1 129 0 0 10 9 0 616E6474686174FFC0\n";
+    ioctl_replay_state state = { NULL, NULL };
+    ioctl_tree *tree, *last = NULL;
+    struct usbdevfs_connectinfo c;
+    char contents[1000];
+    int i, ret;
+    FILE *f;
+
+    f = tmpfile();
+    g_assert_cmpint(fwrite(orig, strlen(orig), 1, f), ==, 1);
+    rewind(f);
+    tree = ioctl_tree_read(f);
+    fclose(f);
+    g_assert(tree != NULL);
+
+    ioctl_tree_compact(tree);
+    g_assert_cmpuint(tree->repeat, ==, 3);
+    g_assert(tree->next->next->child->child->parent == tree->next->next->child);
+    g_assert_cmpint(tree->next->next->child->child->depth, ==, 2);
+
+    f = tmpfile();
+    ioctl_tree_write(f, tree);
+    rewind(f);
+    memset(contents, 0, sizeof(contents));
+    g_assert_cmpint(fread(contents, 1, sizeof(contents), f), >, 10);
+    g_assert_cmpstr(contents, ==, compacted);
+    ioctl_tree_free(tree);
+
+    /* read back the repeat counts */
+    rewind(f);
+    tree = ioctl_tree_read(f);
+    fclose(f);
+    g_assert(tree != NULL);
+    g_assert_cmpuint(tree->repeat, ==, 3);
+    g_assert_cmpuint(tree->next->repeat, ==, 0);
+    g_assert_cmpuint(tree->next->next->child->repeat, ==, 3);
+
+    /* replays the original sequence */
+    for (i = 0; i < 3; ++i) {
+	last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &c, &ret, &state);
+	g_assert(last == tree);
+	g_assert_cmpint(ret, ==, 0);
+	g_assert_cmpint(c.devnum, ==, 11);
+    }
+    g_assert_cmpint(ioctl_tree_next_ret(tree, last, &state), ==, 42);
+    last = ioctl_tree_execute(tree, last, USBDEVFS_CONNECTINFO, &c, &ret, &state);
+    g_assert(last == tree->next);
+    g_assert_cmpint(ret, ==, 42);
+    g_assert_cmpint(c.devnum, ==, 12);
+
+    t_execute_check_outurb(&s_out1, tree, &last, &state);
+    g_assert(last == tree->next->next);
+    for (i = 0; i < 3; ++i) {
+	t_execute_check_inurb(&s_in1a, tree, &last, &state);
+	g_assert(last == tree->next->next->child);
+    }
+    t_execute_check_inurb(&s_in1b, tree, &last, &state);
+    g_assert(last == tree->next->next->child->child);
+
+    ioctl_tree_free(tree);
+}
+
+static void
+t_journal(void)
+{
+    const struct usbdevfs_urb *requests[] = { out1, in1a, in1b, out2, in2a, out1, in3 };
+    ioctl_tree *tree = NULL, *recovered, *n;
+    char contents[1000], recovered_contents[1000];
+    FILE *journal, *f;
+
+    journal = tmpfile();
+    fputs("@DEV /dev/bus/usb/001/011\n", journal);
+    for (size_t i = 0; i < sizeof(requests) / sizeof(requests[0]); ++i) {
+	n = ioctl_tree_new_from_bin(USBDEVFS_REAPURB, &requests[i], 0);
+	ioctl_tree_write_journal(journal, n);
+	tree = ioctl_tree_insert(tree, n);
+    }
+    /* crash while writing a record */
+    fputs("USBDEVFS_REAPURB 0 1 129 0 0 15 6 0 66696C", journal);
+
+    rewind(journal);
+    recovered = ioctl_tree_read_journal(NULL, journal);
+    fclose(journal);
+    g_assert(recovered != NULL);
+
+    /* same tree as the one which got recorded */
+    f = tmpfile();
+    ioctl_tree_write(f, tree);
+    rewind(f);
+    memset(contents, 0, sizeof(contents));
+    g_assert_cmpint(fread(contents, 1, sizeof(contents), f), >, 10);
+    fclose(f);
+    f = tmpfile();
+    ioctl_tree_write(f, recovered);
+    rewind(f);
+    memset(recovered_contents, 0, sizeof(recovered_contents));
+    g_assert_cmpint(fread(recovered_contents, 1, sizeof(recovered_contents), f), >, 10);
+    fclose(f);
+    g_assert_cmpstr(recovered_contents, ==, contents);
+    assert_urb(recovered->next->next->child, &s_in2a);
+    assert_urb(recovered->next->next->next, &s_in3);
 
     ioctl_tree_free(tree);
+    ioctl_tree_free(recovered);
 }
 
 static void
 t_evdev(void)
 {
+    ioctl_replay_state state = { NULL, NULL };
     ioctl_tree *tree = NULL, *t;
     FILE *f;
     char contents[1000];
@@ -526,37 +1032,37 @@ t_evdev(void)
     fclose(f);
 
     /* execute EVIOCGABS ioctls */
-    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_X), &abs_query, &ret));
+    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_X), &abs_query, &ret, &state));
     g_assert(ret == 0);
     g_assert(memcmp(&abs_query, &absinfo_x, sizeof(abs_query)) == 0);
 
-    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_VOLUME), &abs_query, &ret));
+    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_VOLUME), &abs_query, &ret, &state));
     g_assert(ret == 8);
     g_assert(memcmp(&abs_query, &absinfo_volume, sizeof(abs_query)) == 0);
 
-    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_Y), &abs_query, &ret));
+    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGABS(ABS_Y), &abs_query, &ret, &state));
 
     /* execute EVIOCGBIT ioctls */
     /* ensure that it doesn't write beyond specified length */
     memset(bits_query, 0xAA, sizeof(bits_query));
-    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_SYN, sizeof(synbits)), &bits_query, &ret));
+    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_SYN, sizeof(synbits)), &bits_query, &ret, &state));
     g_assert(ret == 0x81);
     g_assert(memcmp(&bits_query, "\x01\x02\x03\x04\xAA\xAA\xAA\xAA", 8) == 0);
 
     memset(bits_query, 0xAA, sizeof(bits_query));
-    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_KEY, sizeof(keybits)), &bits_query, &ret));
+    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_KEY, sizeof(keybits)), &bits_query, &ret, &state));
     g_assert(ret == 0x82);
     g_assert(memcmp(&bits_query, keybits, sizeof(bits_query)) == 0);
 
     memset(bits_query, 0xAA, sizeof(bits_query));
-    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_PWR, sizeof(pwrbits)), &bits_query, &ret));
+    g_assert(ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_PWR, sizeof(pwrbits)), &bits_query, &ret, &state));
     g_assert(ret == 0x83);
     g_assert(memcmp(&bits_query, "\0\0\0\0\xAA\xAA\xAA\xAA", 8) == 0);
 
     /* undefined for other ev type */
-    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_REL, sizeof(synbits)), &bits_query, &ret));
+    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_REL, sizeof(synbits)), &bits_query, &ret, &state));
     /* undefined for other length */
-    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_KEY, 4), &bits_query, &ret));
+    g_assert(!ioctl_tree_execute(tree, NULL, EVIOCGBIT(EV_KEY, 4), &bits_query, &ret, &state));
 
     ioctl_tree_free(tree);
 }
@@ -572,10 +1078,19 @@ main(int argc, char **argv)
     g_test_add_func("/umockdev-ioctl-tree/type_get_by", t_type_get_by);
     g_test_add_func("/umockdev-ioctl-tree/create_from_bin", t_create_from_bin);
     g_test_add_func("/umockdev-ioctl-tree/write", t_write);
+    g_test_add_func("/umockdev-ioctl-tree/insert_dedup", t_insert_dedup);
     g_test_add_func("/umockdev-ioctl-tree/read", t_read);
+    g_test_add_func("/umockdev-ioctl-tree/read_invalid_length", t_read_invalid_length);
+    g_test_add_func("/umockdev-ioctl-tree/read_large", t_read_large);
     g_test_add_func("/umockdev-ioctl-tree/iteration", t_iteration);
+    g_test_add_func("/umockdev-ioctl-tree/cursor", t_cursor);
     g_test_add_func("/umockdev-ioctl-tree/execute", t_execute);
+    g_test_add_func("/umockdev-ioctl-tree/execute_concurrent", t_execute_concurrent);
     g_test_add_func("/umockdev-ioctl-tree/execute_unknown", t_execute_unknown);
+    g_test_add_func("/umockdev-ioctl-tree/execute_many", t_execute_many);
+    g_test_add_func("/umockdev-ioctl-tree/compiled", t_compiled);
+    g_test_add_func("/umockdev-ioctl-tree/compact", t_compact);
+    g_test_add_func("/umockdev-ioctl-tree/journal", t_journal);
 
     g_test_add_func("/umockdev-ioctl-tree/evdev", t_evdev);
 
@@ -372,6 +372,51 @@ t_system_ioctl_log_append_dev_mismatch ()
     checked_remove (log);
 }
 
+/*
+ * umockdev-record --ioctl merges a journal which a crashed recording left behind
+ */
+static void
+t_system_ioctl_log_journal_recover ()
+{
+    string sout;
+    string serr;
+    int exit;
+    string log;
+
+    FileUtils.close(checked_open_tmp ("ioctl_log_test.XXXXXX", out log));
+    string journal = log + ".journal";
+
+    try {
+        FileUtils.set_contents (journal, "@DEV /dev/zero\nUSBDEVFS_CONNECTINFO 0 0B00000000000000\n");
+    } catch (FileError e) {
+        error ("Cannot write journal: %s", e.message);
+    }
+
+    spawn ("umockdev-record" + " -i /dev/zero=" + log + " -- " + readbyte_path + " /dev/zero",
+           out sout, out serr, out exit);
+    assert_cmpstr (serr, CompareOperator.EQ, "");
+    assert_cmpint (exit, CompareOperator.EQ, 0);
+    assert_cmpstr (file_contents (log), CompareOperator.EQ,
+                   "@DEV /dev/zero\nUSBDEVFS_CONNECTINFO 0 0B00000000000000\n");
+    assert (!FileUtils.test (journal, FileTest.EXISTS));
+
+    // the recovered log gets written in the requested format
+    checked_remove (log);
+    try {
+        FileUtils.set_contents (journal, "@DEV /dev/zero\nUSBDEVFS_CONNECTINFO 0 0B00000000000000\n");
+    } catch (FileError e) {
+        error ("Cannot write journal: %s", e.message);
+    }
+    spawn ("umockdev-record" + " --ioctl-compiled -i /dev/zero=" + log + " -- " + readbyte_path + " /dev/zero",
+           out sout, out serr, out exit);
+    assert_cmpstr (serr, CompareOperator.EQ, "");
+    assert_cmpint (exit, CompareOperator.EQ, 0);
+    assert (file_contents (log).has_prefix ("UMDIOCTB"));
+    assert (!FileUtils.test (journal, FileTest.EXISTS));
+
+    checked_remove (log);
+}
+
 /*
  * umockdev-record --script recording to a file, with simple "readbyte" command
  */
@@ -922,6 +967,7 @@ main (string[] args)
     Test.add_func ("/umockdev-record/system-invalid", t_system_invalid);
     Test.add_func ("/umockdev-record/ioctl-log", t_system_ioctl_log);
     Test.add_func ("/umockdev-record/ioctl-log-append-dev-mismatch", t_system_ioctl_log_append_dev_mismatch);
+    Test.add_func ("/umockdev-record/ioctl-log-journal-recover", t_system_ioctl_log_journal_recover);
     Test.add_func ("/umockdev-record/script-log-simple", t_system_script_log_simple);
     Test.add_func ("/umockdev-record/script-log-simple-fopen", t_system_script_log_simple_fopen);
     Test.add_func ("/umockdev-record/script-log-append-same-dev", t_system_script_log_append_same_dev);
@@ -28,6 +28,10 @@ using Selinux;
 
 string rootdir;
 
+/* test hook of the library, which is not part of the API */
+[CCode (cname = "umockdev_ioctl_recording_get_n_loads")]
+extern uint ioctl_recording_get_n_loads ();
+
 /* exception-handling wrappers */
 static int
 checked_open_tmp (string tmpl, out string name_used) {
@@ -512,6 +516,90 @@ USBDEVFS_CONNECTINFO 0 0000000B00000000
 }
 
 
+void
+t_usbfs_ioctl_tree_shared ()
+{
+  var tb = new UMockdev.Testbed ();
+  tb_add_from_string (tb, """P: /devices/mycam
+N: 001
+E: SUBSYSTEM=usb
+""");
+  tb_add_from_string (tb, """P: /devices/mycam2
+N: 002
+E: SUBSYSTEM=usb
+""");
+  tb_add_from_string (tb, """P: /devices/mycam3
+N: 003
+E: SUBSYSTEM=usb
+""");
+
+  string test_tree;
+  if (BYTE_ORDER == ByteOrder.LITTLE_ENDIAN)
+      test_tree = """USBDEVFS_CONNECTINFO 0 0B00000000000000
+USBDEVFS_CONNECTINFO 42 0C00000001000000
+""";
+  else
+      test_tree = """USBDEVFS_CONNECTINFO 0 0000000B00000000
+USBDEVFS_CONNECTINFO 42 0000000C01000000
+""";
+
+  string tmppath;
+  int fd = checked_open_tmp ("test_ioctl_tree.XXXXXX", out tmppath);
+  assert_cmpint ((int) Posix.write (fd, test_tree, test_tree.length), CompareOperator.GT, 20);
+  Posix.close (fd);
+
+  // the same recording for two devices shares the parsed tree
+  uint loads = ioctl_recording_get_n_loads ();
+  try {
+      tb.load_ioctl ("/dev/001", tmppath);
+      tb.load_ioctl ("/dev/002", tmppath);
+  } catch (Error e) {
+      error ("Cannot load ioctls: %s", e.message);
+  }
+  assert_cmpuint (ioctl_recording_get_n_loads (), CompareOperator.EQ, loads + 1);
+
+  // a modified file gets loaded again
+  if (BYTE_ORDER == ByteOrder.LITTLE_ENDIAN)
+      test_tree = "USBDEVFS_CONNECTINFO 0 0D00000000000000\n";
+  else
+      test_tree = "USBDEVFS_CONNECTINFO 0 0000000D00000000\n";
+  try {
+      FileUtils.set_contents (tmppath, test_tree);
+      tb.load_ioctl ("/dev/003", tmppath);
+  } catch (Error e) {
+      error ("Cannot load ioctls: %s", e.message);
+  }
+  assert_cmpuint (ioctl_recording_get_n_loads (), CompareOperator.EQ, loads + 2);
+  checked_remove (tmppath);
+
+  int fd1 = Posix.open ("/dev/001", Posix.O_RDWR, 0);
+  assert_cmpint (fd1, CompareOperator.GE, 0);
+  int fd2 = Posix.open ("/dev/002", Posix.O_RDWR, 0);
+  assert_cmpint (fd2, CompareOperator.GE, 0);
+  int fd3 = Posix.open ("/dev/003", Posix.O_RDWR, 0);
+  assert_cmpint (fd3, CompareOperator.GE, 0);
+
+  // each client replays from its own position
+  var ci = Ioctl.usbdevfs_connectinfo();
+  assert_cmpint (Posix.ioctl (fd1, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 0);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 11);
+  assert_cmpint (Posix.ioctl (fd2, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 0);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 11);
+  assert_cmpint (Posix.ioctl (fd1, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 42);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 12);
+  assert_cmpint (Posix.ioctl (fd2, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 42);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 12);
+
+  // the reloaded recording has the new contents
+  assert_cmpint (Posix.ioctl (fd3, Ioctl.USBDEVFS_CONNECTINFO, ref ci), CompareOperator.EQ, 0);
+  assert_cmpuint (ci.devnum, CompareOperator.EQ, 13);
+
+  Posix.close (fd1);
+  Posix.close (fd2);
+  Posix.close (fd3);
+}
+
+
 void
 t_usbfs_ioctl_tree_xz ()
 {
@@ -1054,6 +1142,195 @@ t_mt_uevent ()
   assert_cmpuint (change_count, CompareOperator.EQ, num_changes);
 }
 
+void
+t_uevent_batch ()
+{
+  var tb = new UMockdev.Testbed ();
+  var gudev = new GUdev.Client ({"pci"});
+  string[] received = {};
+
+  string[] syspaths = {};
+  for (int i = 0; i < 5; ++i)
+    syspaths += tb.add_devicev ("pci", "dev%i".printf (i), null, {"a", "1"}, {});
+  // drain the "add" events
+  while (MainContext.default ().iteration (false));
+
+  gudev.uevent.connect((client, action, device) => {
+      received += action + " " + device.get_sysfs_path ();
+    });
+
+  // nothing gets delivered until the outermost commit
+  tb.begin_uevent_batch ();
+  tb.uevent (syspaths[0], "change");
+  string[] batch = {};
+  for (int i = 1; i < 5; ++i)
+    batch += syspaths[i];
+  tb.uevent_batch (batch, "change");
+  tb.remove_device (syspaths[4]);
+  Thread.usleep (100000);
+  while (MainContext.default ().iteration (false));
+  assert_cmpint (received.length, CompareOperator.EQ, 0);
+
+  // batches are per thread, other threads' uevents are not held back
+  new Thread<void*> ("uevent", () => {
+      tb.uevent (syspaths[0], "online");
+      return null;
+    }).join ();
+  var timeout = new Timer ();
+  while (received.length < 1 && timeout.elapsed () < 3.0)
+    MainContext.default ().iteration (false);
+  assert_cmpint (received.length, CompareOperator.EQ, 1);
+  assert_cmpstr (received[0], CompareOperator.EQ, "online " + syspaths[0]);
+
+  tb.commit_uevent_batch ();
+  timeout.start ();
+  while (received.length < 7 && timeout.elapsed () < 3.0)
+    MainContext.default ().iteration (false);
+
+  assert_cmpint (received.length, CompareOperator.EQ, 7);
+  for (int i = 0; i < 5; ++i)
+    assert_cmpstr (received[i + 1], CompareOperator.EQ, "change " + syspaths[i]);
+  assert_cmpstr (received[6], CompareOperator.EQ, "remove " + syspaths[4]);
+}
+
+void
+t_uevent_storm ()
+{
+  var tb = new UMockdev.Testbed ();
+  var gudev = new GUdev.Client ({"pci"});
+  string[] received = {};
+
+  string[] syspaths = {};
+  for (int i = 0; i < 3; ++i)
+    syspaths += tb.add_devicev ("pci", "dev%i".printf (i), null, {"a", "1"}, {});
+  // drain the "add" events
+  while (MainContext.default ().iteration (false));
+
+  gudev.uevent.connect((client, action, device) => {
+      received += action + " " + device.get_sysfs_path ();
+    });
+
+  var stats = new VariantDict (tb.uevent_storm (syspaths, {"change", "online"}, 20, 0));
+  assert_cmpuint ((uint) stats.lookup_value ("events", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 20);
+  assert_cmpuint ((uint) stats.lookup_value ("delivered", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 20);
+  assert_cmpuint ((uint) stats.lookup_value ("dropped", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 0);
+  assert (stats.lookup_value ("events-per-second", VariantType.DOUBLE).get_double () > 0);
+  assert (stats.lookup_value ("latency-p50", VariantType.UINT64).get_uint64 () <=
+          stats.lookup_value ("latency-max", VariantType.UINT64).get_uint64 ());
+
+  var timeout = new Timer ();
+  while (received.length < 20 && timeout.elapsed () < 3.0)
+    MainContext.default ().iteration (false);
+
+  assert_cmpint (received.length, CompareOperator.EQ, 20);
+  assert_cmpstr (received[0], CompareOperator.EQ, "change " + syspaths[0]);
+  assert_cmpstr (received[1], CompareOperator.EQ, "online " + syspaths[1]);
+  assert_cmpstr (received[5], CompareOperator.EQ, "online " + syspaths[2]);
+}
+
+static uint64
+uevent_stat (UMockdev.Testbed tb, string key)
+{
+  return tb.get_uevent_stats ().lookup_value (key, VariantType.UINT64).get_uint64 ();
+}
+
+void
+t_uevent_dropped ()
+{
+  var tb = new UMockdev.Testbed ();
+  var syspath = tb.add_devicev ("pci", "dev", null, {"a", "1"}, {});
+  Socket listener = null;
+
+  // a listener which went away
+  string gone_path = Path.build_filename (tb.get_root_dir (), "event1000000");
+  try {
+      listener = new Socket (SocketFamily.UNIX, SocketType.DATAGRAM, SocketProtocol.DEFAULT);
+      listener.bind (new UnixSocketAddress (gone_path), true);
+      listener.close ();
+  } catch (Error e) {
+      error ("Cannot create listener: %s", e.message);
+  }
+
+  uint64 dropped = uevent_stat (tb, "dropped");
+  tb.uevent (syspath, "change");
+  assert_cmpuint ((uint) (uevent_stat (tb, "dropped") - dropped), CompareOperator.EQ, 1);
+  assert (!FileUtils.test (gone_path, FileTest.EXISTS));
+
+  // a listener which does not read its events gets some, then they get dropped
+  try {
+      listener = new Socket (SocketFamily.UNIX, SocketType.DATAGRAM, SocketProtocol.DEFAULT);
+      listener.bind (new UnixSocketAddress (Path.build_filename (tb.get_root_dir (), "event1000001")), true);
+  } catch (Error e) {
+      error ("Cannot create listener: %s", e.message);
+  }
+
+  uint64 delivered = uevent_stat (tb, "delivered");
+  dropped = uevent_stat (tb, "dropped");
+  for (int i = 0; i < 100000 && uevent_stat (tb, "dropped") == dropped; ++i)
+      tb.uevent (syspath, "change");
+  assert_cmpuint ((uint) (uevent_stat (tb, "dropped") - dropped), CompareOperator.EQ, 1);
+  assert_cmpuint ((uint) (uevent_stat (tb, "delivered") - delivered), CompareOperator.GT, 0);
+}
+
+void
+t_uevent_replay ()
+{
+  var tb = new UMockdev.Testbed ();
+  var gudev = new GUdev.Client ({"usb"});
+  string[] received = {};
+  string? model_on_change = null;
+
+  gudev.uevent.connect((client, action, device) => {
+      received += action + " " + device.get_sysfs_path ();
+      if (action == "change")
+        model_on_change = device.get_property ("ID_MODEL");
+    });
+
+  try {
+    tb.load_uevents_from_string ("""# umockdev uevent recording, source: udev
+U: 0.000100 add /module/usbhid
+E: SUBSYSTEM=module
+
+U: 0.001000 add /devices/usb1/1-1
+E: SUBSYSTEM=usb
+E: DEVTYPE=usb_device
+E: ID_MODEL=Gadget
+E: SEQNUM=1234
+U: 0.002000 change /devices/usb1/1-1
+E: SUBSYSTEM=usb
+E: DEVTYPE=usb_device
+E: ID_MODEL=Gadget2
+U: 0.003000 remove /devices/usb1/1-1
+E: SUBSYSTEM=usb
+E: DEVTYPE=usb_device
+""", 0);
+  } catch (Error e) {
+    error ("Cannot load uevents: %s", e.message);
+  }
+  tb.wait_uevents ();
+
+  var timeout = new Timer ();
+  while (received.length < 3 && timeout.elapsed () < 3.0)
+    MainContext.default ().iteration (false);
+
+  assert_cmpint (received.length, CompareOperator.EQ, 3);
+  assert_cmpstr (received[0], CompareOperator.EQ, "add /sys/devices/usb1/1-1");
+  assert_cmpstr (received[1], CompareOperator.EQ, "change /sys/devices/usb1/1-1");
+  assert_cmpstr (received[2], CompareOperator.EQ, "remove /sys/devices/usb1/1-1");
+  assert_cmpstr (model_on_change, CompareOperator.EQ, "Gadget2");
+  assert (!FileUtils.test ("/sys/devices/usb1/1-1", FileTest.EXISTS));
+
+  // invalid recording
+  try {
+    tb.load_uevents_from_string ("U: 0.000000 add\n", 1);
+    assert_not_reached ();
+  } catch (UMockdev.Error e) {
+    assert (e is UMockdev.Error.PARSE);
+  } catch (Error e) {
+    error ("unexpected error: %s", e.message);
+  }
+}
+
 static bool
 ioctl_custom_handle_ioctl_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
 {
@@ -1162,6 +1439,157 @@ E: SUBSYSTEM=test
   assert_cmpint ((int) Posix.read (fd, read_buf, 10), CompareOperator.EQ, -1);
   assert_cmpint (Posix.errno, CompareOperator.EQ, Posix.EAGAIN);
 
+  /* all requests got accounted */
+  var stats = handler.get_stats ();
+  var s = stats.lookup_value ("0x3", VariantType.VARDICT);
+  assert (s != null);
+  assert_cmpuint ((uint) s.lookup_value ("count", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 1);
+  assert_cmpuint ((uint) s.lookup_value ("resolves", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 1);
+  assert_cmpuint ((uint) s.lookup_value ("read-mem-bytes", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 4);
+  assert_cmpuint ((uint) s.lookup_value ("write-mem-bytes", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 4);
+  s = stats.lookup_value ("write", VariantType.VARDICT);
+  assert (s != null);
+  assert_cmpuint ((uint) s.lookup_value ("count", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 1);
+  assert_cmpuint ((uint) s.lookup_value ("read-mem-bytes", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 10);
+  s = stats.lookup_value ("read", VariantType.VARDICT);
+  assert (s != null);
+  assert_cmpuint ((uint) s.lookup_value ("count", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 2);
+  assert_cmpuint ((uint) s.lookup_value ("write-mem-bytes", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 10);
+  assert (stats.lookup_value ("0x4", VariantType.VARDICT) == null);
+
+  Posix.close(fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+/* counts the requests in which resolve() returned an object of an earlier
+ * request */
+static int ioctl_reuse_count;
+
+static bool
+ioctl_reuse_handle_ioctl_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
+{
+    try {
+        var data = client.arg.resolve(0, sizeof(int));
+
+        void* seen = data.get_data("seen");
+        if (seen != null)
+            ioctl_reuse_count++;
+        data.set_data("seen", (void*) 1);
+        *(int*) data.data = 42;
+
+        /* still holding data while completing */
+        client.complete(0, 0);
+    } catch (Error e) {
+        error ("cannot resolve client arg: %s", e.message);
+    }
+    return true;
+}
+
+void
+t_ioctl_data_reuse()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  var handler = new UMockdev.IoctlBase();
+  handler.connect("signal::handle-ioctl", ioctl_reuse_handle_ioctl_cb, null);
+  ioctl_reuse_count = 0;
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  for (int i = 0; i < 3; i++) {
+      int target = 0;
+      assert_cmpint (Posix.ioctl (fd, 1, &target), CompareOperator.EQ, 0);
+      assert_cmpint (target, CompareOperator.EQ, 42);
+  }
+
+  /* the resolved data of the first request got reused by the later ones */
+  assert_cmpint (ioctl_reuse_count, CompareOperator.EQ, 2);
+
+  Posix.close(fd);
+
+  try {
+      tb.detach_ioctl("/dev/test");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
+static bool
+ioctl_dirty_handle_ioctl_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
+{
+    try {
+        var data = client.arg.resolve(0, 64);
+
+        data.data[0] = 1;
+        data.data[10] = 2;
+        data.update(20, new uint8[] { 3 });
+        /* with request 4, only declare the first direct change */
+        if (client.request == 4)
+            data.mark_dirty(0, 1);
+
+        client.complete(0, 0);
+    } catch (Error e) {
+        error ("cannot resolve client arg: %s", e.message);
+    }
+    return true;
+}
+
+void
+t_ioctl_mark_dirty()
+{
+  var tb = new UMockdev.Testbed ();
+
+  tb_add_from_string (tb, """P: /devices/test
+N: test
+E: SUBSYSTEM=test
+""");
+
+  var handler = new UMockdev.IoctlBase();
+  handler.connect("signal::handle-ioctl", ioctl_dirty_handle_ioctl_cb, null);
+
+  try {
+      tb.attach_ioctl("/dev/test", handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int fd = Posix.open ("/dev/test", Posix.O_RDWR, 0);
+  assert_cmpint (fd, CompareOperator.GE, 0);
+
+  /* without mark_dirty(), all changes get written back */
+  var buf = new uint8[64];
+  assert_cmpint (Posix.ioctl (fd, 3, (void*) buf), CompareOperator.EQ, 0);
+  assert_cmpuint (buf[0], CompareOperator.EQ, 1);
+  assert_cmpuint (buf[10], CompareOperator.EQ, 2);
+  assert_cmpuint (buf[20], CompareOperator.EQ, 3);
+
+  /* with it, only the marked and updated ranges */
+  buf = new uint8[64];
+  assert_cmpint (Posix.ioctl (fd, 4, (void*) buf), CompareOperator.EQ, 0);
+  assert_cmpuint (buf[0], CompareOperator.EQ, 1);
+  assert_cmpuint (buf[10], CompareOperator.EQ, 0);
+  assert_cmpuint (buf[20], CompareOperator.EQ, 3);
+
+  var s = handler.get_stats ().lookup_value ("0x4", VariantType.VARDICT);
+  assert (s != null);
+  assert_cmpuint ((uint) s.lookup_value ("write-mem-bytes", VariantType.UINT64).get_uint64 (), CompareOperator.EQ, 2);
 
   Posix.close(fd);
 
@@ -1172,6 +1600,85 @@ E: SUBSYSTEM=test
   }
 }
 
+/* the handler of /dev/slow blocks until the one of /dev/fast ran */
+static Mutex worker_mutex;
+static Cond worker_cond;
+static bool worker_fast_done;
+
+static bool
+ioctl_worker_slow_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
+{
+    worker_mutex.lock ();
+    while (!worker_fast_done)
+        worker_cond.wait (worker_mutex);
+    worker_mutex.unlock ();
+
+    client.complete(2, 0);
+    return true;
+}
+
+static bool
+ioctl_worker_fast_cb(UMockdev.IoctlBase handler, UMockdev.IoctlClient client)
+{
+    worker_mutex.lock ();
+    worker_fast_done = true;
+    worker_cond.broadcast ();
+    worker_mutex.unlock ();
+
+    client.complete(1, 0);
+    return true;
+}
+
+void
+t_ioctl_worker_threads()
+{
+  var tb = new UMockdev.Testbed ();
+  tb.set_worker_threads (2);
+
+  tb_add_from_string (tb, """P: /devices/slow
+N: slow
+E: SUBSYSTEM=test
+
+P: /devices/fast
+N: fast
+E: SUBSYSTEM=test
+""");
+
+  var slow_handler = new UMockdev.IoctlBase();
+  var fast_handler = new UMockdev.IoctlBase();
+  slow_handler.connect("signal::handle-ioctl", ioctl_worker_slow_cb, null);
+  fast_handler.connect("signal::handle-ioctl", ioctl_worker_fast_cb, null);
+  worker_fast_done = false;
+
+  try {
+      tb.attach_ioctl("/dev/slow", slow_handler);
+      tb.attach_ioctl("/dev/fast", fast_handler);
+  } catch (Error e) {
+      error ("Failed to attach ioctl: %s", e.message);
+  }
+
+  int slow_fd = Posix.open ("/dev/slow", Posix.O_RDWR, 0);
+  assert_cmpint (slow_fd, CompareOperator.GE, 0);
+  int fast_fd = Posix.open ("/dev/fast", Posix.O_RDWR, 0);
+  assert_cmpint (fast_fd, CompareOperator.GE, 0);
+
+  /* with a single worker thread, this would block the /dev/fast handler */
+  var slow_thread = new Thread<int> ("slow-ioctl", () => Posix.ioctl (slow_fd, 1, 0));
+
+  assert_cmpint (Posix.ioctl (fast_fd, 1, 0), CompareOperator.EQ, 1);
+  assert_cmpint (slow_thread.join (), CompareOperator.EQ, 2);
+
+  Posix.close (slow_fd);
+  Posix.close (fast_fd);
+
+  try {
+      tb.detach_ioctl("/dev/slow");
+      tb.detach_ioctl("/dev/fast");
+  } catch (Error e) {
+      error ("Failed to detach ioctl: %s", e.message);
+  }
+}
+
 int
 main (string[] args)
 {
@@ -1200,6 +1707,7 @@ main (string[] args)
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree", t_usbfs_ioctl_tree);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_with_default_device", t_usbfs_ioctl_tree_with_default_device);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_override_default_device", t_usbfs_ioctl_tree_override_default_device);
+  Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_shared", t_usbfs_ioctl_tree_shared);
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_tree_xz", t_usbfs_ioctl_tree_xz);
 
   Test.add_func ("/umockdev-testbed-vala/usbfs_ioctl_pcap", t_usbfs_ioctl_pcap);
@@ -1221,9 +1729,16 @@ main (string[] args)
   /* tests for multi-thread safety */
   Test.add_func ("/umockdev-testbed-vala/mt_parallel_attr_distinct", t_mt_parallel_attr_distinct);
   Test.add_func ("/umockdev-testbed-vala/mt_uevent", t_mt_uevent);
+  Test.add_func ("/umockdev-testbed-vala/uevent_batch", t_uevent_batch);
+  Test.add_func ("/umockdev-testbed-vala/uevent_storm", t_uevent_storm);
+  Test.add_func ("/umockdev-testbed-vala/uevent_dropped", t_uevent_dropped);
+  Test.add_func ("/umockdev-testbed-vala/uevent_replay", t_uevent_replay);
 
   /* test IoctlBase attachment and signals */
   Test.add_func ("/umockdev-testbed-vala/ioctl_custom", t_ioctl_custom);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_data_reuse", t_ioctl_data_reuse);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_mark_dirty", t_ioctl_mark_dirty);
+  Test.add_func ("/umockdev-testbed-vala/ioctl_worker_threads", t_ioctl_worker_threads);
 
   return Test.run();
 }
@@ -36,6 +36,7 @@
 #include <sys/un.h>
 #include <sys/vfs.h>
 #include <sys/xattr.h>
+#include <linux/netlink.h>
 #include <linux/usbdevice_fs.h>
 #include <linux/input.h>
 #include <linux/magic.h>
@@ -695,6 +696,49 @@ t_testbed_uevent_libudev_filter(UMockdevTestbedFixture * fixture, UNUSED_DATA)
     udev_unref(udev);
 }
 
+static void
+t_testbed_uevent_libudev_filter_tag(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    struct udev *udev;
+    struct udev_monitor *mon;
+    struct udev_device *device;
+
+    /* set up monitor */
+    udev = udev_new();
+    g_assert(udev != NULL);
+    mon = udev_monitor_new_from_netlink(udev, "udev");
+    g_assert(mon != NULL);
+    g_assert_cmpint(udev_monitor_filter_add_match_tag(mon, "seat"), ==, 0);
+    g_assert_cmpint(udev_monitor_filter_update(mon), ==, 0);
+    g_assert_cmpint(udev_monitor_enable_receiving(mon), ==, 0);
+
+    gboolean success = umockdev_testbed_add_from_string(
+            fixture->testbed,
+            "P: /devices/untagged\n"
+            "E: SUBSYSTEM=pci\n"
+            "\n"
+            "P: /devices/othertag\n"
+            "E: SUBSYSTEM=pci\n"
+            "E: TAGS=:uaccess:\n"
+            "\n"
+            "P: /devices/tagged\n"
+            "E: SUBSYSTEM=pci\n"
+            "E: TAGS=:uaccess:seat:\n"
+            "E: CURRENT_TAGS=:seat:\n", NULL);
+    g_assert (success);
+
+    /* only the tagged device passes the socket filter */
+    device = udev_monitor_receive_device(mon);
+    g_assert(device != NULL);
+    g_assert_cmpstr(udev_device_get_syspath(device), ==, "/sys/devices/tagged");
+    g_assert_cmpstr(udev_device_get_action(device), ==, "add");
+    udev_device_unref(device);
+    g_assert(udev_monitor_receive_device(mon) == NULL);
+
+    udev_monitor_unref(mon);
+    udev_unref(udev);
+}
+
 struct event_counter {
     unsigned add;
     unsigned remove;
@@ -730,6 +774,75 @@ on_timeout(gpointer user_data)
 }
 
 
+/* batching monitors drain the netlink socket with recvmmsg() */
+static void
+t_testbed_uevent_recvmmsg(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    struct udev *udev;
+    struct udev_monitor *mon;
+    const int num_events = 3;
+    const int num_slots = 8;
+    struct mmsghdr msgs[num_slots];
+    struct iovec iovs[num_slots];
+    struct sockaddr_nl senders[num_slots];
+    char bufs[num_slots][4096];
+    char creds[num_slots][CMSG_SPACE(sizeof(struct ucred))];
+    int fd, ret;
+
+    /* set up monitor; this enables SO_PASSCRED */
+    udev = udev_new();
+    g_assert(udev != NULL);
+    mon = udev_monitor_new_from_netlink(udev, "udev");
+    g_assert(mon != NULL);
+    fd = udev_monitor_get_fd(mon);
+    g_assert_cmpint(fd, >, 0);
+    g_assert_cmpint(udev_monitor_enable_receiving(mon), ==, 0);
+
+    gchar *syspath = umockdev_testbed_add_device(fixture->testbed, "pci", "mydev", NULL,
+                                                 NULL, "ID_INPUT", "1", NULL);
+    g_assert(syspath);
+    for (int i = 0; i < num_events; ++i)
+        umockdev_testbed_uevent(fixture->testbed, syspath, "change");
+
+    memset(msgs, 0, sizeof msgs);
+    memset(senders, 0xFF, sizeof senders);
+    for (int i = 0; i < num_slots; ++i) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = sizeof bufs[i];
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &senders[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof senders[i];
+        msgs[i].msg_hdr.msg_control = creds[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof creds[i];
+    }
+
+    /* the "add" plus the change events, all in one call */
+    ret = recvmmsg(fd, msgs, num_slots, MSG_DONTWAIT, NULL);
+    g_assert_cmpint(ret, ==, num_events + 1);
+
+    for (int i = 0; i < ret; ++i) {
+        struct cmsghdr *cmsg;
+        struct ucred cred;
+
+        g_assert_cmpuint(msgs[i].msg_len, >, 8);
+        g_assert_cmpstr(bufs[i], ==, "libudev");
+        g_assert_cmpint(senders[i].nl_family, ==, AF_NETLINK);
+        g_assert_cmpuint(senders[i].nl_pid, ==, 0);
+        g_assert_cmpuint(senders[i].nl_groups, ==, 2);
+
+        cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr);
+        g_assert(cmsg != NULL);
+        g_assert_cmpint(cmsg->cmsg_type, ==, SCM_CREDENTIALS);
+        memcpy(&cred, CMSG_DATA(cmsg), sizeof cred);
+        g_assert_cmpuint(cred.uid, ==, 0);
+    }
+
+    g_free(syspath);
+    udev_monitor_unref(mon);
+    udev_unref(udev);
+}
+
 static void
 t_testbed_uevent_gudev(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -1004,6 +1117,19 @@ t_testbed_add_from_string_errors(UMockdevTestbedFixture * fixture, UNUSED_DATA)
     g_assert_error(error, UMOCKDEV_ERROR, UMOCKDEV_ERROR_PARSE);
     g_clear_error(&error);
 
+    /* invalid hex digit, in the scalar tail and in a SIMD block */
+    g_assert(!umockdev_testbed_add_from_string(fixture->testbed,
+					       "P: /devices/dev1\n"
+					       "E: SUBSYSTEM=usb\n" "H: binary_attr=41FG\n", &error));
+    g_assert_error(error, UMOCKDEV_ERROR, UMOCKDEV_ERROR_PARSE);
+    g_clear_error(&error);
+    g_assert(!umockdev_testbed_add_from_string(fixture->testbed,
+					       "P: /devices/dev1\n"
+					       "E: SUBSYSTEM=usb\n"
+					       "H: binary_attr=00112233445566778899AABBCCDDEEFF0011223344:566778899AABBCCDDEEFF\n", &error));
+    g_assert_error(error, UMOCKDEV_ERROR, UMOCKDEV_ERROR_PARSE);
+    g_clear_error(&error);
+
     /* invalid device path */
     g_assert(!umockdev_testbed_add_from_string(fixture->testbed, "P: /dev1\n" "E: SUBSYSTEM=usb\n", &error));
     g_assert_error(error, UMOCKDEV_ERROR, UMOCKDEV_ERROR_VALUE);
@@ -1015,6 +1141,28 @@ t_testbed_add_from_string_errors(UMockdevTestbedFixture * fixture, UNUSED_DATA)
     g_clear_error(&error);
 }
 
+static void
+t_testbed_load_ioctl_spi_invalid_hex(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+    if (g_test_subprocess()) {
+	GError *error = NULL;
+	g_autofree gchar *path = g_build_filename(fixture->root_dir, "spi.ioctl", NULL);
+
+	/* invalid digit in a SIMD block */
+	g_assert(g_file_set_contents(path,
+				     "@DEV /dev/spidev0.0 (SPI)\n"
+				     "TW 03ff\n"
+				     "TW 00112233445566778899AABBCCDDEEFF00112233x45566778899001122334455\n",
+				     -1, &error));
+	g_assert_no_error(error);
+	umockdev_testbed_load_ioctl(fixture->testbed, "/dev/spidev0.0", path, &error);
+	return;
+    }
+    g_test_trap_subprocess(NULL, 0, 0);
+    g_test_trap_assert_failed();
+    g_test_trap_assert_stderr("*could not decode HEX string*");
+}
+
 static void
 t_testbed_add_from_file(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 {
@@ -2547,6 +2695,8 @@ main(int argc, char **argv)
     g_test_add("/umockdev-testbed/add_from_string_errors",
 	       UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_add_from_string_errors, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/load_ioctl_spi_invalid_hex", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_load_ioctl_spi_invalid_hex, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/add_from_file", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_add_from_file, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/libc", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
@@ -2557,6 +2707,10 @@ main(int argc, char **argv)
 	       t_testbed_uevent_libudev, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/uevent/libudev-filter", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_uevent_libudev_filter, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/uevent/libudev-filter-tag", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_uevent_libudev_filter_tag, t_testbed_fixture_teardown);
+    g_test_add("/umockdev-testbed/uevent/recvmmsg", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
+	       t_testbed_uevent_recvmmsg, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/uevent/gudev", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,
 	       t_testbed_uevent_gudev, t_testbed_fixture_teardown);
     g_test_add("/umockdev-testbed/uevent/no_listener", UMockdevTestbedFixture, NULL, t_testbed_fixture_setup,